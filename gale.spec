@@ -82,6 +82,7 @@ if [ -d $RPM_BUILD_ROOT ] && [ ! -L $RPM_BUILD_ROOT ]; then rm -rf $RPM_BUILD_RO
 %files
 %defattr(-,root,root)
 /usr/bin/gkgen
+/usr/bin/gkimport
 /usr/bin/gkinfo
 /usr/bin/gksign
 /usr/bin/gsend
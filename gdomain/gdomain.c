@@ -11,7 +11,7 @@ static struct gale_text subscriptions;
 static struct gale_location *domain_location = NULL;
 
 static void *on_error_packet(struct gale_packet *pkt,void *x) {
-	link_put(line,pkt);
+	if (NULL != pkt) link_put(line,pkt);
 	return OOP_CONTINUE;
 }
 
@@ -32,7 +32,7 @@ static void *on_connected(struct gale_server *server,
 }
 
 static void *on_response(struct gale_packet *pk,void *x) {
-	link_put(line,pk);
+	if (NULL != pk) link_put(line,pk);
 	return OOP_CONTINUE;
 }
 
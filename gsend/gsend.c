@@ -74,6 +74,8 @@ static void *on_pack(struct gale_packet *pack,void *user) {
 	struct gale_link *link;			/* Physical connection */
 	struct gale_server *server;		/* Logical link */
 
+	if (NULL == pack) gale_alert(GALE_ERROR,G_("could not pack message"),0);
+
 	/* Open a connection to the server; don't subscribe to anything. */
 	link = new_link(oop);
 	server = gale_make_server(oop,link,null_text,0);
@@ -74,12 +74,12 @@ int is_queueing = 0;
 
 /* Send a message once it's all packed. */
 static void *on_put(struct gale_packet *packet,void *user) {
-	link_put(conn,packet);
+	if (NULL != packet) link_put(conn,packet);
 	return OOP_CONTINUE;
 }
 
 static void *on_will(struct gale_packet *packet,void *user) {
-	link_will(conn,packet);
+	if (NULL != packet) link_will(conn,packet);
 	return OOP_CONTINUE;
 }
 
@@ -249,6 +249,7 @@ static void *on_status(int status,void *x) {
 static void *show_message(struct gale_message *msg) {
 	/* Lots of crap.  Discussed below, where they're used. */
 	struct gale_environ *save = gale_save_environ();
+	const struct gale_group_index *index;
 	struct gale_group group;
 	struct gale_fragment f;
 	struct gale_text body = null_text;
@@ -256,6 +257,7 @@ static void *show_message(struct gale_message *msg) {
 	char *szbody = NULL;
 
 	if (NULL == msg) return next_message();
+	index = gale_make_group_index(msg->data);
 
 #ifndef NDEBUG
 	/* In debug mode, restart if we get a properly authorized message. 
@@ -275,7 +277,7 @@ static void *show_message(struct gale_message *msg) {
 	if (do_keys 
 	&&  NULL != key_location
 	&&  NULL != user_location
-	&&  gale_group_lookup(msg->data,G_("question.key"),frag_text,&f)
+	&&  gale_index_lookup(index,GA_("question.key"),frag_text,&f)
 	&& !gale_text_compare(f.value.text,gale_location_name(user_location))) {
 		f.name = G_("answer/key");
 		f.type = frag_data;
@@ -289,8 +291,8 @@ static void *show_message(struct gale_message *msg) {
 			G_("\"")),0);
 	} else 
 	if (do_verbose
-	&& (gale_group_lookup(msg->data,G_("question.key"),frag_text,&f)
-	||  gale_group_lookup(msg->data,G_("question/key"),frag_text,&f))) {
+	&& (gale_index_lookup(index,GA_("question.key"),frag_text,&f)
+	||  gale_index_lookup(index,GA_("question/key"),frag_text,&f))) {
 		gale_alert(GALE_WARNING,gale_text_concat(3,
 			G_("ignoring key request for \""),
 			f.value.text,
@@ -303,7 +305,7 @@ static void *show_message(struct gale_message *msg) {
 	set_list(G_("GALE_TO"),msg->to);
 
 	/* Go through the message fragments. */
-	group = msg->data;
+	group = gale_index_group(index);
 	while (!gale_group_null(group)) {
 		struct gale_fragment frag = gale_group_first(group);
 		struct gale_text base,name,value;
@@ -314,14 +316,14 @@ static void *show_message(struct gale_message *msg) {
 
 		/* Process receipts, if we do. */
 		if (do_presence && frag.type == frag_text
-		&& !gale_text_compare(frag.name,G_("question.receipt")))
+		&& !gale_text_compare(frag.name,GA_("question.receipt")))
 			gale_find_exact_location(source,
 				frag.value.text,
 				on_receipt,NULL);
 
 		/* Save the message body for later. */
 		if (frag.type == frag_text
-		&&  !gale_text_compare(frag.name,G_("message/body"))) {
+		&&  !gale_text_compare(frag.name,GA_("message/body"))) {
 			body = frag.value.text;
 			continue;
 		}
@@ -64,6 +64,26 @@ struct gale_packet {
 	struct gale_data content;
 };
 
+/** One category from a packet's routing string.
+ *  \sa gale_packet_categories() */
+struct gale_category {
+	/** The category as it appears in the routing string. */
+	struct gale_text text;
+	/** The category without its "+" or "-" prefix.  A directed category
+	 *  with no path ("@host") gets a trailing slash. */
+	struct gale_text base;
+	/** For directed ("@host/...") categories, the host; else null_text. */
+	struct gale_text host;
+	/** Zero if the category was marked with "-". */
+	int flag;
+	/** Nonzero if the category is directed (\a base starts with "@"). */
+	int directed;
+};
+
+void gale_category_parse(struct gale_text text,struct gale_category *cat);
+const struct gale_category *gale_packet_categories(
+	struct gale_packet *,int *count);
+
 /** \name Gale Protocol 
  *  The ::gale_link structure represents the protocol state of an active 
  *  connection to a Gale server; it depends on a physical connection
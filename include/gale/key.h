@@ -41,7 +41,8 @@ struct gale_time gale_key_time(const struct gale_key_assertion *);
  *  \return Liboop continuation code (usually OOP_CONTINUE). */
 typedef void *gale_key_call(oop_source *oop,struct gale_key *key,void *user);
 
-enum { search_private = 1, search_slow = 2, search_all = 3, search_harder = 4 };
+enum { search_private = 1, search_slow = 2, search_all = 3, search_harder = 4,
+       search_early = 8 };
 void gale_key_search(oop_source *source,
 	struct gale_key *,int flags,
 	gale_key_call *,void *user);
@@ -70,4 +71,7 @@ void gale_key_add_hook(gale_key_hook *,void *user);
 void gale_key_hook_done(oop_source *,
 	struct gale_key *,struct gale_key_request *);
 
+int gale_key_db_add(struct gale_text db,struct gale_data,struct gale_time);
+int gale_key_db_compact(struct gale_text db);
+
 #endif
@@ -136,6 +136,42 @@ void gale_finalizer(void *ptr,void (*fun)(void *ptr,void *user),void *user);
  *  For debugging.  Call this if you're worried the heap might be corrupt. */
 void gale_check_mem(void);
 
+/** Number of buckets in gale_memory_stats::pause_histogram. */
+#define GALE_MEMORY_BUCKETS 12
+
+/** Garbage collector statistics.
+ *  Collector behavior can be tuned with GALE_GC_INCREMENTAL (nonzero to 
+ *  enable incremental collection), GALE_GC_DIVISOR (the free space divisor;
+ *  larger values collect more often in a smaller heap) and GALE_GC_MARKERS
+ *  (the number of parallel marker threads; this one must be set in the
+ *  environment, not a configuration file).
+ *  \sa gale_memory_stats() */
+struct gale_memory_stats {
+	/** Number of collections since startup. */
+	unsigned long collections;
+	/** Total time spent in collection, in microseconds. */
+	unsigned long pause_total;
+	/** Longest single collection, in microseconds. */
+	unsigned long pause_max;
+	/** Collection pauses by duration: bucket \e i counts pauses shorter
+	 *  than 2^i milliseconds; the last bucket counts everything longer. */
+	unsigned long pause_histogram[GALE_MEMORY_BUCKETS];
+	/** Size of the collected heap, in bytes. */
+	size_t heap_size;
+	/** Free space in the heap, in bytes. */
+	size_t free_bytes;
+	/** Bytes allocated since the last collection. */
+	size_t bytes_since_gc;
+	/** Bytes allocated since startup. */
+	size_t total_bytes;
+};
+
+/** Get garbage collector statistics.
+ *  The same figures appear in the SIGUSR2 report.
+ *  \param stats Structure to fill in.  Pause times are only available 
+ *         when the collector supports collection event callbacks. */
+void gale_memory_stats(struct gale_memory_stats *stats);
+
 /** Allocate an object.
  *  \param x Uninitialized pointer to an object (will be set).
  *  \sa gale_malloc() */
@@ -161,6 +197,37 @@ struct gale_data gale_data_copy(struct gale_data data);
  *  greater than zero if \a a \> \a b. */
 int gale_data_compare(struct gale_data a,struct gale_data b);
 
+struct gale_slab;
+
+/** Allocation statistics for a ::gale_slab pool.
+ *  \sa gale_slab_stats() */
+struct gale_slab_stats {
+	/** Object size, in bytes (after alignment). */
+	size_t size;
+	/** Number of chunks obtained from the underlying allocator. */
+	unsigned long chunks;
+	/** Number of chunks given back once all their objects were freed. */
+	unsigned long released;
+	/** Number of objects allocated. */
+	unsigned long allocated;
+	/** Number of allocations satisfied from the free list. */
+	unsigned long reused;
+	/** Number of objects returned with gale_slab_free(). */
+	unsigned long freed;
+};
+
+struct gale_slab *gale_make_slab(struct gale_text name,size_t size);
+void *gale_slab_alloc(struct gale_slab *slab);
+void gale_slab_free(struct gale_slab *slab,void *obj);
+void gale_slab_stats(const struct gale_slab *slab,struct gale_slab_stats *);
+
+/** Allocate an object from a pool.
+ *  \param slab Pool from gale_make_slab(), which must have been created
+ *         for objects of this size.
+ *  \param x Uninitialized pointer to an object (will be set).
+ *  \sa gale_slab_alloc() */
+#define gale_slab_create(slab,x) ((x) = gale_slab_alloc(slab))
+
 struct gale_ptr;
 
 /** Create a weak pointer.
@@ -205,6 +272,27 @@ struct gale_encoding;
 /** \internal */
 struct gale_text _gale_text_literal(const wchar_t *,size_t len); /* internal */
 
+/** Like G_(), but the text is interned (see gale_text_intern()).
+ *  Use this for literals which are compared often, such as fragment names
+ *  passed to gale_group_lookup().  
+ *  \code struct gale_text body = GA_("message/body"); \endcode */
+#define GA_(x) (_gale_atom_literal(L##x,sizeof(L##x) / sizeof(wch) - 1))
+
+/** \internal */
+struct gale_text _gale_atom_literal(const wchar_t *,size_t len); /* internal */
+
+/** An interned string.
+ *  \sa gale_atom() */
+struct gale_atom;
+
+const struct gale_atom *gale_atom(struct gale_text text);
+const struct gale_atom *gale_atom_permanent(struct gale_text text);
+struct gale_text gale_atom_text(const struct gale_atom *atom);
+u32 gale_atom_hash(const struct gale_atom *atom);
+struct gale_data gale_atom_key(const struct gale_atom *atom);
+struct gale_text gale_text_intern(struct gale_text text);
+struct gale_text gale_text_interned(struct gale_text text);
+
 struct gale_text gale_text_concat(int count,...);
 struct gale_text gale_text_concat_array(int count,struct gale_text *array);
 
@@ -221,6 +309,27 @@ void gale_text_accumulate(struct gale_text_accumulator *,struct gale_text);
 int gale_text_accumulator_empty(const struct gale_text_accumulator *);
 struct gale_text gale_text_collect(const struct gale_text_accumulator *);
 
+/** A growable buffer for building a string piece by piece.
+ *  Unlike repeated gale_text_concat(), appending takes constant time
+ *  (amortized) per character.
+ *  \code
+ *  struct gale_text_builder b = null_builder;
+ *  gale_text_append(&b,G_("foo"));
+ *  gale_text_append(&b,G_("bar"));
+ *  assert(0 == gale_text_compare(gale_text_build(&b),G_("foobar")));
+ *  \endcode
+ *  \sa gale_text_append(), gale_text_build() */
+struct gale_text_builder {
+	/** \internal */
+	wch *buffer;
+	size_t len,alloc;
+};
+
+/** An empty builder which you can use to initialize new builders. */
+extern const struct gale_text_builder null_builder;
+void gale_text_append(struct gale_text_builder *,struct gale_text);
+struct gale_text gale_text_build(const struct gale_text_builder *);
+
 struct gale_text gale_text_left(struct gale_text,int len);
 struct gale_text gale_text_right(struct gale_text,int len);
 
@@ -239,8 +348,9 @@ struct gale_data gale_text_as_data(struct gale_text);
 struct gale_text gale_text_from_data(struct gale_data);
 
 /** Initialize a character encoding translator.
- *  We use the iconv library, so \a enc can be any encoding supported by
- *  iconv ("UTF-8", "ISO-8859-1", "BIG5", etc). 
+ *  UTF-8 and ASCII are handled directly; for anything else we use the
+ *  iconv library, so \a enc can be any encoding supported by iconv
+ *  ("ISO-8859-1", "BIG5", etc). 
  *  Normally, you don't create gale_encoding objects yourself, but use the
  *  ones in ::gale_global (see globals.h). 
  *  \sa gale_text_from(), gale_text_to() */
@@ -268,13 +378,23 @@ char *gale_text_to(struct gale_encoding *enc,struct gale_text str);
 struct gale_map;
 
 /** Create a key-value lookup table.
+ *  The table is hashed, so gale_map_walk() visits its entries in an 
+ *  arbitrary (but consistent) order.
  *  \param weak If nonzero, create a 'weak map' using weak pointers.
  *  Objects in a weak map will not be kept alive by the map alone.
  *  If they are garbage collected, they will be removed from the map.
  *  \return The new, empty map.
- *  \sa gale_map_add(), gale_map_find(), gale_map_walk() */
+ *  \sa gale_make_ordered_map(), gale_map_add(), gale_map_find(), 
+ *  gale_map_walk() */
 struct gale_map *gale_make_map(int weak);
 
+/** Create a key-value lookup table which keeps its keys sorted.
+ *  Like gale_make_map(), but gale_map_walk() visits entries in key order.
+ *  Lookups are slower, so only use this when the order matters.
+ *  \param weak If nonzero, create a 'weak map' using weak pointers.
+ *  \return The new, empty map. */
+struct gale_map *gale_make_ordered_map(int weak);
+
 /** Add a key-value pair to a map.
  *  \param map The map to add to.
  *  \param key The key to use.  If another entry exists with the same key,
@@ -291,6 +411,8 @@ void *gale_map_find(const struct gale_map *map,struct gale_data key);
 
 /** Traverse a map in order.
  *  This function finds the first key/data entry where key > \a *after.
+ *  (For maps from gale_make_map(), "order" is the map's internal order,
+ *  but the empty key still comes first.)
  *  If \a after is NULL, it finds the first entry in the map.
  *  This example counts the number of keys in a map:
  *  \code
@@ -306,6 +428,49 @@ void *gale_map_find(const struct gale_map *map,struct gale_data key);
  *  \return Nonzero if an entry was found, zero otherwise. */
 int gale_map_walk(const struct gale_map *map,const struct gale_data *after,
                   struct gale_data *key,void **data);
+
+/** Iteration state for gale_map_next().
+ *  Allocate one of these (usually on the stack) and initialize it with
+ *  gale_map_begin().  The fields are private. */
+struct gale_map_cursor {
+	/** \internal */
+	const struct gale_map *map;
+	const void *node;
+	unsigned long generation;
+	int bucket,started;
+	struct gale_data key;
+	void **stack;
+	int depth,alloc;
+};
+
+/** Start iterating over a map.
+ *  Entries are visited in the same order as gale_map_walk(), but each step
+ *  takes constant time (amortized).  The map may be modified during the
+ *  iteration; entries added after the cursor's position will be visited,
+ *  and entries removed before it is reached will not.
+ *  \code
+ *  struct gale_map_cursor cursor;
+ *  struct gale_data key;
+ *  void *data;
+ *  gale_map_begin(&cursor,map);
+ *  while (gale_map_next(&cursor,&key,&data)) ...;
+ *  \endcode
+ *  \param cursor The cursor to initialize.
+ *  \param map The map to traverse. */
+void gale_map_begin(struct gale_map_cursor *cursor,const struct gale_map *map);
+
+/** Advance a map cursor to the next entry.
+ *  \param cursor A cursor initialized by gale_map_begin().
+ *  \param key Pointer to a variable to return the entry's key in, or NULL.
+ *  \param data Pointer to a variable to return the entry's data in, or NULL.
+ *  \return Nonzero if an entry was found, zero at the end of the map. */
+int gale_map_next(struct gale_map_cursor *cursor,
+                  struct gale_data *key,void **data);
+
+/** Check whether a map is empty.
+ *  \param map The map to examine.
+ *  \return Nonzero if the map has no entries. */
+int gale_map_empty(const struct gale_map *map);
 /*@}*/
 
 /** \name Time Processing */
@@ -416,6 +581,43 @@ int gale_group_lookup(
         enum gale_fragment_type type,
 	struct gale_fragment *frag);
 
+struct gale_group_index;
+
+/** Index a group for fast lookup.
+ *  Building the index walks the group once; after that, each lookup takes
+ *  constant time.  Use this when a group will be searched many times.
+ *  The index is not affected by later changes to the group.
+ *  \param group The group to index.
+ *  \return The new index. */
+struct gale_group_index *gale_make_group_index(struct gale_group group);
+
+/** Find a fragment in an indexed group by name.
+ *  Like gale_group_lookup(), but in constant time.
+ *  \param index Index from gale_make_group_index().
+ *  \param name The name of the fragment to find.
+ *  \param type The type of the fragment to find.
+ *  \param frag Pointer to an uninitialized fragment.
+ *  \return Nonzero if the fragment was found (and stored in \a frag). */
+int gale_index_lookup(
+	const struct gale_group_index *index,
+	struct gale_text name,enum gale_fragment_type type,
+	struct gale_fragment *frag);
+
+/** Find all the fragments in an indexed group with some name.
+ *  \param index Index from gale_make_group_index().
+ *  \param name The name of the fragments to find.
+ *  \param type The type of the fragments to find.
+ *  \param frags Set to the matching fragments, in group order.
+ *  \return The number of matching fragments. */
+int gale_index_find(
+	const struct gale_group_index *index,
+	struct gale_text name,enum gale_fragment_type type,
+	const struct gale_fragment **frags);
+
+/** Return the group an index was built from, flattened into a single
+ *  array (so gale_group_rest() is cheap). */
+struct gale_group gale_index_group(const struct gale_group_index *index);
+
 /** Return a human-readable version of the fragment (for debugging). */
 struct gale_text gale_print_fragment(struct gale_fragment,int indent);
 
@@ -498,6 +700,66 @@ size_t gale_fragment_size(struct gale_fragment);
 int gale_unpack_group(struct gale_data *,struct gale_group *);
 void gale_pack_group(struct gale_data *,struct gale_group);
 size_t gale_group_size(struct gale_group);
+
+/** Serialize a group without building it in memory first.
+ *  The packed group (as from gale_pack_group()) is passed to \a func in
+ *  pieces.  Large data values are passed as they are, without copying.
+ *  \param group The group to serialize.
+ *  \param func Function to call with each piece of output.  The data is
+ *         only valid until \a func returns.
+ *  \param user User-defined parameter to pass to \a func. */
+void gale_write_group(struct gale_group group,
+	void (*func)(struct gale_data,void *),void *user);
+/*@}*/
+
+/** \name Packed Fragment Views
+ *  These functions examine a packed group in place, without decoding (or
+ *  copying) any more of it than necessary.  Data is borrowed from the 
+ *  packed buffer rather than copied, so the buffer must not change while
+ *  the results are in use. */
+/*@{*/
+
+/** A fragment within a packed group. */
+struct gale_fragment_view {
+	/** Type of the fragment. */
+	enum gale_fragment_type type;
+	/** Name of the fragment, still packed; see gale_view_name(). */
+	struct gale_data name;
+	/** Value of the fragment, still packed; see gale_view_fragment(). */
+	struct gale_data value;
+};
+
+/** Step to the next fragment in a packed group.
+ *  \param data Packed group; advanced past the fragment.
+ *  \param view Set to the fragment.
+ *  \return Nonzero if there was another fragment. */
+int gale_view_next(struct gale_data *data,struct gale_fragment_view *view);
+
+/** Find a fragment in a packed group by name, without decoding the group.
+ *  \param group Packed group to search.
+ *  \param name The name of the fragment to find.
+ *  \param type The type of the fragment to find.
+ *  \param view Set to the first matching fragment.
+ *  \return Nonzero if the fragment was found. */
+int gale_view_lookup(
+	struct gale_data group,
+	struct gale_text name,enum gale_fragment_type type,
+	struct gale_fragment_view *view);
+
+/** Return the (interned) name of a fragment view. */
+struct gale_text gale_view_name(const struct gale_fragment_view *view);
+
+/** Decode a fragment view.  Data values point into the packed buffer;
+ *  text is decoded now.
+ *  \param view Fragment from gale_view_next() or gale_view_lookup().
+ *  \param frag Set to the decoded fragment. */
+void gale_view_fragment(
+	const struct gale_fragment_view *view,
+	struct gale_fragment *frag);
+
+/** Like gale_unpack_group(), but data fragments point into the packed
+ *  buffer instead of being copied. */
+int gale_view_group(struct gale_data *data,struct gale_group *group);
 /*@}*/
 
 /** \name File and Directory Manipulation */
@@ -0,0 +1,71 @@
+#include "gale/all.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(void) {
+	fprintf(stderr,
+		"%s\n"
+		"usage: gkimport [-h] [-d db] directory ...\n"
+		"flags: -h          Display this message\n"
+		"       -d db       Key database to use (default $GALE_KEY_DB)\n"
+		,GALE_BANNER);
+	exit(1);
+}
+
+static int added = 0,skipped = 0;
+
+static void import(struct gale_text db,struct gale_text dir) {
+	DIR * const pdir = opendir(gale_text_to(gale_global->enc_filesys,dir));
+	struct dirent *de;
+
+	if (NULL == pdir) {
+		gale_alert(GALE_WARNING,dir,errno);
+		return;
+	}
+
+	while (NULL != (de = readdir(pdir))) {
+		struct gale_file_state *state;
+		struct gale_data key;
+		if ('.' == de->d_name[0]) continue;
+
+		key = gale_read_file(dir_file(dir,gale_text_from(
+			gale_global->enc_filesys,de->d_name,-1)),65536,0,&state);
+		if (0 != key.l && NULL != state
+		&&  gale_key_db_add(db,key,gale_get_file_time(state)))
+			++added;
+		else
+			++skipped;
+	}
+
+	closedir(pdir);
+}
+
+int main(int argc,char *argv[]) {
+	struct gale_text db;
+	int arg;
+
+	gale_init("gkimport",argc,argv);
+	db = gale_var(G_("GALE_KEY_DB"));
+
+	while (EOF != (arg = getopt(argc,argv,"hd:"))) switch (arg) {
+	case 'd': db = gale_text_from(gale_global->enc_cmdline,optarg,-1);
+	          break;
+	default: usage();
+	}
+
+	if (0 == db.l || optind == argc) usage();
+	for (; optind != argc; ++optind)
+		import(db,gale_text_from(gale_global->enc_cmdline,argv[optind],-1));
+
+	if (!gale_key_db_compact(db))
+		gale_alert(GALE_ERROR,G_("could not compact key database"),0);
+
+	fprintf(stderr,"gkimport: %d keys added, %d files skipped\n",
+		added,skipped);
+	return 0;
+}
@@ -41,7 +41,7 @@ void print(const struct gale_key_assertion *ass) {
 		gale_print(stdout,0,gale_key_name(owner));
 		gale_print(stdout,0,G_(">"));
 
-		if (gale_group_lookup(data,G_("key.owner"),frag_text,&frag)
+		if (gale_group_lookup(data,GA_("key.owner"),frag_text,&frag)
 		&&  frag.value.text.l > 0) {
 			gale_print(stdout,0,G_(" ("));
 			gale_print(stdout,0,frag.value.text);
@@ -87,9 +87,11 @@ void *on_location(struct gale_text name,struct gale_location *loc,void *user) {
 		if (NULL == members)
 			gale_print(stdout,0,G_(">: *everyone*.\n"));
 		else {
-			struct gale_data key = null_data;
+			struct gale_map_cursor cursor;
+			struct gale_data key;
 			gale_print(stdout,0,G_(">:\n"));
-			while (gale_map_walk(members,&key,&key,NULL)) {
+			gale_map_begin(&cursor,members);
+			while (gale_map_next(&cursor,&key,NULL)) {
 				gale_print(stdout,0,gale_text_from_data(key));
 				gale_print(stdout,0,G_("\n"));
 			}
@@ -17,4 +17,10 @@ struct gale_location *client_i_get(struct gale_text name);
 struct gale_text client_i_encode(const struct gale_location *);
 struct gale_text client_i_decode(struct gale_text routing);
 
+/* Expensive work is run off the event loop; see client_work.c. */
+typedef void client_i_work_call(void *user);
+typedef void *client_i_done_call(oop_source *,void *user);
+void client_i_work(oop_source *,struct gale_text queue,
+	client_i_work_call *work,client_i_done_call *done,void *user);
+
 #endif
@@ -51,13 +51,13 @@ static void follow_key(oop_source *oop,const struct find *find) {
 
 	if (!gale_group_lookup(
 		gale_key_data(gale_key_public(find->loc->key,find->now)),
-		G_("key.redirect"),frag_text,&frag)
+		GA_("key.redirect"),frag_text,&frag)
 	|| (NULL != find->map && NULL != gale_map_find(find->map,name_data)))
 	{
 		key_i_graph(oop,
 			find->loc->key,
 			find->flags,
-			G_("key.member"),
+			GA_("key.member"),
 			on_graph,(void *) find);
 		return;
 	}
@@ -218,13 +218,14 @@ const struct gale_map *gale_location_members(struct gale_location *loc) {
  *  \param loc Location to examine.
  *  \return Nonzero if we can subscribe to this location. */
 int gale_location_receive_ok(struct gale_location *loc) {
-	struct gale_data key = null_data;
+	struct gale_map_cursor cursor;
 	void *datum;
 
 	if (loc->members_null
 	||  NULL != gale_key_private(loc->key)) return 1;
 
-	while (gale_map_walk(loc->members,&key,&key,&datum)) {
+	gale_map_begin(&cursor,loc->members);
+	while (gale_map_next(&cursor,NULL,&datum)) {
 		struct gale_key *member = (struct gale_key *) datum;
 		if (NULL != gale_key_private(member)) return 1;
 	}
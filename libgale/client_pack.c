@@ -3,13 +3,47 @@
 #include "gale/crypto.h"
 
 #include "client_i.h"
+#include "crypto_i.h"
 
 #include <assert.h>
 
+struct pack {
+	gale_call_packet *call;
+	void *user;
+	struct gale_group data;
+	int num_from,num_to;
+	struct gale_group *from,*to;
+	struct gale_packet *packet;
+};
+
+/* Runs off the event loop; only touches the job itself.
+   If signing or encryption fails, the message is dropped. */
+static void pack_work(void *x) {
+	struct pack * const job = (struct pack *) x;
+
+	if (!gale_crypto_sign(job->num_from,job->from,&job->data)
+	||  (job->num_to > 0 && !gale_crypto_seal(job->num_to,job->to,&job->data))) {
+		job->packet = NULL;
+		return;
+	}
+
+	job->packet->content.p = gale_malloc(gale_group_size(job->data));
+	job->packet->content.l = 0;
+	gale_pack_group(&job->packet->content,job->data);
+}
+
+static void *pack_done(oop_source *oop,void *x) {
+	struct pack * const job = (struct pack *) x;
+	return job->call(job->packet,job->user);
+}
+
 /** Pack a Gale message into a raw "packet".
  *  Packing may require location lookups, so this function starts
  *  the process in the background, using liboop to invoke a callback
- *  when the process is complete.
+ *  when the process is complete.  Signing and encryption happen off the
+ *  event loop; messages from the same sender (or, if unsigned, to the
+ *  same recipients) are delivered in order.  If the message can't be
+ *  signed or encrypted, \a func is called with NULL instead.
  *  \param oop Liboop event source to use.
  *  \param msg Message to pack.
  *  \param func Function to call with packed message.
@@ -19,18 +53,26 @@ void gale_pack_message(oop_source *oop,
         struct gale_message *msg,
         gale_call_packet *call,void *user)
 {
-	struct gale_group data = msg->data;
 	const struct gale_time now = gale_time_now();
+	struct gale_text queue = null_text;
+	struct pack *job;
+
+	gale_create(job);
+	job->call = call;
+	job->user = user;
+	job->data = msg->data;
+	job->num_from = job->num_to = 0;
+
+	/* Collect the keys here; the key database isn't thread-safe. */
 
 	/* TODO: blah... private keys */
 	{
-		int i,num_from = 0;
-		struct gale_group *keys;
-		while (NULL != msg->from && NULL != msg->from[num_from]) 
-			++num_from;
-		gale_create_array(keys,num_from);
-		for (i = 0; i < num_from; ++i) {
-			keys[i] = gale_key_data(
+		int i;
+		while (NULL != msg->from && NULL != msg->from[job->num_from]) 
+			++job->num_from;
+		gale_create_array(job->from,job->num_from);
+		for (i = 0; i < job->num_from; ++i) {
+			job->from[i] = gale_key_data(
 				gale_key_private(msg->from[i]->key));
 			if (msg->from[i]->at_part < 0) {
 				struct gale_fragment frag;
@@ -38,12 +80,12 @@ void gale_pack_message(oop_source *oop,
 				frag.name = G_("key.source");
 				frag.value.data = gale_key_raw(
 					gale_key_public(msg->from[i]->key,now));
-				gale_group_replace(&keys[i],frag);
+				gale_group_replace(&job->from[i],frag);
 			}
 		}
 
-		if (!gale_crypto_sign(num_from,keys,&data))
-			/* TODO: handle errors */;
+		if (job->num_from > 0) 
+			queue = gale_key_name(msg->from[0]->key);
 	}
 
 	/* TODO: check if msg->to is empty */
@@ -52,49 +94,44 @@ void gale_pack_message(oop_source *oop,
 
 		while (!is_null && NULL != msg->to && NULL != msg->to[i]) {
 			struct gale_location * const loc = msg->to[i++];
-			struct gale_data key = null_data;
-			void *data;
+			struct gale_map_cursor cursor;
 
 			if (loc->members_null) {
 				is_null = 1;
 				continue;
 			}
 
-			while (gale_map_walk(loc->members,&key,&key,&data))
+			gale_map_begin(&cursor,loc->members);
+			while (gale_map_next(&cursor,NULL,NULL))
 				++num_to;
 		}
 
 		if (!is_null && num_to > 0) {
-			struct gale_group *keys;
 			int j = 0;
 
-			gale_create_array(keys,num_to);
+			gale_create_array(job->to,num_to);
 			for (i = 0; NULL != msg->to[i]; ++i) {
 				struct gale_location * const loc = msg->to[i];
-				struct gale_data key = null_data;
+				struct gale_map_cursor cursor;
 				void *data;
 
-				while (gale_map_walk(loc->members,&key,&key,&data))
-					keys[j++] = gale_key_data(gale_key_public((struct gale_key *) data,now));
+				gale_map_begin(&cursor,loc->members);
+				while (gale_map_next(&cursor,NULL,&data))
+					job->to[j++] = gale_key_data(gale_key_public((struct gale_key *) data,now));
 			}
 
 			assert(j == num_to);
-			if (!gale_crypto_seal(num_to,keys,&data))
-				/* TODO: handle errors */;
+			job->num_to = num_to;
 		}
 	}
 
-	{
-		struct gale_packet *pack;
-		gale_create(pack);
-		pack->routing = gale_pack_subscriptions(msg->to,NULL);
-		pack->content.p = gale_malloc(gale_group_size(data));
-		pack->content.l = 0;
-		gale_pack_group(&pack->content,data);
-
-		/* TODO: delay this */
-		call(pack,user);
-	}
+	gale_create(job->packet);
+	job->packet->routing = gale_pack_subscriptions(msg->to,NULL);
+	if (0 == queue.l) queue = gale_text_concat(2,G_(" to "),job->packet->routing);
+
+	/* Pick up GALE_ENCRYPTION here, since the worker can't. */
+	if (job->num_to > 0) crypto_i_seal_init();
+	client_i_work(oop,queue,pack_work,pack_done,job);
 }
 
 /** Pack a list of locations into a subscription expression.
@@ -5,7 +5,7 @@ struct gale_error_queue {
 	oop_source *oop;
 	gale_call_message *call;
 	void *data;
-	struct gale_text buffer;
+	struct gale_text_builder buffer;
 	struct gale_location *target;
 	int is_active;
 };
@@ -16,7 +16,7 @@ static void activate(struct gale_error_queue *queue) {
 	const int is_active = 
 		  (NULL != queue->call 
 		&& NULL != queue->target 
-		&&    0 != queue->buffer.l);
+		&&    0 != gale_text_build(&queue->buffer).l);
 	if (queue->is_active && !is_active)
 		queue->oop->cancel_time(queue->oop,OOP_TIME_NOW,on_kick,queue);
 	else if (!queue->is_active && is_active)
@@ -38,7 +38,7 @@ static void *on_kick(oop_source *oop,struct timeval when,void *x) {
 
 	frag.type = frag_text;
 	frag.name = G_("message/body");
-	frag.value.text = queue->buffer;
+	frag.value.text = gale_text_build(&queue->buffer);
 	gale_group_add(&msg->data,frag);
 
 	gale_add_id(&msg->data,G_("daemon"));
@@ -51,7 +51,7 @@ static void *on_kick(oop_source *oop,struct timeval when,void *x) {
 		G_(" ("),gale_var(G_("LOGNAME")),G_(")"));
 	gale_group_add(&msg->data,frag);
 
-	queue->buffer = null_text;
+	queue->buffer = null_builder;
 	activate(queue);
 	return queue->call(msg,queue->data);
 }
@@ -75,7 +75,7 @@ struct gale_error_queue *gale_make_queue(oop_source *oop) {
 	gale_create(queue);
 	queue->oop = oop;
 	queue->call = NULL;
-	queue->buffer = null_text;
+	queue->buffer = null_builder;
 	queue->target = NULL;
 	queue->is_active = 0;
 
@@ -106,7 +106,8 @@ void gale_on_queue(
  *  \sa gale_make_queue(), gale_on_queue() */
 void *gale_queue_error(int severity,struct gale_text msg,void *queue) {
 	struct gale_error_queue * const q = (struct gale_error_queue *) queue;
-	q->buffer = gale_text_concat(3,q->buffer,msg,G_("\n"));
+	gale_text_append(&q->buffer,msg);
+	gale_text_append(&q->buffer,G_("\n"));
 	activate(q);
 	return OOP_CONTINUE;
 }
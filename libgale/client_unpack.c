@@ -5,15 +5,104 @@
 #include "client_i.h"
 
 #include <assert.h>
+#include <string.h>
 
 struct unpack {
+	oop_source *oop;
 	gale_call_message *func;
 	void *user;
 	struct gale_message *message;
 	int from_count,to_count;
 	int target_count,count;
+
+	struct order *order;
+	struct unpack *next;
+	struct gale_message *result;
+	int is_done;
+};
+
+/* Lookups and background crypto can finish in any order, but each caller
+   (func and user) gets its messages in the order they arrived.  A caller's
+   messages in progress are queued; a finished message waits until those
+   ahead of it have been delivered. */
+
+struct order {
+	struct gale_data id;
+	struct unpack *head,*tail;
+	int is_scheduled;
 };
 
+static struct gale_map **order_map = NULL;
+
+static void enqueue(struct unpack *ctx) {
+	struct gale_data id;
+	struct order *order;
+
+	if (NULL == order_map) {
+		order_map = gale_malloc_safe(sizeof(*order_map));
+		*order_map = gale_make_map(0);
+	}
+
+	id.l = sizeof(ctx->func) + sizeof(ctx->user);
+	id.p = gale_malloc(id.l);
+	memcpy(id.p,&ctx->func,sizeof(ctx->func));
+	memcpy(id.p + sizeof(ctx->func),&ctx->user,sizeof(ctx->user));
+
+	order = gale_map_find(*order_map,id);
+	if (NULL == order) {
+		gale_create(order);
+		order->id = id;
+		order->head = order->tail = NULL;
+		order->is_scheduled = 0;
+		gale_map_add(*order_map,id,order);
+	}
+
+	ctx->order = order;
+	ctx->next = NULL;
+	ctx->result = NULL;
+	ctx->is_done = 0;
+	if (NULL == order->tail) 
+		order->head = ctx;
+	else
+		order->tail->next = ctx;
+	order->tail = ctx;
+}
+
+static oop_call_time on_release;
+
+/* Deliver the first message in the queue, if it's finished.  Any more
+   finished messages are delivered in later callbacks. */
+static void *release(oop_source *oop,struct order *order) {
+	struct unpack * const ctx = order->head;
+	if (NULL == ctx || !ctx->is_done) return OOP_CONTINUE;
+
+	order->head = ctx->next;
+	if (NULL == order->head) {
+		order->tail = NULL;
+		gale_map_add(*order_map,order->id,NULL);
+	} else if (order->head->is_done && !order->is_scheduled) {
+		order->is_scheduled = 1;
+		oop->on_time(oop,OOP_TIME_NOW,on_release,order);
+	}
+
+	return ctx->func(ctx->result,ctx->user);
+}
+
+static void *on_release(oop_source *oop,struct timeval when,void *x) {
+	struct order * const order = (struct order *) x;
+	order->is_scheduled = 0;
+	return release(oop,order);
+}
+
+/* A message is finished (NULL if it couldn't be unpacked). */
+static void *deliver(oop_source *oop,
+	struct unpack *ctx,struct gale_message *msg) 
+{
+	ctx->result = msg;
+	ctx->is_done = 1;
+	return release(oop,ctx->order);
+}
+
 struct unpack_key {
 	struct gale_location **store;
 	struct unpack *unpack;
@@ -25,10 +114,40 @@ static void compress(struct gale_location **list,int count) {
 	for (i = 0; i < count; ++i) if (NULL != list[i]) list[j++] = list[i];
 }
 
-static void *finish(struct unpack *ctx) {
+struct verify {
+	struct unpack *unpack;
+	int count;
+	struct gale_group *keys;
+	struct gale_group data;
+	int is_valid;
+};
+
+/* Runs off the event loop. */
+static void verify_work(void *x) {
+	struct verify * const job = (struct verify *) x;
+	job->is_valid = gale_crypto_verify(job->count,job->keys,job->data);
+}
+
+static void *verify_done(oop_source *oop,void *x) {
+	struct verify * const job = (struct verify *) x;
+	struct unpack * const ctx = job->unpack;
+
+	if (!job->is_valid) {
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("can't verify message allegedly from \""),
+			gale_location_name(ctx->message->from[0]),
+			G_("\"")),0);
+		ctx->message->from[0] = NULL;
+	}
+
+	ctx->message->data = gale_crypto_original(ctx->message->data);
+	return deliver(oop,ctx,ctx->message);
+}
+
+static void *finish(oop_source *oop,struct unpack *ctx) {
 	assert(0 == ctx->count);
 	if (NULL == ctx->message)
-		return ctx->func(NULL,ctx->user);
+		return deliver(oop,ctx,NULL);
 
 	/* Remove NULL entries from 'from' and 'to' arrays. */
 
@@ -36,45 +155,46 @@ static void *finish(struct unpack *ctx) {
 	compress(ctx->message->to,ctx->to_count);
 	if (NULL == ctx->message->to 
 	||  NULL == ctx->message->to[0])
-		return ctx->func(NULL,ctx->user);
+		return deliver(oop,ctx,NULL);
 
 	if (NULL == ctx->message->from) {
 		gale_create(ctx->message->from);
 		ctx->message->from[0] = NULL;
 	}
 
-	/* Verify signatures. */
+	/* Verify signatures (in the background). */
 
 	if (NULL != ctx->message->from
 	&&  NULL != ctx->message->from[0]) {
 		int i;
-		struct gale_group *keys;
+		struct verify *job;
 
+		gale_create(job);
+		job->unpack = ctx;
+		job->data = ctx->message->data;
 		for (i = 0; NULL != ctx->message->from[i]; ++i) ;
-		gale_create_array(keys,i);
+		job->count = i;
+		gale_create_array(job->keys,i);
 		for (i = 0; NULL != ctx->message->from[i]; ++i)
-			keys[i] = gale_key_data(gale_key_public(
+			job->keys[i] = gale_key_data(gale_key_public(
 				gale_location_key(ctx->message->from[i]),
 				gale_time_now()));
 
-		if (!gale_crypto_verify(i,keys,ctx->message->data)) {
-			gale_alert(GALE_WARNING,gale_text_concat(3,
-				G_("can't verify message allegedly from \""),
-				gale_location_name(ctx->message->from[0]),
-				G_("\"")),0);
-			ctx->message->from[0] = NULL;
-		}
+		client_i_work(oop,
+			gale_location_name(ctx->message->from[0]),
+			verify_work,verify_done,job);
+		return OOP_CONTINUE;
 	}
 
 	ctx->message->data = gale_crypto_original(ctx->message->data);
-	return ctx->func(ctx->message,ctx->user);
+	return deliver(oop,ctx,ctx->message);
 }
 
 static void *on_loc(struct gale_text name,struct gale_location *l,void *x) {
 	struct unpack_key * const key = (struct unpack_key *) x;
 	*(key->store) = l;
 	return (0 == --(key->unpack->count)) 
-		? finish(key->unpack) 
+		? finish(key->unpack->oop,key->unpack) 
 		: OOP_CONTINUE;
 }
 
@@ -118,39 +238,73 @@ static void *on_unsealed(oop_source *oop,struct timeval when,void *x) {
 		}
 	}
 
-	return (0 == --(ctx->count)) ? finish(ctx) : OOP_CONTINUE;
+	return (0 == --(ctx->count)) ? finish(oop,ctx) : OOP_CONTINUE;
+}
+
+struct open {
+	struct unpack *unpack;
+	struct gale_group key,data;
+	int is_open;
+};
+
+/* Runs off the event loop. */
+static void open_work(void *x) {
+	struct open * const job = (struct open *) x;
+	job->is_open = gale_crypto_open(job->key,&job->data);
+}
+
+/* One fewer key to try; if that was the last, give up on decryption. */
+static void *no_key(oop_source *oop,struct unpack *ctx) {
+	const struct gale_text *target;
+	struct gale_text_builder err = null_builder;
+	struct gale_text sep = G_(" to ");
+
+	if (0 == ctx->target_count || 0 != --ctx->target_count) 
+		return OOP_CONTINUE;
+
+	gale_text_append(&err,G_("can't decrypt message"));
+	for (target = gale_crypto_target(ctx->message->data);
+	     NULL != target && 0 != target->l; ++target) {
+		gale_text_append(&err,sep);
+		gale_text_append(&err,*target);
+		sep = G_(", ");
+	}
+	gale_alert(GALE_WARNING,gale_text_build(&err),0);
+	return on_unsealed(oop,OOP_TIME_NOW,ctx);
+}
+
+static void *open_done(oop_source *oop,void *x) {
+	struct open * const job = (struct open *) x;
+	struct unpack * const ctx = job->unpack;
+	if (0 == ctx->target_count) return OOP_CONTINUE;
+	if (!job->is_open) return no_key(oop,ctx);
+
+	ctx->message->data = job->data;
+	ctx->target_count = 0;
+	return on_unsealed(oop,OOP_TIME_NOW,ctx);
 }
 
 static void *on_target_key(oop_source *oop,struct gale_key *key,void *x) {
 	struct unpack * const ctx = (struct unpack *) x;
 	const struct gale_key_assertion * const ass = gale_key_private(key);
+	struct open *job;
 	if (0 == ctx->target_count) return OOP_CONTINUE;
-
-	if (NULL != ass
-	&&  gale_crypto_open(gale_key_data(ass),&ctx->message->data)) {
-		ctx->target_count = 0;
-		return on_unsealed(oop,OOP_TIME_NOW,ctx);
-	}
-
-	if (0 == --ctx->target_count) {
-		const struct gale_text *target;
-                struct gale_text err = null_text;
-                for (target = gale_crypto_target(ctx->message->data);
-		     NULL != target && 0 != target->l; ++target)
-                        err = gale_text_concat(3,err,
-                                (0 == err.l ? G_(" to ") : G_(", ")),*target);
-	        gale_alert(GALE_WARNING,gale_text_concat(2,
-                            G_("can't decrypt message"),err),0);
-	        return on_unsealed(oop,OOP_TIME_NOW,ctx);
-        }
-
-        return OOP_CONTINUE;
+	if (NULL == ass) return no_key(oop,ctx);
+
+	/* Decrypt in the background, in order for each recipient key. */
+	gale_create(job);
+	job->unpack = ctx;
+	job->key = gale_key_data(ass);
+	job->data = ctx->message->data;
+	client_i_work(oop,gale_key_name(key),open_work,open_done,job);
+	return OOP_CONTINUE;
 }
 
 /** Unpack a Gale message from a raw "packet".
  *  Unpacking may require location lookups, so this function starts
  *  the process in the background, using liboop to invoke a callback
- *  when the process is complete.
+ *  when the process is complete.  Messages are passed to each \a func and
+ *  \a user in the same order they were passed to this function.
  *  \param oop Liboop event source to use.
  *  \param pack "Packet" to unpack (usually as received).
  *  \param func Function to call with unpacked message.
@@ -163,6 +317,7 @@ void gale_unpack_message(oop_source *oop,
 	struct unpack *ctx;
 
 	gale_create(ctx);
+	ctx->oop = oop;
 	ctx->func = func;
 	ctx->user = user;
 	gale_create(ctx->message);
@@ -173,10 +328,11 @@ void gale_unpack_message(oop_source *oop,
 	ctx->to_count = 0;
 	ctx->target_count = 0;
 	ctx->count = 1; /* decremented in on_unsealed */
+	enqueue(ctx);
 
 	{
 		struct gale_data copy = pack->content;
-		if (!gale_unpack_group(&copy,&ctx->message->data)) {
+		if (!gale_view_group(&copy,&ctx->message->data)) {
 			gale_alert(GALE_WARNING,gale_text_concat(3,
 				G_("error decoding message on \""),
 				pack->routing,G_("\"")),0);
@@ -188,15 +344,14 @@ void gale_unpack_message(oop_source *oop,
 	/* Reconstruct 'to' array from routing string. */
 
 	{
-		int i = 0;
-		struct gale_text cat = null_text;
-		while (gale_text_token(pack->routing,':',&cat)) ++i;
-		gale_create_array(ctx->message->to,1 + i);
+		int i,count;
+		const struct gale_category *cat = 
+			gale_packet_categories(pack,&count);
+		gale_create_array(ctx->message->to,1 + count);
 
-		cat = null_text;
-		while (gale_text_token(pack->routing,':',&cat)) {
+		for (i = 0; i < count; ++i) {
 			struct unpack_key *key;
-			const struct gale_text name = client_i_decode(cat);
+			const struct gale_text name = client_i_decode(cat[i].text);
 			if (0 != name.l) {
 				++(ctx->count);
 				gale_create(key);
@@ -223,7 +378,8 @@ void gale_unpack_message(oop_source *oop,
 		while (NULL != target && 0 != target->l) {
 			if (0 != ctx->target_count) ++(ctx->target_count);
 			gale_key_search(oop,
-				gale_key_handle(*target++),search_all,
+				gale_key_handle(*target++),
+				search_all | search_early,
 				on_target_key,ctx);
 		}
 	}
@@ -0,0 +1,238 @@
+#include "client_i.h"
+#include "crypto_i.h"
+#include "thread_i.h"
+#include "gale/globals.h"
+
+#include <assert.h>
+
+#ifdef HAVE_THREADS
+#define GC_THREADS /* so pthread_create() registers threads with the collector */
+#include <gc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Expensive work (RSA, mostly) is handed off here so the event loop can keep
+   going.  Each job belongs to a queue, named by the caller; a queue runs one
+   job at a time, so jobs in the same queue finish in the order they were
+   submitted.  Different queues run in parallel on worker threads if thread
+   support is enabled (GALE_WORKERS sets the number of threads, defaulting
+   to the number of processors).  Otherwise, jobs run from the event loop
+   as soon as it's idle. */
+
+#define MAX_WORKERS 16
+
+struct job {
+	client_i_work_call *work;
+	client_i_done_call *done;
+	void *user;
+	struct queue *queue;
+	struct job *next; /* in the queue */
+	struct job *link; /* in the pool's lists */
+};
+
+struct queue {
+	struct gale_text name;
+	struct job *head,*tail;
+};
+
+struct job_list {
+	struct job *head,*tail;
+};
+
+struct pool {
+	oop_source *oop;
+	struct gale_map *queues;
+#ifdef HAVE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_key_t is_worker;
+	struct job_list waiting,finished;
+	int wake[2],threads;
+#endif
+};
+
+static struct pool *pool = NULL;
+
+static void start(struct job *);
+
+/* A job's work is done; report it, and start the next in its queue. */
+static void *finish(struct job *job) {
+	struct queue * const queue = job->queue;
+
+	assert(queue->head == job);
+	queue->head = job->next;
+	if (NULL == queue->head) {
+		queue->tail = NULL;
+		gale_map_add(pool->queues,gale_text_as_data(queue->name),NULL);
+	} else
+		start(queue->head);
+
+	return job->done(pool->oop,job->user);
+}
+
+static void *on_idle(oop_source *oop,struct timeval when,void *x) {
+	struct job * const job = (struct job *) x;
+	job->work(job->user);
+	return finish(job);
+}
+
+#ifdef HAVE_THREADS
+static void list_add(struct job_list *list,struct job *job) {
+	job->link = NULL;
+	if (NULL == list->tail) list->head = job;
+	else list->tail->link = job;
+	list->tail = job;
+}
+
+static void *worker(void *x) {
+	pthread_setspecific(pool->is_worker,pool);
+	for (;;) {
+		struct job *job;
+
+		pthread_mutex_lock(&pool->lock);
+		while (NULL == pool->waiting.head)
+			pthread_cond_wait(&pool->ready,&pool->lock);
+		job = pool->waiting.head;
+		pool->waiting.head = job->link;
+		if (NULL == pool->waiting.head) pool->waiting.tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->work(job->user);
+
+		pthread_mutex_lock(&pool->lock);
+		list_add(&pool->finished,job);
+		pthread_mutex_unlock(&pool->lock);
+
+		/* If the pipe is full, the loop will wake up anyway. */
+		while (write(pool->wake[1],"",1) < 0 && EINTR == errno) ;
+	}
+
+	return NULL;
+}
+
+static void *on_wake(oop_source *oop,int fd,oop_event event,void *x) {
+	void *ret = OOP_CONTINUE;
+	struct job *job;
+	char buf[64];
+
+	while (read(fd,buf,sizeof(buf)) > 0) ;
+	thread_i_flush_alerts();
+
+	pthread_mutex_lock(&pool->lock);
+	job = pool->finished.head;
+	pool->finished.head = pool->finished.tail = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	while (NULL != job) {
+		struct job * const next = job->link;
+		void * const done = finish(job);
+		if (OOP_CONTINUE != done) ret = done;
+		job = next;
+	}
+
+	return ret;
+}
+
+int thread_i_is_worker(void) {
+	return NULL != pool && NULL != pthread_getspecific(pool->is_worker);
+}
+
+static void start_threads(void) {
+	int i,count = crypto_i_threads();
+	pthread_attr_t attr;
+
+	if (count > MAX_WORKERS) count = MAX_WORKERS;
+	pool->threads = 0;
+	pthread_key_create(&pool->is_worker,NULL);
+	if (count <= 0 || 0 != pipe(pool->wake)) return;
+
+	fcntl(pool->wake[0],F_SETFL,O_NONBLOCK);
+	fcntl(pool->wake[1],F_SETFL,O_NONBLOCK);
+	pthread_mutex_init(&pool->lock,NULL);
+	pthread_cond_init(&pool->ready,NULL);
+	pool->waiting.head = pool->waiting.tail = NULL;
+	pool->finished.head = pool->finished.tail = NULL;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < count; ++i) {
+		pthread_t thread;
+		if (0 != pthread_create(&thread,&attr,worker,NULL)) {
+			gale_alert(GALE_WARNING,G_("can't start worker thread"),
+				errno);
+			break;
+		}
+		++(pool->threads);
+	}
+	pthread_attr_destroy(&attr);
+
+	if (pool->threads > 0)
+		pool->oop->on_fd(pool->oop,pool->wake[0],OOP_READ,on_wake,NULL);
+	else {
+		close(pool->wake[0]);
+		close(pool->wake[1]);
+	}
+}
+#endif
+
+static void start(struct job *job) {
+#ifdef HAVE_THREADS
+	if (pool->threads > 0) {
+		pthread_mutex_lock(&pool->lock);
+		list_add(&pool->waiting,job);
+		pthread_cond_signal(&pool->ready);
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+#endif
+	pool->oop->on_time(pool->oop,OOP_TIME_NOW,on_idle,job);
+}
+
+/** \internal Do some work off the event loop.
+ *  \param oop Liboop event source to use.
+ *  \param queue Name of the queue for this job.  Jobs in the same queue
+ *         run one at a time, in order.
+ *  \param work Function to do the work.  It may run on another thread,
+ *         so it must not touch anything the event loop might be using.
+ *  \param done Function to call from the event loop when the work is done.
+ *  \param user User-defined parameter to pass both functions. */
+void client_i_work(oop_source *oop,struct gale_text queue,
+	client_i_work_call *work,client_i_done_call *done,void *user)
+{
+	struct queue *q;
+	struct job *job;
+
+	if (NULL == pool) {
+		pool = gale_malloc_safe(sizeof(*pool));
+		pool->oop = oop;
+		pool->queues = gale_make_map(0);
+#ifdef HAVE_THREADS
+		start_threads();
+#endif
+	}
+
+	gale_create(job);
+	job->work = work;
+	job->done = done;
+	job->user = user;
+	job->next = NULL;
+
+	q = gale_map_find(pool->queues,gale_text_as_data(queue));
+	if (NULL == q) {
+		gale_create(q);
+		q->name = queue;
+		q->head = q->tail = NULL;
+		gale_map_add(pool->queues,gale_text_as_data(q->name),q);
+	}
+
+	job->queue = q;
+	if (NULL == q->tail) {
+		q->head = q->tail = job;
+		start(job);
+	} else {
+		q->tail->next = job;
+		q->tail = job;
+	}
+}
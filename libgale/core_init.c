@@ -18,6 +18,7 @@
 extern char **environ;
 
 extern void _gale_globals(void);
+extern void _gale_alloc_init(void);
 
 /* Set default environment values, if they weren't already set. */
 
@@ -114,8 +115,10 @@ void gale_init(const char *s,int argc,char * const *argv) {
 	/* Round out the environment. */
 
 	set_defaults(pwd);
+	_gale_alloc_init();
 
 	key_i_init_builtin();
 	key_i_init_dirs();
+	key_i_init_db();
 	key_i_init_akd();
 }
@@ -91,6 +91,8 @@ struct gale_link {
 static void * const st_yes = (void *) 0x1;
 static void * const st_no = (void *) 0x2;
 
+static struct gale_slab *link_slab = NULL;
+
 static size_t message_size(struct gale_packet *m) {
 	return gale_u32_size() + m->content.l + m->routing.l * gale_wch_size();
 }
@@ -106,7 +108,7 @@ static struct gale_packet *dequeue(struct gale_link *l) {
 		--l->queue_num;
 		l->queue_mem -= message_size(link->msg);
 		m = link->msg;
-		gale_free(link);
+		gale_slab_free(link_slab,link);
 		gale_dprintf(7,"<- dequeueing message [%p]\n",m);
 	}
 	return m;
@@ -424,12 +426,8 @@ static void ost_version(struct output_state *out) {
 
 static void ofn_msg_data(struct output_state *out,struct output_context *ctx) {
 	struct gale_link *l = (struct gale_link *) out->private;
-	struct gale_data data;
-	send_space(ctx,
-		gale_u32_size() + gale_copy_size(l->out_msg->content.l),
-		&data);
-	gale_pack_u32(&data,0);
-	gale_pack_copy(&data,l->out_msg->content.p,l->out_msg->content.l);
+	/* The content is immutable, so send it without copying. */
+	send_buffer(ctx,l->out_msg->content,NULL,NULL);
 	l->out_msg = NULL;
 	ost_idle(out);
 }
@@ -438,9 +436,10 @@ static void ofn_message(struct output_state *out,struct output_context *ctx) {
 	struct gale_link *l = (struct gale_link *) out->private;
 	struct gale_data data;
 	size_t len = gale_text_len_size(l->out_msg->routing);
-	send_space(ctx,gale_u32_size() + len,&data);
+	send_space(ctx,gale_u32_size() + len + gale_u32_size(),&data);
 	gale_pack_u32(&data,len);
 	gale_pack_text_len(&data,l->out_msg->routing);
+	gale_pack_u32(&data,0); /* content format */
 	out->next = ofn_msg_data;
 }
 
@@ -466,6 +465,12 @@ static void ofn_cid(struct output_state *out,struct output_context *ctx) {
 	out->next = ofn_data;
 }
 
+static int first(struct gale_map *map,struct gale_data *key,void **ptr) {
+	struct gale_map_cursor cursor;
+	gale_map_begin(&cursor,map);
+	return gale_map_next(&cursor,key,ptr);
+}
+
 static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 	struct gale_link *l = (struct gale_link *) out->private;
 	struct gale_data data,key;
@@ -480,7 +485,7 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 
 	/* version 1 */
 
-	       if (gale_map_walk(l->out_watch,NULL,&key,&ptr)) {
+	       if (first(l->out_watch,&key,&ptr)) {
 		out->next = ofn_text;
 		l->out_text = gale_text_from_data(key);
 		gale_map_add(l->out_watch,key,NULL);
@@ -490,7 +495,7 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 			assert(ptr == st_no); 
 		}
 		gale_pack_u32(&data,l->out_text.l * gale_wch_size());
-	} else if (gale_map_walk(l->out_fetch,NULL,&key,&ptr)) {
+	} else if (first(l->out_fetch,&key,&ptr)) {
 		assert(st_yes == ptr);
 		out->next = ofn_cid;
 		l->out_cid = key;
@@ -504,7 +509,7 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 		l->out_publish = null_text;
 		gale_pack_u32(&data,opcode_publish);
 		gale_pack_u32(&data,l->out_text.l * gale_wch_size());
-	} else if (gale_map_walk(l->out_supply,NULL,&key,&ptr)) {
+	} else if (first(l->out_supply,&key,&ptr)) {
 		out->next = ofn_cid;
 		l->out_cid = key;
 		assert(ptr != st_yes);
@@ -517,7 +522,7 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 		}
 		gale_pack_u32(&data,l->out_cid.l + l->out_data.l);
 		assert(CID_LENGTH == l->out_cid.l);
-	} else if (gale_map_walk(l->out_assert,NULL,&key,&ptr)) {
+	} else if (first(l->out_assert,&key,&ptr)) {
 		out->next = ofn_cid;
 		l->out_cid = key;
 		l->out_data = null_data;
@@ -527,7 +532,7 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 			assert(st_no == ptr);
 		}
 		gale_pack_u32(&data,l->out_cid.l + l->out_data.l);
-	} else if (gale_map_walk(l->out_complete,NULL,&key,&ptr)) {
+	} else if (first(l->out_complete,&key,&ptr)) {
 		assert(ptr == st_yes);
 		out->next = ofn_text;
 		l->out_text = gale_text_from_data(key);
@@ -567,11 +572,11 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 static int ofn_idle_ready(struct output_state *out) {
 	struct gale_link *l = (struct gale_link *) out->private;
 	return l->out_will || l->out_gimme.l || l->out_queue || l->out_publish.l
-	    || gale_map_walk(l->out_watch,NULL,NULL,NULL)
-	    || gale_map_walk(l->out_complete,NULL,NULL,NULL)
-	    || gale_map_walk(l->out_assert,NULL,NULL,NULL)
-	    || gale_map_walk(l->out_fetch,NULL,NULL,NULL)
-	    || gale_map_walk(l->out_supply,NULL,NULL,NULL);
+	    || !gale_map_empty(l->out_watch)
+	    || !gale_map_empty(l->out_complete)
+	    || !gale_map_empty(l->out_assert)
+	    || !gale_map_empty(l->out_fetch)
+	    || !gale_map_empty(l->out_supply);
 }
 
 static void ost_idle(struct output_state *out) {
@@ -836,7 +841,10 @@ void link_subscribe(struct gale_link *l,struct gale_text spec) {
 void link_put(struct gale_link *l,struct gale_packet *m) {
 	struct link *link;
 
-	gale_create(link);
+	if (NULL == link_slab) 
+		link_slab = gale_make_slab(G_("link"),sizeof(*link));
+
+	gale_slab_create(link_slab,link);
 	link->when = gale_time_now();
 	link->msg = m;
 	if (NULL == l->out_queue)
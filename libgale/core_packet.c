@@ -0,0 +1,86 @@
+#include "gale/core.h"
+#include "gale/misc.h"
+
+#include <string.h>
+
+/* The parsed categories are cached in a weak map, keyed by the packet's
+   address, along with the routing string they came from.  (struct
+   gale_packet itself is public, so it has no room for them.)  If someone
+   replaces the routing string, the cache no longer matches and is rebuilt
+   the next time it's asked for.  Entries last until the next collection,
+   which is plenty for the burst of lookups as a packet is routed. */
+
+struct packet_cache {
+	struct gale_text routing;
+	int count;
+	struct gale_category *array;
+};
+
+static struct gale_map **cache_map = NULL;
+
+/** Parse a single category.
+ *  \param text The category, possibly with a "+" or "-" prefix.
+ *  \param cat Structure to fill in. */
+void gale_category_parse(struct gale_text text,struct gale_category *cat) {
+	cat->text = text;
+	cat->host = null_text;
+	cat->flag = 1;
+	cat->directed = 0;
+	cat->base = text;
+
+	if (text.l > 0 && ('+' == text.p[0] || '-' == text.p[0])) {
+		cat->flag = ('+' == text.p[0]);
+		cat->base = gale_text_right(text,-1);
+	}
+
+	if (cat->base.l < 1 || '@' != cat->base.p[0]) return;
+
+	cat->directed = 1;
+	gale_text_token(gale_text_right(cat->base,-1),'/',&cat->host);
+	if (cat->host.l == cat->base.l - 1)
+		cat->base = gale_text_concat(2,cat->base,G_("/"));
+}
+
+/** Get the categories a packet is routed to.
+ *  The routing string is only parsed once; later calls return the same
+ *  array, as long as the packet's routing string hasn't been replaced.
+ *  \param pkt The packet.
+ *  \param count Set to the number of categories.
+ *  \return Array of parsed categories.  Don't modify it. */
+const struct gale_category *gale_packet_categories(
+	struct gale_packet *pkt,int *count)
+{
+	struct packet_cache *cache;
+	struct gale_text cat = null_text;
+	struct gale_data key;
+	int i;
+
+	if (NULL == cache_map) {
+		cache_map = gale_malloc_safe(sizeof(*cache_map));
+		*cache_map = gale_make_map(1);
+	}
+
+	key.l = sizeof(pkt);
+	key.p = (byte *) &pkt;
+	cache = gale_map_find(*cache_map,key);
+	if (NULL == cache
+	||  cache->routing.p != pkt->routing.p
+	||  cache->routing.l != pkt->routing.l) {
+		gale_create(cache);
+		cache->routing = pkt->routing;
+		cache->count = 0;
+		while (gale_text_token(pkt->routing,':',&cat)) ++cache->count;
+
+		gale_create_array(cache->array,cache->count);
+		for (i = 0; gale_text_token(pkt->routing,':',&cat); ++i)
+			gale_category_parse(cat,&cache->array[i]);
+
+		/* Atomic, so the key doesn't keep the packet alive. */
+		key.p = gale_malloc_atomic(key.l);
+		memcpy(key.p,&pkt,key.l);
+		gale_map_add(*cache_map,key,cache);
+	}
+
+	*count = cache->count;
+	return cache->array;
+}
@@ -0,0 +1,382 @@
+#include "gale/crypto.h"
+#include "gale/misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <openssl/evp.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#define have_cycles 1
+#else
+#define cycles() 0ULL
+#define have_cycles 0
+#endif
+
+/* Benchmarks for libgale crypto, over a range of key types, payload sizes
+   and signer or recipient counts.  Each result is printed as a tab-separated
+   line: test, parameters (key=value pairs separated by commas), operations
+   per second, processor cycles per payload byte ("-" if that doesn't apply
+   or can't be measured here), and the heap growth (in kilobytes, possibly
+   negative) over the run.  Lines starting with "#" are comments.
+
+   Each test runs for about RUN_TIME, but at least MIN_OPS times.  Every
+   signed or sealed message is different, so verify and open do all the
+   work despite the verification and session key caches.  Name tests on
+   the command line (generate, sign_raw, sign, seal) to run just those;
+   sign_raw, sign and seal are followed by verify_raw, verify and open. */
+
+#define KEYS 8 /* distinct keys of each type */
+#define MIN_OPS 3
+#define MAX_OPS 1000
+#define MAX_BYTES (16 * 1024 * 1024) /* of messages kept for verify/open */
+#define RUN_TIME 5e8 /* nanoseconds */
+
+struct key_type {
+	const char *name,*type,*bits;
+	struct gale_group keys[KEYS];
+	int is_ready;
+};
+
+static struct key_type key_types[] = {
+	{ "rsa512", "rsa", "512" },
+	{ "rsa768", "rsa", "768" },
+	{ "rsa1024", "rsa", "1024" },
+	{ "ed25519", "ed25519", NULL },
+};
+
+#define KEY_TYPES (sizeof(key_types) / sizeof(key_types[0]))
+#define DEFAULT_KEY (&key_types[1])
+#define ED25519_KEY (&key_types[3])
+
+static const size_t payloads[] = { 64, 1024, 64 * 1024 };
+#define PAYLOADS (sizeof(payloads) / sizeof(payloads[0]))
+
+static char **wanted_tests = NULL;
+
+static int wanted(const char *test) {
+	char **arg = wanted_tests;
+	if (NULL == arg || NULL == *arg) return 1;
+	for (; NULL != *arg; ++arg)
+		if (!strcmp(*arg,test)) return 1;
+	return 0;
+}
+
+static double elapsed(struct timeval start) {
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return (now.tv_sec - start.tv_sec) * 1e9
+	     + (now.tv_usec - start.tv_usec) * 1e3;
+}
+
+struct run {
+	struct timeval start;
+	unsigned long long cycles;
+	size_t heap;
+	int ops;
+};
+
+static void run_start(struct run *run) {
+	struct gale_memory_stats stats;
+	gale_check_mem();
+	gale_memory_stats(&stats);
+	run->heap = stats.heap_size;
+	run->ops = 0;
+	gettimeofday(&run->start,NULL);
+	run->cycles = cycles();
+}
+
+/* Nonzero if another operation should run. */
+static int run_more(const struct run *run,int max_ops) {
+	if (run->ops >= max_ops) return 0;
+	return run->ops < MIN_OPS || elapsed(run->start) < RUN_TIME;
+}
+
+/* The most messages of this size we're willing to keep around. */
+static int max_ops(size_t bytes) {
+	int ops = MAX_OPS;
+	if (0 != bytes && MAX_BYTES / bytes < ops) ops = MAX_BYTES / bytes;
+	return ops < MIN_OPS ? MIN_OPS : ops;
+}
+
+static void run_report(const struct run *run,
+	const char *test,const char *params,size_t bytes)
+{
+	const unsigned long long used = cycles() - run->cycles;
+	const double ns = elapsed(run->start);
+	struct gale_memory_stats stats;
+
+	gale_memory_stats(&stats);
+	printf("%s\t%s\t%.1f\t",test,params,run->ops * 1e9 / ns);
+	if (have_cycles && 0 != bytes && 0 != run->ops)
+		printf("%.2f",(double) used / run->ops / bytes);
+	else
+		printf("-");
+	/* A collection during the run can shrink the heap. */
+	printf("\t%ld\n",((long) stats.heap_size - (long) run->heap) / 1024);
+	fflush(stdout);
+}
+
+static const char *describe(const char *key,size_t bytes,int keys,
+	const char *format)
+{
+	static char buf[128];
+	char *p = buf;
+	p += sprintf(p,"key=%s",key);
+	if (0 != bytes) p += sprintf(p,",bytes=%lu",(unsigned long) bytes);
+	if (0 != keys) p += sprintf(p,",keys=%d",keys);
+	if (NULL != format) p += sprintf(p,",format=%s",format);
+	return buf;
+}
+
+static struct gale_group generate(const struct key_type *kt,struct gale_text id) {
+	gale_set(G_("GALE_AUTH_TYPE"),gale_text_from(NULL,kt->type,-1));
+	if (NULL != kt->bits)
+		gale_set(G_("GALE_AUTH_BITS"),gale_text_from(NULL,kt->bits,-1));
+	return gale_crypto_generate(id);
+}
+
+/* Without Ed25519 support, we'd get an RSA key instead. */
+static int is_supported(const struct key_type *kt,struct gale_group key) {
+	struct gale_fragment frag;
+	if (strcmp(kt->type,"ed25519")) return 1;
+	return gale_group_lookup(key,G_("ed25519.public"),frag_data,&frag);
+}
+
+/* Generating hundreds of keys would take a while, so the keys share
+   a few keys' material under different names. */
+static struct gale_group *make_keys(struct key_type *kt,int count,int is_public) {
+	struct gale_group *keys;
+	struct gale_fragment frag;
+	int i;
+
+	if (!kt->is_ready) {
+		for (i = 0; i < KEYS; ++i)
+			kt->keys[i] = generate(kt,gale_text_concat(2,
+				G_("bench.key"),gale_text_from_number(i,10,0)));
+		kt->is_ready = 1;
+	}
+
+	if (!is_supported(kt,kt->keys[0])) {
+		fprintf(stderr,"crypto_bench: no %s support\n",kt->name);
+		return NULL;
+	}
+
+	gale_create_array(keys,count);
+	frag.type = frag_text;
+	frag.name = G_("key.id");
+	for (i = 0; i < count; ++i) {
+		keys[i] = kt->keys[i % KEYS];
+		if (is_public) keys[i] = gale_crypto_public(keys[i]);
+		frag.value.text = gale_text_concat(3,G_("k"),
+			gale_text_from_number(i,10,0),G_("@bench"));
+		gale_group_replace(&keys[i],frag);
+	}
+
+	return keys;
+}
+
+/* A message of about this many bytes, numbered so each is different. */
+static struct gale_group make_message(size_t bytes,int number) {
+	struct gale_group message = gale_group_empty();
+	struct gale_fragment frag;
+	const size_t len = bytes / gale_wch_size();
+	wch *body;
+	size_t i;
+
+	gale_create_array(body,len);
+	for (i = 0; i < len; ++i) body[i] = 'a' + i % 26;
+
+	frag.type = frag_number;
+	frag.name = G_("message/number");
+	frag.value.number = number;
+	gale_group_add(&message,frag);
+
+	frag.type = frag_text;
+	frag.name = G_("message/body");
+	frag.value.text.p = body;
+	frag.value.text.l = len;
+	gale_group_add(&message,frag);
+	return message;
+}
+
+static void bench_generate(struct key_type *kt) {
+	struct gale_group key = gale_group_empty();
+	struct run run;
+
+	run_start(&run);
+	while (run_more(&run,MAX_OPS)) {
+		key = generate(kt,G_("bench.generate"));
+		++run.ops;
+	}
+
+	if (is_supported(kt,key))
+		run_report(&run,"generate",describe(kt->name,0,0,NULL),0);
+	else
+		fprintf(stderr,"crypto_bench: no %s support\n",kt->name);
+}
+
+static void bench_sign_raw(struct key_type *kt,size_t bytes) {
+	struct gale_group *keys = make_keys(kt,1,0),*pub = make_keys(kt,1,1);
+	const int max = max_ops(bytes);
+	struct gale_data *data,*sig;
+	struct run run;
+	int i;
+
+	if (NULL == keys) return;
+	gale_create_array(data,max);
+	gale_create_array(sig,max);
+	for (i = 0; i < max; ++i) {
+		data[i].p = gale_malloc_atomic(bytes);
+		memset(data[i].p,'x',bytes);
+		data[i].l = 0;
+		gale_pack_u32(&data[i],i);
+		data[i].l = bytes;
+	}
+
+	run_start(&run);
+	while (run_more(&run,max)) {
+		const struct gale_data *sigs =
+			gale_crypto_sign_raw(1,keys,data[run.ops]);
+		if (NULL == sigs) {
+			fprintf(stderr,"crypto_bench: sign_raw failed\n");
+			return;
+		}
+		sig[run.ops++] = sigs[0];
+	}
+	run_report(&run,"sign_raw",describe(kt->name,bytes,1,NULL),bytes);
+
+	i = run.ops;
+	run_start(&run);
+	while (run_more(&run,i)) {
+		if (!gale_crypto_verify_raw(1,pub,&sig[run.ops],data[run.ops])) {
+			fprintf(stderr,"crypto_bench: verify_raw failed\n");
+			return;
+		}
+		++run.ops;
+	}
+	run_report(&run,"verify_raw",describe(kt->name,bytes,1,NULL),bytes);
+}
+
+static void bench_sign(struct key_type *kt,size_t bytes,int count) {
+	struct gale_group *keys = make_keys(kt,count,0);
+	struct gale_group *pub = make_keys(kt,count,1);
+	const int max = max_ops(bytes);
+	struct gale_group *data;
+	struct run run;
+	size_t size;
+	int i;
+
+	if (NULL == keys) return;
+	gale_create_array(data,max);
+	for (i = 0; i < max; ++i) data[i] = make_message(bytes,i);
+	size = gale_group_size(data[0]);
+
+	run_start(&run);
+	while (run_more(&run,max)) {
+		if (!gale_crypto_sign(count,keys,&data[run.ops])) {
+			fprintf(stderr,"crypto_bench: sign failed\n");
+			return;
+		}
+		++run.ops;
+	}
+	run_report(&run,"sign",describe(kt->name,size,count,NULL),size);
+
+	i = run.ops;
+	run_start(&run);
+	while (run_more(&run,i)) {
+		if (!gale_crypto_verify(count,pub,data[run.ops])) {
+			fprintf(stderr,"crypto_bench: verify failed\n");
+			return;
+		}
+		++run.ops;
+	}
+	run_report(&run,"verify",describe(kt->name,size,count,NULL),size);
+}
+
+static void bench_seal(const char *format,size_t bytes,int count) {
+	struct gale_group *keys = make_keys(DEFAULT_KEY,count,0);
+	struct gale_group *pub = make_keys(DEFAULT_KEY,count,1);
+	const int max = max_ops(bytes);
+	struct gale_group *data;
+	struct run run;
+	size_t size;
+	int i;
+
+	if (NULL == keys) return;
+	gale_set(G_("GALE_ENCRYPTION"),gale_text_from(NULL,format,-1));
+	gale_create_array(data,max);
+	for (i = 0; i < max; ++i) data[i] = make_message(bytes,i);
+	size = gale_group_size(data[0]);
+
+	run_start(&run);
+	while (run_more(&run,max)) {
+		if (!gale_crypto_seal(count,pub,&data[run.ops])) {
+			fprintf(stderr,"crypto_bench: seal failed\n");
+			return;
+		}
+		++run.ops;
+	}
+	run_report(&run,"seal",
+		describe(DEFAULT_KEY->name,size,count,format),size);
+
+	i = run.ops;
+	run_start(&run);
+	while (run_more(&run,i)) {
+		if (!gale_crypto_open(keys[0],&data[run.ops])) {
+			fprintf(stderr,"crypto_bench: open failed\n");
+			return;
+		}
+		++run.ops;
+	}
+	run_report(&run,"open",
+		describe(DEFAULT_KEY->name,size,count,format),size);
+}
+
+int main(int argc,char *argv[]) {
+	/* Only ciphers libgale can actually seal with; see aead_cipher(). */
+	static const char *formats[] = { 
+		"3des", "aes-gcm",
+#ifdef NID_chacha20_poly1305
+		"chacha20-poly1305",
+#endif
+	};
+	static const int signers[] = { 1, 4, 16 };
+	static const int recipients[] = { 1, 10, 100, 1000 };
+	int i,j,k;
+
+	gale_init("crypto_bench",argc,argv);
+	wanted_tests = argv + 1;
+	printf("# test\tparams\tops/sec\tcycles/byte\theap KB\n");
+
+	if (wanted("generate"))
+		for (i = 0; i < KEY_TYPES; ++i)
+			bench_generate(&key_types[i]);
+
+	if (wanted("sign_raw"))
+		for (i = 0; i < KEY_TYPES; ++i)
+			for (j = 0; j < PAYLOADS; ++j)
+				bench_sign_raw(&key_types[i],payloads[j]);
+
+	if (wanted("sign"))
+		for (j = 0; j < PAYLOADS; ++j)
+			for (k = 0; k < sizeof(signers) / sizeof(*signers); ++k) {
+				bench_sign(DEFAULT_KEY,payloads[j],signers[k]);
+				bench_sign(ED25519_KEY,payloads[j],signers[k]);
+			}
+
+#ifndef NID_chacha20_poly1305
+	if (wanted("seal")) 
+		printf("# chacha20-poly1305: not available, skipped\n");
+#endif
+	if (wanted("seal"))
+		for (i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+			for (j = 0; j < PAYLOADS; ++j)
+				for (k = 0; k < sizeof(recipients) / sizeof(*recipients); ++k)
+					bench_seal(formats[i],payloads[j],recipients[k]);
+
+	return 0;
+}
@@ -8,7 +8,7 @@
 
 static void add_bignum(
 	struct gale_group *group,struct gale_text name,
-	int size,int count,BIGNUM *b,...) 
+	int size,int count,const BIGNUM *b,...) 
 {
 	struct gale_fragment frag;
 	va_list ap;
@@ -25,21 +25,19 @@ static void add_bignum(
 		memset(frag.value.data.p + frag.value.data.l,0,size);
 		BN_bn2bin(b,frag.value.data.p + frag.value.data.l + size - len);
 		frag.value.data.l += size;
-		b = va_arg(ap,BIGNUM *);
+		b = va_arg(ap,const BIGNUM *);
 	}
 	va_end(ap);
 
 	gale_group_add(group,frag);
 }
 
-/** Generate a new key.
- *  \param id The name to embed in the key.
- *  \return The newly generated key, containing public and private data.
- *  \sa gale_crypto_public() */
-struct gale_group gale_crypto_generate(struct gale_text id) {
-	RSA *rsa = NULL;
+static void generate_rsa(struct gale_group *output) {
+	RSA *rsa = RSA_new();
+	BIGNUM *f4 = BN_new();
+	const BIGNUM *n,*e,*d,*p,*q,*dmp1,*dmq1,*iqmp;
 	int bits = gale_text_to_number(gale_var(G_("GALE_AUTH_BITS")));
-	struct gale_group output = gale_group_empty();
+	int is_generated;
 	struct gale_fragment frag;
 
 	if (0 == bits) bits = 768; /* default value */
@@ -50,34 +48,108 @@ struct gale_group gale_crypto_generate(struct gale_text id) {
 
 	crypto_i_seed();
 	gale_alert(GALE_NOTICE,G_("generating key, please wait..."),0);
-	rsa = RSA_generate_key(bits,RSA_F4,NULL,NULL);
-	assert(NULL != rsa);
-
-	frag.type = frag_text;
-	frag.name = G_("key.id");
-	frag.value.text = id;
-	gale_group_add(&output,frag);
+	is_generated = NULL != rsa && NULL != f4 
+	            && BN_set_word(f4,RSA_F4)
+	            && RSA_generate_key_ex(rsa,bits,f4,NULL);
+	if (!is_generated) crypto_i_error();
+	assert(is_generated);
+	RSA_get0_key(rsa,&n,&e,&d);
+	RSA_get0_factors(rsa,&p,&q);
+	RSA_get0_crt_params(rsa,&dmp1,&dmq1,&iqmp);
 
 	frag.type = frag_number;
 	frag.name = G_("rsa.bits");
 	frag.value.number = bits;
-	gale_group_add(&output,frag);
+	gale_group_add(output,frag);
 
-	add_bignum(&output,G_("rsa.modulus"),GALE_RSA_MODULUS_LEN,1,rsa->n);
-	add_bignum(&output,G_("rsa.exponent"),GALE_RSA_MODULUS_LEN,1,rsa->e);
-	add_bignum(&output,G_("rsa.private.exponent"),
-		GALE_RSA_MODULUS_LEN,1,rsa->d);
-	add_bignum(&output,G_("rsa.private.prime"),
-		GALE_RSA_PRIME_LEN,2,rsa->p,rsa->q);
-	add_bignum(&output,G_("rsa.private.prime.exponent"),
-		GALE_RSA_PRIME_LEN,2,rsa->dmp1,rsa->dmq1);
-	add_bignum(&output,G_("rsa.private.coefficient"),
-		GALE_RSA_PRIME_LEN,1,rsa->iqmp);
+	add_bignum(output,G_("rsa.modulus"),GALE_RSA_MODULUS_LEN,1,n);
+	add_bignum(output,G_("rsa.exponent"),GALE_RSA_MODULUS_LEN,1,e);
+	add_bignum(output,G_("rsa.private.exponent"),
+		GALE_RSA_MODULUS_LEN,1,d);
+	add_bignum(output,G_("rsa.private.prime"),
+		GALE_RSA_PRIME_LEN,2,p,q);
+	add_bignum(output,G_("rsa.private.prime.exponent"),
+		GALE_RSA_PRIME_LEN,2,dmp1,dmq1);
+	add_bignum(output,G_("rsa.private.coefficient"),
+		GALE_RSA_PRIME_LEN,1,iqmp);
 
+	if (NULL != f4) BN_free(f4);
 	if (NULL != rsa) RSA_free(rsa);
+}
+
+#ifdef EVP_PKEY_ED25519
+static void add_raw(struct gale_group *group,struct gale_text name,
+	EVP_PKEY *pkey,int (*get)(const EVP_PKEY *,unsigned char *,size_t *))
+{
+	struct gale_fragment frag;
+	size_t len = GALE_ED25519_LEN;
+
+	frag.name = name;
+	frag.type = frag_data;
+	frag.value.data.p = gale_malloc(len);
+	if (!get(pkey,frag.value.data.p,&len)) crypto_i_error();
+	assert(GALE_ED25519_LEN == len);
+	frag.value.data.l = len;
+	gale_group_add(group,frag);
+}
+
+static int generate_ed25519(struct gale_group *output) {
+	EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519,NULL);
+	EVP_PKEY *pkey = NULL;
+
+	crypto_i_seed();
+	if (NULL == context
+	||  EVP_PKEY_keygen_init(context) <= 0
+	||  EVP_PKEY_keygen(context,&pkey) <= 0) {
+		crypto_i_error();
+		EVP_PKEY_CTX_free(context);
+		return 0;
+	}
+
+	add_raw(output,G_("ed25519.public"),pkey,EVP_PKEY_get_raw_public_key);
+	add_raw(output,G_("ed25519.private"),pkey,EVP_PKEY_get_raw_private_key);
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_CTX_free(context);
+	return 1;
+}
+#endif
+
+/** Generate a new key.
+ *  The key type is set by GALE_AUTH_TYPE: "rsa" (the default, with
+ *  GALE_AUTH_BITS bits) or "ed25519" (if the crypto library supports it).
+ *  \param id The name to embed in the key.
+ *  \return The newly generated key, containing public and private data.
+ *  \sa gale_crypto_public() */
+struct gale_group gale_crypto_generate(struct gale_text id) {
+	const struct gale_text type = gale_var(G_("GALE_AUTH_TYPE"));
+	struct gale_group output = gale_group_empty();
+	struct gale_fragment frag;
+
+	frag.type = frag_text;
+	frag.name = G_("key.id");
+	frag.value.text = id;
+	gale_group_add(&output,frag);
+
+	if (!gale_text_compare(type,G_("ed25519"))) {
+#ifdef EVP_PKEY_ED25519
+		if (generate_ed25519(&output)) return output;
+#else
+		gale_alert(GALE_WARNING,G_("no Ed25519 support, using RSA"),0);
+#endif
+	} else if (0 != type.l && gale_text_compare(type,G_("rsa")))
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("unknown key type \""),type,G_("\", using RSA")),0);
+
+	generate_rsa(&output);
 	return output;
 }
 
+static int is_private(struct gale_text name) {
+	return (gale_text_compare(G_("rsa.private"),name) <= 0
+	    &&  gale_text_compare(G_("rsa.private.~"),name) > 0)
+	    ||  !gale_text_compare(G_("ed25519.private"),name);
+}
+
 /** Extract the public components of a key.
  *  \param key A key which may contain private data.
  *  \return The same key with all private data expunged.
@@ -88,8 +160,7 @@ struct gale_group gale_crypto_public(struct gale_group key) {
 		struct gale_fragment frag = gale_group_first(key);
 		key = gale_group_rest(key);
 
-		if (gale_text_compare(G_("rsa.private"),frag.name) <= 0
-		&&  gale_text_compare(G_("rsa.private.~"),frag.name) > 0) {
+		if (is_private(frag.name)) {
 			gale_group_remove(&filtered,frag.name,frag.type);
 			key = filtered;
 		}
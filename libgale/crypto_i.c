@@ -1,5 +1,9 @@
 #include "crypto_i.h"
+#include "thread_i.h"
+#include "gale/globals.h"
 
+#include <openssl/evp.h>
+#include <openssl/bn.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
 
@@ -8,6 +12,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#ifdef HAVE_THREADS
+#define GC_THREADS /* so pthread_create() registers threads with the collector */
+#include <gc.h>
+#endif
+
 void crypto_i_seed(void) {
 	static int is_init = 0;
 	struct {
@@ -47,62 +56,542 @@ void crypto_i_error(void) {
 			0);
 }
 
-struct gale_text crypto_i_rsa(struct gale_group key,RSA *rsa) {
-	struct gale_text name = null_text;
-
-	while (!gale_group_null(key)) {
-		struct gale_fragment frag = gale_group_first(key);
-		struct gale_data data = frag.value.data;
-		key = gale_group_rest(key);
-
-		if (frag_text == frag.type
-		&& !gale_text_compare(G_("key.id"),frag.name))
-			name = frag.value.text;
-
-		if (frag_data != frag.type) 
-			continue;
-		else if (!gale_text_compare(G_("rsa.modulus"),frag.name))
-			rsa->n = BN_bin2bn(data.p,data.l,rsa->n);
-		else if (!gale_text_compare(G_("rsa.exponent"),frag.name))
-			rsa->e = BN_bin2bn(data.p,data.l,rsa->e);
-		else if (!gale_text_compare(G_("rsa.private.exponent"),frag.name))
-			rsa->d = BN_bin2bn(data.p,data.l,rsa->d);
-		else if (2*GALE_RSA_PRIME_LEN == data.l
-		     && !gale_text_compare(G_("rsa.private.prime"),frag.name)) {
-			rsa->p = BN_bin2bn(data.p,GALE_RSA_PRIME_LEN,rsa->p);
-			rsa->q = BN_bin2bn(
-				GALE_RSA_PRIME_LEN + data.p,
-				GALE_RSA_PRIME_LEN,
-				rsa->q);
-		}
-		else if (2*GALE_RSA_PRIME_LEN == data.l
-		     && !gale_text_compare(frag.name,
-			G_("rsa.private.prime.exponent")))
-		{
-			rsa->dmp1 = BN_bin2bn(data.p,
-				GALE_RSA_PRIME_LEN,
-				rsa->dmp1);
-			rsa->dmq1 = BN_bin2bn(
-				GALE_RSA_PRIME_LEN + data.p,
-				GALE_RSA_PRIME_LEN,
-				rsa->dmq1);
+/* The last fragment with this name (and length, if nonzero) wins. */
+static struct gale_data last_data(
+	const struct gale_group_index *index,
+	struct gale_text name,size_t len)
+{
+	const struct gale_fragment *frags;
+	int count = gale_index_find(index,name,frag_data,&frags);
+	while (count-- > 0)
+		if (0 == len || len == frags[count].value.data.l)
+			return frags[count].value.data;
+	return null_data;
+}
+
+/* A missing number is left unset (NULL); an empty one is zero. */
+static BIGNUM *bignum(int is_present,struct gale_data data) {
+	if (!is_present) return NULL;
+	return BN_bin2bn(data.p,data.l,NULL);
+}
+
+static int is_present(const struct gale_group_index *index,
+	struct gale_text name)
+{
+	const struct gale_fragment *frags;
+	return gale_index_find(index,name,frag_data,&frags) > 0;
+}
+
+/* Everything that goes into a key, in the order we fingerprint it. */
+struct material {
+	struct gale_text name;
+	struct gale_data n,e,ed_public,d,iqmp,primes,exponents,ed_private;
+	int has_n,has_e,has_d,has_iqmp;
+};
+
+static void get_material(struct gale_group key,struct material *mat) {
+	const struct gale_group_index *index = gale_make_group_index(key);
+	const struct gale_fragment *frags;
+	int count;
+
+	mat->name = null_text;
+	count = gale_index_find(index,GA_("key.id"),frag_text,&frags);
+	if (count > 0) mat->name = frags[count - 1].value.text;
+
+	mat->n = last_data(index,GA_("rsa.modulus"),0);
+	mat->e = last_data(index,GA_("rsa.exponent"),0);
+	mat->d = last_data(index,GA_("rsa.private.exponent"),0);
+	mat->iqmp = last_data(index,GA_("rsa.private.coefficient"),0);
+	mat->has_n = is_present(index,GA_("rsa.modulus"));
+	mat->has_e = is_present(index,GA_("rsa.exponent"));
+	mat->has_d = is_present(index,GA_("rsa.private.exponent"));
+	mat->has_iqmp = is_present(index,GA_("rsa.private.coefficient"));
+	mat->primes = last_data(index,
+		GA_("rsa.private.prime"),2*GALE_RSA_PRIME_LEN);
+	mat->exponents = last_data(index,
+		GA_("rsa.private.prime.exponent"),2*GALE_RSA_PRIME_LEN);
+	mat->ed_public = last_data(index,GA_("ed25519.public"),GALE_ED25519_LEN);
+	mat->ed_private = last_data(index,
+		GA_("ed25519.private"),GALE_ED25519_LEN);
+}
+
+/* Parts the key doesn't have are left unset. */
+static void fill_rsa(const struct material *mat,RSA *rsa) {
+	BIGNUM *n = bignum(mat->has_n,mat->n),*e = bignum(mat->has_e,mat->e);
+	BIGNUM *d = bignum(mat->has_d,mat->d);
+	BIGNUM *p = NULL,*q = NULL,*dmp1 = NULL,*dmq1 = NULL;
+	BIGNUM *iqmp = bignum(mat->has_iqmp,mat->iqmp);
+
+	if (0 != mat->primes.l) {
+		p = BN_bin2bn(mat->primes.p,GALE_RSA_PRIME_LEN,NULL);
+		q = BN_bin2bn(
+			GALE_RSA_PRIME_LEN + mat->primes.p,
+			GALE_RSA_PRIME_LEN,
+			NULL);
+	}
+
+	if (0 != mat->exponents.l) {
+		dmp1 = BN_bin2bn(mat->exponents.p,
+			GALE_RSA_PRIME_LEN,
+			NULL);
+		dmq1 = BN_bin2bn(
+			GALE_RSA_PRIME_LEN + mat->exponents.p,
+			GALE_RSA_PRIME_LEN,
+			NULL);
+	}
+
+	/* The RSA structure takes ownership of whatever it accepts. */
+	if (!RSA_set0_key(rsa,n,e,d)) {
+		BN_free(n);
+		BN_free(e);
+		BN_clear_free(d);
+	}
+	if (!RSA_set0_factors(rsa,p,q)) {
+		BN_clear_free(p);
+		BN_clear_free(q);
+	}
+	if (!RSA_set0_crt_params(rsa,dmp1,dmq1,iqmp)) {
+		BN_clear_free(dmp1);
+		BN_clear_free(dmq1);
+		BN_clear_free(iqmp);
+	}
+}
+
+static int public_valid(const RSA *rsa) {
+	const BIGNUM *n,*e;
+	RSA_get0_key(rsa,&n,&e,NULL);
+	return NULL != n && NULL != e;
+}
+
+static int private_valid(const RSA *rsa) {
+	const BIGNUM *d,*p,*q,*dmp1,*dmq1,*iqmp;
+	RSA_get0_key(rsa,NULL,NULL,&d);
+	RSA_get0_factors(rsa,&p,&q);
+	RSA_get0_crt_params(rsa,&dmp1,&dmq1,&iqmp);
+	return public_valid(rsa)
+	    && NULL != d
+	    && NULL != p && NULL != q
+	    && NULL != dmp1 && NULL != dmq1
+	    && NULL != iqmp;
+}
+
+/* Parsed keys are cached, keyed by the key material itself (not a digest 
+   of it, so two different keys can never share an entry).  The cache holds 
+   one reference to each EVP_PKEY; callers get their own reference.  Entries
+   are kept in least-recently-used order and the oldest is dropped when the
+   cache is full (GALE_KEY_CACHE entries, default 64).  Worker threads share
+   the cache, so it's only touched with key_lock held; parsing happens
+   outside the lock. */
+
+#define DEFAULT_KEY_CACHE 64
+
+struct key_entry {
+	struct gale_data print;
+	EVP_PKEY *pkey;
+	struct gale_text name;
+	struct key_entry *prev,*next;
+};
+
+struct key_cache {
+	struct gale_map *map;
+	struct key_entry *head,*tail;
+	int count,limit;
+	unsigned long hits,misses,evictions;
+};
+
+THREAD_LOCK(key_lock);
+static struct key_cache *key_cache = NULL;
+
+static struct gale_text key_cache_report(void *x) {
+	return gale_text_concat(11,
+		G_("keys: cached="),gale_text_from_number(key_cache->count,10,0),
+		G_("/"),gale_text_from_number(key_cache->limit,10,0),
+		G_(", hits="),gale_text_from_number(key_cache->hits,10,0),
+		G_(", misses="),gale_text_from_number(key_cache->misses,10,0),
+		G_(", evictions="),
+		gale_text_from_number(key_cache->evictions,10,0),
+		G_("\n"));
+}
+
+static struct key_cache *get_cache(void) {
+	if (NULL == key_cache) {
+		key_cache = gale_malloc_safe(sizeof(*key_cache));
+		key_cache->map = gale_make_map(0);
+		key_cache->head = key_cache->tail = NULL;
+		key_cache->count = 0;
+		key_cache->limit = gale_text_to_number(
+			gale_var(G_("GALE_KEY_CACHE")));
+		if (key_cache->limit <= 0) key_cache->limit = DEFAULT_KEY_CACHE;
+		key_cache->hits = key_cache->misses = key_cache->evictions = 0;
+		gale_report_add(gale_global->report,key_cache_report,NULL);
+	}
+
+	return key_cache;
+}
+
+static void unlink_entry(struct key_cache *cache,struct key_entry *entry) {
+	if (NULL != entry->prev) entry->prev->next = entry->next;
+	else cache->head = entry->next;
+	if (NULL != entry->next) entry->next->prev = entry->prev;
+	else cache->tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void link_entry(struct key_cache *cache,struct key_entry *entry) {
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (NULL != cache->head) cache->head->prev = entry;
+	else cache->tail = entry;
+	cache->head = entry;
+}
+
+static void drop_entry(struct key_cache *cache,struct key_entry *entry) {
+	unlink_entry(cache,entry);
+	gale_map_add(cache->map,entry->print,NULL);
+	EVP_PKEY_free(entry->pkey);
+	entry->pkey = NULL;
+	--(cache->count);
+}
+
+static struct gale_data fingerprint(const struct material *mat,int is_private) {
+	const int count = is_private ? 8 : 3;
+	struct gale_data parts[8],print;
+	int i;
+
+	parts[0] = mat->n;
+	parts[1] = mat->e;
+	parts[2] = mat->ed_public;
+	parts[3] = mat->d;
+	parts[4] = mat->iqmp;
+	parts[5] = mat->primes;
+	parts[6] = mat->exponents;
+	parts[7] = mat->ed_private;
+
+	print.l = 2 * gale_u32_size() + gale_text_size(mat->name);
+	for (i = 0; i < count; ++i)
+		print.l += gale_u32_size() + gale_copy_size(parts[i].l);
+
+	print.p = gale_malloc_atomic(print.l);
+	print.l = 0;
+	gale_pack_u32(&print,is_private);
+	/* An empty number isn't the same as a missing one (see bignum). */
+	gale_pack_u32(&print,mat->has_n | mat->has_e << 1
+		| mat->has_d << 2 | mat->has_iqmp << 3);
+	gale_pack_text(&print,mat->name);
+	for (i = 0; i < count; ++i) {
+		gale_pack_u32(&print,parts[i].l);
+		gale_pack_copy(&print,parts[i].p,parts[i].l);
+	}
+
+	return print;
+}
+
+/* Do the per-key setup OpenSSL would otherwise repeat on every operation.
+   The Montgomery contexts stay with the RSA structure once computed.
+   (OpenSSL 1.1 hides them, and computes them on first use instead.) */
+static void precompute(RSA *rsa,int is_private) {
+	BN_CTX *ctx = BN_CTX_new();
+	if (NULL == ctx) return;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	BN_MONT_CTX_set_locked(&rsa->_method_mod_n,CRYPTO_LOCK_RSA,rsa->n,ctx);
+	if (is_private) {
+		BN_MONT_CTX_set_locked(
+			&rsa->_method_mod_p,CRYPTO_LOCK_RSA,rsa->p,ctx);
+		BN_MONT_CTX_set_locked(
+			&rsa->_method_mod_q,CRYPTO_LOCK_RSA,rsa->q,ctx);
+	}
+#endif
+	if (is_private) {
+		crypto_i_seed();
+		if (!RSA_blinding_on(rsa,ctx)) crypto_i_error();
+	}
+
+	BN_CTX_free(ctx);
+}
+
+static EVP_PKEY *make_rsa(const struct material *mat,int is_private) {
+	EVP_PKEY *pkey;
+	RSA *rsa = RSA_new();
+	fill_rsa(mat,rsa);
+	if (is_private ? !private_valid(rsa) : !public_valid(rsa)) {
+		RSA_free(rsa);
+		return NULL;
+	}
+
+	precompute(rsa,is_private);
+	pkey = EVP_PKEY_new();
+	EVP_PKEY_assign_RSA(pkey,rsa);
+	return pkey;
+}
+
+#ifdef EVP_PKEY_ED25519
+static EVP_PKEY *make_ed25519(const struct material *mat,int is_private) {
+	if (!is_private)
+		return EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519,NULL,
+			mat->ed_public.p,mat->ed_public.l);
+	if (0 == mat->ed_private.l) return NULL;
+	return EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519,NULL,
+		mat->ed_private.p,mat->ed_private.l);
+}
+#endif
+
+/* Find an entry and take a reference to its key.  Call with key_lock held. */
+static EVP_PKEY *find_key(struct key_cache *cache,struct gale_data print) {
+	struct key_entry * const entry = gale_map_find(cache->map,print);
+	if (NULL == entry) return NULL;
+	unlink_entry(cache,entry);
+	link_entry(cache,entry);
+	EVP_PKEY_up_ref(entry->pkey);
+	return entry->pkey;
+}
+
+static EVP_PKEY *get_key(struct gale_group key,int is_private,
+	struct gale_text *name)
+{
+	struct key_cache * const cache = get_cache();
+	struct key_entry *entry;
+	struct material mat;
+	struct gale_data print;
+	EVP_PKEY *pkey;
+
+	get_material(key,&mat);
+	if (NULL != name) *name = mat.name;
+	print = fingerprint(&mat,is_private);
+
+	thread_lock(key_lock);
+	pkey = find_key(cache,print);
+	if (NULL != pkey) ++(cache->hits); else ++(cache->misses);
+	thread_unlock(key_lock);
+	if (NULL != pkey) return pkey;
+
+	/* Parse the key without holding the lock. */
+#ifdef EVP_PKEY_ED25519
+	if (0 != mat.ed_public.l)
+		pkey = make_ed25519(&mat,is_private);
+	else
+#endif
+		pkey = make_rsa(&mat,is_private);
+	if (NULL == pkey) return NULL;
+
+	gale_create(entry);
+	entry->print = print;
+	entry->name = mat.name;
+	entry->pkey = pkey;
+
+	thread_lock(key_lock);
+	pkey = find_key(cache,print);
+	if (NULL == pkey) {
+		while (cache->count >= cache->limit && NULL != cache->tail) {
+			++(cache->evictions);
+			drop_entry(cache,cache->tail);
 		}
-		else if (!gale_text_compare(frag.name,
-			G_("rsa.private.coefficient")))
-			rsa->iqmp = BN_bin2bn(data.p,data.l,rsa->iqmp);
+
+		gale_map_add(cache->map,entry->print,entry);
+		link_entry(cache,entry);
+		++(cache->count);
+
+		pkey = entry->pkey;
+		EVP_PKEY_up_ref(pkey);
+	}
+	thread_unlock(key_lock);
+
+	/* Someone else got there first; use theirs. */
+	if (pkey != entry->pkey) EVP_PKEY_free(entry->pkey);
+	return pkey;
+}
+
+/** \internal Get a ready-to-use public key.
+ *  \param key Key data, including public key material.
+ *  \param name If not NULL, set to the key's name.
+ *  \return A new reference to the key (release it with EVP_PKEY_free()),
+ *          or NULL if the key data is incomplete. */
+EVP_PKEY *crypto_i_public(struct gale_group key,struct gale_text *name) {
+	return get_key(key,0,name);
+}
+
+/** \internal Get a ready-to-use private key.
+ *  \param key Key data, including private key material.
+ *  \param name If not NULL, set to the key's name.
+ *  \return A new reference to the key (release it with EVP_PKEY_free()),
+ *          or NULL if the key data is incomplete. */
+EVP_PKEY *crypto_i_private(struct gale_group key,struct gale_text *name) {
+	return get_key(key,1,name);
+}
+
+/** \internal Check a key's type.
+ *  \param key Key data.
+ *  \return Nonzero iff this is an Ed25519 key (which signs a SHA-512 digest)
+ *          rather than an RSA key (which signs an MD5 digest). */
+int crypto_i_is_ed25519(struct gale_group key) {
+	struct gale_fragment frag;
+	return gale_group_lookup(key,GA_("ed25519.public"),frag_data,&frag)
+	    || gale_group_lookup(key,GA_("ed25519.private"),frag_data,&frag);
+}
+
+/** \internal Identify a public key.
+ *  \param key Key data, including public key material.
+ *  \return Data which is the same for two keys exactly when their names
+ *          and public key material are the same. */
+struct gale_data crypto_i_fingerprint(struct gale_group key) {
+	struct material mat;
+	get_material(key,&mat);
+	return fingerprint(&mat,0);
+}
+
+/** \internal Drop any cached copies of a key.
+ *  Called when a key is replaced or retracted.  This also forgets any
+ *  signatures verified with the key.
+ *  \param key Key data, as passed to crypto_i_public() or crypto_i_private(). */
+void crypto_i_forget(struct gale_group key) {
+	struct key_entry *entry;
+	struct material mat;
+	int is_private;
+
+	get_material(key,&mat);
+	crypto_i_forget_verified(fingerprint(&mat,0));
+	if (NULL == key_cache) return;
+
+	thread_lock(key_lock);
+	for (is_private = 0; is_private < 2; ++is_private) {
+		entry = gale_map_find(key_cache->map,fingerprint(&mat,is_private));
+		if (NULL != entry) drop_entry(key_cache,entry);
 	}
+	thread_unlock(key_lock);
+}
+
+/* Below this many items per thread, it's not worth starting threads. */
+#define PARALLEL_MIN 16
+#define PARALLEL_MAX 16
 
-	return name;
+#ifdef HAVE_THREADS
+/* Threads to use, from GALE_WORKERS (see crypto_i_threads). */
+static int parallel_threads = 0;
+#endif
+
+struct stripe {
+	int lo,hi;
+	void (*func)(int,void *);
+	void *user;
+#ifdef HAVE_THREADS
+	struct thread_i_alerts alerts;
+#endif
+};
+
+static void run_stripe(struct stripe *stripe) {
+	int i;
+	for (i = stripe->lo; i < stripe->hi; ++i) 
+		stripe->func(i,stripe->user);
 }
 
-int crypto_i_public_valid(RSA *rsa) {
-	return NULL != rsa->n && NULL != rsa->e;
+#ifdef HAVE_THREADS
+static void *stripe_thread(void *x) {
+	struct stripe * const stripe = (struct stripe *) x;
+	thread_i_collect(&stripe->alerts);
+	run_stripe(stripe);
+	thread_i_collect(NULL);
+	return NULL;
 }
+#endif
+
+/** \internal Run an independent operation on many items.
+ *  With thread support, large batches from the main thread are divided 
+ *  among up to GALE_WORKERS threads (by default, one per processor); 
+ *  otherwise (including on a worker, which is already running in parallel
+ *  with the others), the items are simply processed in order.  Alerts
+ *  raised by \a func are reported from the calling thread, in order.
+ *  \param count Number of items.
+ *  \param func Function to call with each item index and \a user.
+ *  \param user User-defined parameter to pass the function. */
+void crypto_i_parallel(int count,void (*func)(int,void *),void *user) {
+	struct stripe stripe[PARALLEL_MAX];
+	int i,threads = 1;
+#ifdef HAVE_THREADS
+	pthread_t thread[PARALLEL_MAX];
+	int started[PARALLEL_MAX];
+
+	if (!thread_i_is_worker() && count >= 2 * PARALLEL_MIN) {
+		crypto_i_threads();
+		threads = parallel_threads;
+		if (threads > count / PARALLEL_MIN) threads = count / PARALLEL_MIN;
+		if (threads < 1) threads = 1;
+	}
+#endif
+
+	for (i = 0; i < threads; ++i) {
+		stripe[i].lo = (count * i) / threads;
+		stripe[i].hi = (count * (i + 1)) / threads;
+		stripe[i].func = func;
+		stripe[i].user = user;
+#ifdef HAVE_THREADS
+		stripe[i].alerts.head = stripe[i].alerts.tail = NULL;
+#endif
+	}
+
+#ifdef HAVE_THREADS
+	/* The first stripe runs here; so does any we can't start a thread for. */
+	for (i = 1; i < threads; ++i) 
+		started[i] = !pthread_create(
+			&thread[i],NULL,stripe_thread,&stripe[i]);
+	run_stripe(&stripe[0]);
+	for (i = 1; i < threads; ++i) {
+		if (started[i]) pthread_join(thread[i],NULL);
+		else run_stripe(&stripe[i]);
+		thread_i_report(&stripe[i].alerts);
+	}
+#else
+	run_stripe(&stripe[0]);
+#endif
+}
+
+#ifdef HAVE_THREADS
+/* OpenSSL 1.1 does its own locking; older versions need callbacks. */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *ssl_locks = NULL;
+
+static void ssl_lock(int mode,int n,const char *file,int line) {
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&ssl_locks[n]);
+	else
+		pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static unsigned long ssl_id(void) {
+	return (unsigned long) pthread_self();
+}
+#endif
+
+/** \internal Prepare for crypto on worker threads.
+ *  Installs OpenSSL's locking callbacks, sets up the shared caches and
+ *  reads GALE_WORKERS.  Call from the main thread before starting any
+ *  workers.
+ *  \return The number of threads to use (at most PARALLEL_MAX). */
+int crypto_i_threads(void) {
+	static int is_init = 0;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int i;
+#endif
+	if (is_init) return parallel_threads;
+	is_init = 1;
+
+	parallel_threads = gale_text_to_number(gale_var(G_("GALE_WORKERS")));
+	if (parallel_threads <= 0) parallel_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (parallel_threads > PARALLEL_MAX) parallel_threads = PARALLEL_MAX;
+	if (parallel_threads < 1) parallel_threads = 1;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	ssl_locks = gale_malloc_safe(CRYPTO_num_locks() * sizeof(*ssl_locks));
+	for (i = 0; i < CRYPTO_num_locks(); ++i)
+		pthread_mutex_init(&ssl_locks[i],NULL);
+	CRYPTO_set_id_callback(ssl_id);
+	CRYPTO_set_locking_callback(ssl_lock);
+#endif
 
-int crypto_i_private_valid(RSA *rsa) {
-	return crypto_i_public_valid(rsa)
-	    && NULL != rsa->d
-	    && NULL != rsa->p && NULL != rsa->q
-	    && NULL != rsa->dmp1 && NULL != rsa->dmq1
-	    && NULL != rsa->iqmp;
+	crypto_i_seed();
+	get_cache();
+	crypto_i_verify_init();
+	crypto_i_session_init();
+	crypto_i_seal_init();
+	return parallel_threads;
 }
+#endif
@@ -4,15 +4,73 @@
 #include "gale/crypto.h"
 #include "gale/types.h"
 
+#include <openssl/opensslv.h>
 #include <openssl/crypto.h>
+#include <openssl/bn.h>
 #include <openssl/rsa.h>
+#include <openssl/evp.h>
+
+/* Older OpenSSL (before 1.1) has no accessors for its structures; 
+   crypto_misc.c supplies the ones we use. */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+int EVP_PKEY_up_ref(EVP_PKEY *);
+RSA *EVP_PKEY_get0_RSA(EVP_PKEY *);
+int RSA_set0_key(RSA *,BIGNUM *n,BIGNUM *e,BIGNUM *d);
+int RSA_set0_factors(RSA *,BIGNUM *p,BIGNUM *q);
+int RSA_set0_crt_params(RSA *,BIGNUM *dmp1,BIGNUM *dmq1,BIGNUM *iqmp);
+void RSA_get0_key(const RSA *,
+	const BIGNUM **n,const BIGNUM **e,const BIGNUM **d);
+void RSA_get0_factors(const RSA *,const BIGNUM **p,const BIGNUM **q);
+void RSA_get0_crt_params(const RSA *,
+	const BIGNUM **dmp1,const BIGNUM **dmq1,const BIGNUM **iqmp);
+#endif
 
 void crypto_i_seed(void);
 void crypto_i_error(void);
 
-struct gale_text crypto_i_rsa(struct gale_group,RSA *);
-int crypto_i_public_valid(RSA *);
-int crypto_i_private_valid(RSA *);
+/* Parsed keys are cached; release them with EVP_PKEY_free(). */
+EVP_PKEY *crypto_i_public(struct gale_group,struct gale_text *name);
+EVP_PKEY *crypto_i_private(struct gale_group,struct gale_text *name);
+void crypto_i_forget(struct gale_group);
+int crypto_i_is_ed25519(struct gale_group);
+
+/* Successful verifications are cached by key fingerprint. */
+struct gale_data crypto_i_fingerprint(struct gale_group);
+void crypto_i_forget_verified(struct gale_data print);
+void crypto_i_verify_init(void);
+
+/* Session keys may be reused for the same recipients (GALE_SESSION_REUSE),
+   and unwrapped session keys are cached. */
+struct gale_data crypto_i_session_set(
+	int key_count,const struct gale_group *keys,u32 format);
+int crypto_i_session_find(struct gale_data set,
+	unsigned char *key,int key_len,
+	struct gale_data *block,u32 *count);
+void crypto_i_session_add(struct gale_data set,
+	const unsigned char *key,int key_len,
+	struct gale_data block,u32 count);
+int crypto_i_unwrap(struct gale_group key,EVP_PKEY *pkey,
+	struct gale_data wrapped,unsigned char *raw);
+void crypto_i_session_init(void);
+
+/* Call before running crypto on worker threads (HAVE_THREADS only);
+   returns the number of threads to run (GALE_WORKERS). */
+int crypto_i_threads(void);
+
+/* Re-read GALE_ENCRYPTION for gale_crypto_seal() on worker threads. */
+void crypto_i_seal_init(void);
+
+/* Call func(i,user) for each 0 <= i < count, perhaps in parallel. */
+void crypto_i_parallel(int count,void (*func)(int,void *),void *user);
+
+/* Sign or verify a group (with a version prefix) without packing it. */
+const struct gale_data *crypto_i_sign_group(int key_count,
+	const struct gale_group *keys,struct gale_group);
+int crypto_i_verify_group(int key_count,
+	const struct gale_group *keys,const struct gale_data *sigs,
+	struct gale_group);
 
 /* Although these restrictions do not necessarily apply to this implementation, 
  * they are used to compute field sizes and such in the key storage, and so     
@@ -24,6 +82,10 @@ int crypto_i_private_valid(RSA *);
 #define GALE_ENCRYPTED_KEY_LEN GALE_RSA_MODULUS_LEN
 #define GALE_SIGNATURE_LEN GALE_RSA_MODULUS_LEN
 
+/* Ed25519 keys (ed25519.public, ed25519.private) and signatures. */
+#define GALE_ED25519_LEN 32
+#define GALE_ED25519_SIGNATURE_LEN 64
+
 /* Magic number for embedded signatures */
 static const byte sig_magic[] = { 0x68, 0x13, 0x01, 0x00 };
 
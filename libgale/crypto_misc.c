@@ -19,13 +19,83 @@ struct gale_data gale_crypto_random(int len) {
  *  \param len A block of data to hash.
  *  \return A block of data containing a secure hash of the data. */
 struct gale_data gale_crypto_hash(struct gale_data orig) {
-	EVP_MD_CTX context;
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
 	struct gale_data output;
+	unsigned int len;
 
 	output.p = gale_malloc(EVP_MAX_MD_SIZE);
+	if (NULL == context) {
+		crypto_i_error();
+		output.l = 0;
+		return output;
+	}
 
-	EVP_DigestInit(&context,EVP_sha1());
-	EVP_DigestUpdate(&context,orig.p,orig.l);
-	EVP_DigestFinal(&context,output.p,&output.l);
+	EVP_DigestInit(context,EVP_sha1());
+	EVP_DigestUpdate(context,orig.p,orig.l);
+	EVP_DigestFinal(context,output.p,&len);
+	EVP_MD_CTX_free(context);
+	output.l = len;
 	return output;
 }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* The OpenSSL 1.1 accessors, for older versions. */
+
+int EVP_PKEY_up_ref(EVP_PKEY *pkey) {
+	CRYPTO_add(&pkey->references,1,CRYPTO_LOCK_EVP_PKEY);
+	return 1;
+}
+
+RSA *EVP_PKEY_get0_RSA(EVP_PKEY *pkey) {
+	if (EVP_PKEY_RSA != EVP_PKEY_base_id(pkey)) return NULL;
+	return pkey->pkey.rsa;
+}
+
+int RSA_set0_key(RSA *rsa,BIGNUM *n,BIGNUM *e,BIGNUM *d) {
+	if ((NULL == rsa->n && NULL == n) 
+	||  (NULL == rsa->e && NULL == e)) return 0;
+	if (NULL != n) { BN_free(rsa->n); rsa->n = n; }
+	if (NULL != e) { BN_free(rsa->e); rsa->e = e; }
+	if (NULL != d) { BN_clear_free(rsa->d); rsa->d = d; }
+	return 1;
+}
+
+int RSA_set0_factors(RSA *rsa,BIGNUM *p,BIGNUM *q) {
+	if ((NULL == rsa->p && NULL == p) 
+	||  (NULL == rsa->q && NULL == q)) return 0;
+	if (NULL != p) { BN_clear_free(rsa->p); rsa->p = p; }
+	if (NULL != q) { BN_clear_free(rsa->q); rsa->q = q; }
+	return 1;
+}
+
+int RSA_set0_crt_params(RSA *rsa,BIGNUM *dmp1,BIGNUM *dmq1,BIGNUM *iqmp) {
+	if ((NULL == rsa->dmp1 && NULL == dmp1) 
+	||  (NULL == rsa->dmq1 && NULL == dmq1)
+	||  (NULL == rsa->iqmp && NULL == iqmp)) return 0;
+	if (NULL != dmp1) { BN_clear_free(rsa->dmp1); rsa->dmp1 = dmp1; }
+	if (NULL != dmq1) { BN_clear_free(rsa->dmq1); rsa->dmq1 = dmq1; }
+	if (NULL != iqmp) { BN_clear_free(rsa->iqmp); rsa->iqmp = iqmp; }
+	return 1;
+}
+
+void RSA_get0_key(const RSA *rsa,
+	const BIGNUM **n,const BIGNUM **e,const BIGNUM **d) 
+{
+	if (NULL != n) *n = rsa->n;
+	if (NULL != e) *e = rsa->e;
+	if (NULL != d) *d = rsa->d;
+}
+
+void RSA_get0_factors(const RSA *rsa,const BIGNUM **p,const BIGNUM **q) {
+	if (NULL != p) *p = rsa->p;
+	if (NULL != q) *q = rsa->q;
+}
+
+void RSA_get0_crt_params(const RSA *rsa,
+	const BIGNUM **dmp1,const BIGNUM **dmq1,const BIGNUM **iqmp)
+{
+	if (NULL != dmp1) *dmp1 = rsa->dmp1;
+	if (NULL != dmq1) *dmq1 = rsa->dmq1;
+	if (NULL != iqmp) *iqmp = rsa->iqmp;
+}
+#endif
@@ -1,15 +1,236 @@
 #include "key_i.h"
 #include "crypto_i.h"
+#include "thread_i.h"
 #include "gale/crypto.h"
 
 #include <assert.h>
+#include <string.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#endif
 
 static const byte magic[] = { 0x68, 0x13, 0x02, 0x00 };
 static const byte magic2[] = { 0x68, 0x13, 0x02, 0x01 };
+static const byte magic3[] = { 0x68, 0x13, 0x02, 0x02 };
 
 #define IV_LEN 8
 
+/* The magic3 format uses an AEAD cipher, identified by number:
+     magic3, u32 cipher, nonce, u32 key count, wrapped keys, ciphertext, tag
+   Everything before the ciphertext is authenticated along with it.
+   Senders emit it if GALE_ENCRYPTION is "aead" (pick a cipher to suit this
+   machine), "aes-gcm" or "chacha20-poly1305" (aes-gcm, with a warning, if
+   OpenSSL lacks ChaCha20); by default, they stick with magic2 (3DES), 
+   which everyone can read. */
+
+#define AEAD_AES_GCM 1
+#define AEAD_CHACHA20_POLY1305 2
+#define AEAD_IV_LEN 12
+#define AEAD_TAG_LEN 16
+
+static const EVP_CIPHER *aead_cipher(u32 id) {
+	switch (id) {
+	case AEAD_AES_GCM: return EVP_aes_256_gcm();
+#ifdef NID_chacha20_poly1305
+	case AEAD_CHACHA20_POLY1305: return EVP_chacha20_poly1305();
+#endif
+	}
+	return NULL;
+}
+
+/* AES-GCM if the processor does AES in hardware; otherwise ChaCha20. */
+static u32 aead_default(void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	unsigned int a,b,c,d;
+	if (__get_cpuid(1,&a,&b,&c,&d) && (c & bit_AES)) return AEAD_AES_GCM;
+#endif
+#ifdef NID_chacha20_poly1305
+	return AEAD_CHACHA20_POLY1305;
+#else
+	return AEAD_AES_GCM;
+#endif
+}
+
+/* Which AEAD cipher to seal with, or 0 for the magic2 format. */
+static u32 parse_format(struct gale_text name) {
+	if (0 == name.l || !gale_text_compare(name,G_("3des"))) return 0;
+	if (!gale_text_compare(name,G_("aead"))) return aead_default();
+	if (!gale_text_compare(name,G_("aes-gcm"))) return AEAD_AES_GCM;
+	if (!gale_text_compare(name,G_("chacha20-poly1305"))) {
+		if (NULL != aead_cipher(AEAD_CHACHA20_POLY1305))
+			return AEAD_CHACHA20_POLY1305;
+		gale_alert(GALE_WARNING,gale_text_concat(2,
+			G_("GALE_ENCRYPTION \"chacha20-poly1305\" isn't "),
+			G_("supported by this OpenSSL, using aes-gcm")),0);
+		return AEAD_AES_GCM;
+	}
+
+	gale_alert(GALE_WARNING,gale_text_concat(3,
+		G_("unknown GALE_ENCRYPTION \""),name,G_("\", using 3des")),0);
+	return 0;
+}
+
+/* GALE_ENCRYPTION is parsed when it changes, and only off the worker 
+   threads; workers seal with whatever the main thread saw last. */
+THREAD_LOCK(format_lock);
+static struct gale_text *format_name = NULL;
+static u32 format = 0;
+
+/** \internal Read GALE_ENCRYPTION, if it has changed.
+ *  Called before sealing on worker threads, from the main thread. */
+void crypto_i_seal_init(void) {
+	const struct gale_text name = gale_var(G_("GALE_ENCRYPTION"));
+	u32 parsed;
+
+	if (NULL != format_name && !gale_text_compare(name,*format_name))
+		return;
+	if (NULL == format_name)
+		format_name = gale_malloc_safe(sizeof(*format_name));
+
+	parsed = parse_format(name);
+	thread_lock(format_lock);
+	*format_name = name;
+	format = parsed;
+	thread_unlock(format_lock);
+}
+
+static u32 seal_format(void) {
+	u32 ret;
+	if (!thread_i_is_worker()) crypto_i_seal_init();
+	thread_lock(format_lock);
+	ret = format;
+	thread_unlock(format_lock);
+	return ret;
+}
+
+/* The header of either sealed format. */
+struct header {
+	const EVP_CIPHER *cipher; /* NULL if we don't support it */
+	int is_aead;
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	u32 key_count;
+};
+
+static int unpack_header(struct gale_data *data,struct header *header) {
+	u32 id;
+
+	if (gale_unpack_compare(data,magic2,sizeof(magic2))) {
+		header->cipher = EVP_des_ede3_cbc();
+		header->is_aead = 0;
+		return gale_unpack_copy(data,header->iv,IV_LEN)
+		    && gale_unpack_u32(data,&header->key_count);
+	}
+
+	if (gale_unpack_compare(data,magic3,sizeof(magic3))) {
+		if (!gale_unpack_u32(data,&id)) return 0;
+		header->cipher = aead_cipher(id);
+		header->is_aead = 1;
+		return gale_unpack_copy(data,header->iv,AEAD_IV_LEN)
+		    && gale_unpack_u32(data,&header->key_count);
+	}
+
+	return 0;
+}
+
+struct seal_output {
+	EVP_CIPHER_CTX *context;
+	struct gale_data *cipher;
+};
+
+static void seal_update(struct gale_data data,void *user) {
+	struct seal_output * const out = (struct seal_output *) user;
+	int len;
+	EVP_EncryptUpdate(out->context,
+		out->cipher->p + out->cipher->l,&len,data.p,data.l);
+	out->cipher->l += len;
+}
+
+/* The session key is wrapped for each recipient independently, so this
+   is spread across threads for large recipient lists.  Each recipient has
+   its own slot, so the output comes out in the same order regardless. */
+
+struct recipient {
+	struct gale_text name;
+	unsigned char *wrapped;
+	int length; /* 0 if the key is unusable, -1 if encryption failed */
+};
+
+struct wrap {
+	const struct gale_group *target;
+	const unsigned char *session_key;
+	int session_key_length;
+	struct recipient *recipient;
+};
+
+static void wrap_key(int i,void *user) {
+	struct wrap * const wrap = (struct wrap *) user;
+	struct recipient * const r = &wrap->recipient[i];
+	EVP_PKEY *key = crypto_i_public(wrap->target[i],&r->name);
+
+	r->length = 0;
+	r->name = key_i_swizzle(r->name);
+	if (NULL == key) return;
+
+	/* Only RSA keys can receive encrypted data. */
+	if (0 != r->name.l && EVP_PKEY_RSA == EVP_PKEY_base_id(key)) {
+		r->wrapped = gale_malloc_atomic(EVP_PKEY_size(key));
+		r->length = RSA_public_encrypt(
+			wrap->session_key_length,wrap->session_key,r->wrapped,
+			(RSA *) EVP_PKEY_get0_RSA(key),RSA_PKCS1_PADDING);
+		if (r->length <= 0) r->length = -1;
+	}
+
+	EVP_PKEY_free(key);
+}
+
+/* Wrap a new session key for each recipient, and pack them together. */
+static int wrap_keys(int key_count,const struct gale_group *target,
+	const unsigned char *session_key,int session_key_length,
+	struct gale_data *block,u32 *good_count)
+{
+	struct wrap wrap;
+	int i;
+
+	wrap.target = target;
+	wrap.session_key = session_key;
+	wrap.session_key_length = session_key_length;
+	gale_create_array(wrap.recipient,key_count);
+	crypto_i_parallel(key_count,wrap_key,&wrap);
+
+	*good_count = 0;
+	block->l = 0;
+	for (i = 0; i < key_count; ++i) {
+		const struct recipient r = wrap.recipient[i];
+		if (r.length < 0) {
+			gale_alert(GALE_WARNING,gale_text_concat(2,
+				G_("can't encrypt session key for "),r.name),0);
+			return 0;
+		}
+		if (r.length > 0) {
+			wrap.recipient[(*good_count)++] = r;
+			block->l += gale_text_size(r.name)
+			         +  gale_u32_size()
+			         +  gale_copy_size(r.length);
+		}
+	}
+
+	if (0 == *good_count) return 0;
+
+	block->p = gale_malloc(block->l);
+	block->l = 0;
+	for (i = 0; i < *good_count; ++i) {
+		gale_pack_text(block,wrap.recipient[i].name);
+		gale_pack_u32(block,wrap.recipient[i].length);
+		gale_pack_copy(block,
+			wrap.recipient[i].wrapped,wrap.recipient[i].length);
+	}
+
+	return 1;
+}
+
 /** Encrypt some data.
  *  \param key_count Number of keys in the \a target array.
  *  \param target Array of keys.  Anyone who owns any of these keys will be 
@@ -22,76 +243,99 @@ int gale_crypto_seal(
 	struct gale_group *data)
 {
 	struct gale_fragment frag;
-	struct gale_data plain,cipher;
-	EVP_CIPHER_CTX context;
-
-	int i,*session_key_length;
-	unsigned char **session_key,iv[EVP_MAX_IV_LENGTH];
-	struct gale_text *raw_name;
-	EVP_PKEY **public_key;
-
-	int good_count = 0,is_successful = 0;
-
-	plain.p = gale_malloc(gale_group_size(*data) + gale_u32_size());
-	plain.l = 0;
-	gale_pack_u32(&plain,0); /* version identifier? */
-	gale_pack_group(&plain,*data);
+	struct gale_group plain = *data;
+	struct gale_data cipher,version,block,set;
+	struct seal_output output;
+	EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+	byte version_buf[sizeof(u32)];
+	size_t plain_len;
+
+	int i,key_len;
+	unsigned char session_key[EVP_MAX_KEY_LENGTH],iv[EVP_MAX_IV_LENGTH];
+	const u32 aead = seal_format();
+	const EVP_CIPHER * const type = 
+		aead ? aead_cipher(aead) : EVP_des_ede3_cbc();
+	const int iv_len = aead ? AEAD_IV_LEN : IV_LEN;
+
+	u32 good_count = 0;
+	int is_successful = 0;
+
+	plain_len = gale_u32_size() + gale_group_size(plain);
 	*data = gale_group_empty();
 
-	gale_create_array(raw_name,key_count);
-	gale_create_array(public_key,key_count);
-	for (i = 0; i < key_count; ++i) public_key[i] = NULL;
-	for (i = 0; i < key_count; ++i) {
-		public_key[good_count] = EVP_PKEY_new();
-		EVP_PKEY_assign_RSA(public_key[good_count],RSA_new());
-		raw_name[good_count] = key_i_swizzle(crypto_i_rsa(
-			target[i],public_key[good_count]->pkey.rsa));
-		if (0 != raw_name[good_count].l
-		&&  crypto_i_public_valid(public_key[good_count]->pkey.rsa)) 
-			++good_count;
-		else
-			EVP_PKEY_free(public_key[good_count]);
-	}
-
-	gale_create_array(session_key_length,good_count);
-	gale_create_array(session_key,good_count);
-	for (i = 0; i < good_count; ++i) 
-		gale_create_array(session_key[i],EVP_PKEY_size(public_key[i]));
-
 	crypto_i_seed();
-	if (!EVP_SealInit(&context,EVP_des_ede3_cbc(),
-		session_key,session_key_length,iv,public_key,good_count)) {
+	if (NULL == context
+	||  !EVP_EncryptInit(context,type,NULL,NULL)
+	||  RAND_bytes(iv,iv_len) <= 0) {
 		crypto_i_error();
 		goto cleanup;
 	}
 
-	cipher.l = gale_copy_size(sizeof(magic2))
-	         + gale_copy_size(EVP_CIPHER_CTX_iv_length(&context))
-	         + gale_u32_size()
-	         + plain.l + EVP_CIPHER_CTX_block_size(&context) - 1;
-	for (i = 0; i < good_count; ++i)
-		cipher.l += gale_text_size(raw_name[i])
-		         +  gale_u32_size()
-		         +  gale_copy_size(session_key_length[i]);
+	/* This is what EVP_SealInit() does, but with the key wrapping
+	   pulled out so it can run in parallel, or be skipped if there's
+	   a recent session key for these recipients we can reuse. */
+	key_len = EVP_CIPHER_CTX_key_length(context);
+	set = crypto_i_session_set(key_count,target,aead);
+	if (!crypto_i_session_find(set,session_key,key_len,&block,&good_count)) {
+		if (EVP_CIPHER_CTX_rand_key(context,session_key) <= 0) {
+			crypto_i_error();
+			goto cleanup;
+		}
+		if (!wrap_keys(key_count,target,session_key,key_len,
+			&block,&good_count))
+			goto cleanup;
+		crypto_i_session_add(set,session_key,key_len,block,good_count);
+	}
+
+	if (!EVP_EncryptInit(context,NULL,session_key,iv)) {
+		crypto_i_error();
+		goto cleanup;
+	}
+
+	cipher.l = gale_copy_size(sizeof(magic3)) + gale_u32_size()
+	         + gale_copy_size(iv_len)
+	         + gale_u32_size() + gale_copy_size(block.l)
+	         + plain_len + EVP_CIPHER_CTX_block_size(context)
+	         + AEAD_TAG_LEN;
 
 	cipher.p = gale_malloc(cipher.l);
 	cipher.l = 0;
 
-	assert(IV_LEN == EVP_CIPHER_CTX_iv_length(&context));
-	gale_pack_copy(&cipher,magic2,sizeof(magic2));
-	gale_pack_copy(&cipher,iv,IV_LEN);
+	assert(iv_len == EVP_CIPHER_CTX_iv_length(context));
+	if (aead) {
+		gale_pack_copy(&cipher,magic3,sizeof(magic3));
+		gale_pack_u32(&cipher,aead);
+	} else
+		gale_pack_copy(&cipher,magic2,sizeof(magic2));
+	gale_pack_copy(&cipher,iv,iv_len);
 	gale_pack_u32(&cipher,good_count);
-	for (i = 0; i < good_count; ++i) {
-		gale_pack_text(&cipher,raw_name[i]);
-		gale_pack_u32(&cipher,session_key_length[i]);
-		gale_pack_copy(&cipher,session_key[i],session_key_length[i]);
+	gale_pack_copy(&cipher,block.p,block.l);
+
+	/* The header is authenticated too. */
+	if (aead && !EVP_EncryptUpdate(context,NULL,&i,cipher.p,cipher.l)) {
+		crypto_i_error();
+		goto cleanup;
 	}
 
-	EVP_SealUpdate(&context,cipher.p + cipher.l,&i,plain.p,plain.l);
-	cipher.l += i;
+	/* Encrypt the group as we serialize it. */
+	output.context = context;
+	output.cipher = &cipher;
+	version.p = version_buf;
+	version.l = 0;
+	gale_pack_u32(&version,0); /* version identifier? */
+	seal_update(version,&output);
+	gale_write_group(plain,seal_update,&output);
 
-	EVP_SealFinal(&context,cipher.p + cipher.l,&i);
+	EVP_EncryptFinal(context,cipher.p + cipher.l,&i);
 	cipher.l += i;
+	if (aead) {
+		if (!EVP_CIPHER_CTX_ctrl(context,EVP_CTRL_GCM_GET_TAG,
+			AEAD_TAG_LEN,cipher.p + cipher.l)) {
+			crypto_i_error();
+			goto cleanup;
+		}
+		cipher.l += AEAD_TAG_LEN;
+	}
 
 	frag.type = frag_data;
 	frag.name = G_("security/encryption");
@@ -100,8 +344,8 @@ int gale_crypto_seal(
 
 	is_successful = 1;
 cleanup:
-	for (i = 0; i < good_count; ++i)
-		if (NULL != public_key[i]) EVP_PKEY_free(public_key[i]);
+	memset(session_key,0,sizeof(session_key));
+	EVP_CIPHER_CTX_free(context);
 	return is_successful;
 }
 
@@ -114,27 +358,24 @@ const struct gale_text *gale_crypto_target(struct gale_group encrypted) {
 	struct gale_fragment frag;
 	struct gale_data data;
 	struct gale_text *output;
-
-	unsigned char iv[IV_LEN];
-	u32 i,key_count;
+	struct header header;
+	u32 i;
 
 	if (gale_group_null(encrypted)) return NULL;
 	frag = gale_group_first(encrypted);
-	if (gale_text_compare(G_("security/encryption"),frag.name)
+	if (gale_text_compare(GA_("security/encryption"),frag.name)
 	||  frag_data != frag.type) return NULL;
 
 	data = frag.value.data;
-	if (!gale_unpack_compare(&data,magic2,sizeof(magic2))
-	||  !gale_unpack_copy(&data,iv,sizeof(iv))
-	||  !gale_unpack_u32(&data,&key_count)) {
+	if (!unpack_header(&data,&header)) {
 		gale_alert(GALE_WARNING,G_("unknown encryption format"),0);
 		gale_create(output);
 		*output = null_text;
 		return output;
 	}
 
-	gale_create_array(output,1 + key_count);
-	for (i = 0; i < key_count; ++i) {
+	gale_create_array(output,1 + header.key_count);
+	for (i = 0; i < header.key_count; ++i) {
 		struct gale_text name;
 		if (!gale_unpack_text(&data,&name)
 		||  !gale_unpack_skip(&data)) {
@@ -159,38 +400,49 @@ const struct gale_text *gale_crypto_target(struct gale_group encrypted) {
  *  \sa gale_crypto_seal(), gale_crypto_target() */
 int gale_crypto_open(struct gale_group key,struct gale_group *cipher) {
 	struct gale_fragment frag;
-	struct gale_data data;
-	unsigned char iv[IV_LEN];
-	u32 i,key_count;
+	struct gale_data data,aad;
+	struct header header;
+	u32 i;
 	EVP_PKEY *private_key = NULL;
 	struct gale_text raw_name;
 	struct gale_data session_key,plain;
-	EVP_CIPHER_CTX context;
+	unsigned char raw_key[EVP_MAX_KEY_LENGTH];
+	EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
 	int length,is_successful = 0;
 
+	if (NULL == context) {
+		crypto_i_error();
+		goto cleanup;
+	}
 	if (gale_group_null(*cipher)) goto cleanup;
 	frag = gale_group_first(*cipher);
-	if (gale_text_compare(G_("security/encryption"),frag.name)
+	if (gale_text_compare(GA_("security/encryption"),frag.name)
 	||  frag_data != frag.type) {
 		gale_alert(GALE_WARNING,G_("can't decrypt unencrypted data"),0);
 		goto cleanup;
 	}
 
 	data = frag.value.data;
-	if (!gale_unpack_compare(&data,magic2,sizeof(magic2))
-	||  !gale_unpack_copy(&data,iv,sizeof(iv))
-	||  !gale_unpack_u32(&data,&key_count)) goto cleanup;
-
-	private_key = EVP_PKEY_new();
-	EVP_PKEY_assign_RSA(private_key,RSA_new());
-	raw_name = key_i_swizzle(crypto_i_rsa(key,private_key->pkey.rsa));
-	if (!crypto_i_private_valid(private_key->pkey.rsa)) {
+	if (!unpack_header(&data,&header)) goto cleanup;
+	if (NULL == header.cipher) {
+		gale_alert(GALE_WARNING,G_("unsupported encryption cipher"),0);
+		goto cleanup;
+	}
+
+	private_key = crypto_i_private(key,&raw_name);
+	raw_name = key_i_swizzle(raw_name);
+	if (NULL == private_key) {
 		gale_alert(GALE_WARNING,G_("invalid private key"),0);
 		goto cleanup;
 	}
 
+	if (EVP_PKEY_RSA != EVP_PKEY_base_id(private_key)) {
+		gale_alert(GALE_WARNING,G_("key can't decrypt data"),0);
+		goto cleanup;
+	}
+
 	session_key = null_data;
-	for (i = 0; i < key_count; ++i) {
+	for (i = 0; i < header.key_count; ++i) {
 		struct gale_text name;
 		if (!gale_unpack_text(&data,&name)) goto cleanup;
 		if (gale_text_compare(raw_name,name)) {
@@ -209,28 +461,56 @@ int gale_crypto_open(struct gale_group key,struct gale_group *cipher) {
 		goto cleanup;
 	}
 
-	if (!EVP_OpenInit(&context,EVP_des_ede3_cbc(),
-		session_key.p,session_key.l,iv,private_key)) {
+	/* This is what EVP_OpenInit() does, but the unwrapped session key
+	   is cached, in case the sender reuses it. */
+	if (EVP_CIPHER_key_length(header.cipher) != crypto_i_unwrap(
+		key,private_key,session_key,raw_key)
+	|| !EVP_DecryptInit(context,header.cipher,raw_key,header.iv)) {
 		crypto_i_error();
 		goto cleanup;
 	}
 
-	plain.p = gale_malloc(data.l);
+	if (header.is_aead) {
+		/* Everything up to here is authenticated; the tag is at the end. */
+		aad.p = frag.value.data.p;
+		aad.l = data.p - frag.value.data.p;
+		if (data.l < AEAD_TAG_LEN) goto invalid;
+		data.l -= AEAD_TAG_LEN;
+		if (!EVP_DecryptUpdate(context,NULL,&length,aad.p,aad.l)) {
+			crypto_i_error();
+			goto cleanup;
+		}
+	}
+
+	plain.p = gale_malloc(data.l + EVP_CIPHER_block_size(header.cipher));
 	plain.l = 0;
 
-	EVP_OpenUpdate(&context,plain.p + plain.l,&length,data.p,data.l);
+	EVP_DecryptUpdate(context,plain.p,&length,data.p,data.l);
 	plain.l += length;
-	EVP_OpenFinal(&context,plain.p + plain.l,&length);
+	length = 0;
+	if (!header.is_aead)
+		EVP_DecryptFinal(context,plain.p + plain.l,&length);
+	else if (!EVP_CIPHER_CTX_ctrl(context,EVP_CTRL_GCM_SET_TAG,
+		AEAD_TAG_LEN,data.p + data.l)
+	     ||  EVP_DecryptFinal(context,plain.p + plain.l,&length) <= 0) {
+		gale_alert(GALE_WARNING,
+			G_("encrypted data failed authentication"),0);
+		goto cleanup;
+	}
 	plain.l += length;
 
 	if (!gale_unpack_u32(&plain,&i) || 0 != i
-	||  !gale_unpack_group(&plain,cipher)) {
-		gale_alert(GALE_WARNING,G_("invalid encrypted data"),0);
-		goto cleanup;
-	}
+	||  !gale_view_group(&plain,cipher)) 
+		goto invalid;
 
 	is_successful = 1;
+	goto cleanup;
+
+invalid:
+	gale_alert(GALE_WARNING,G_("invalid encrypted data"),0);
 cleanup:
+	memset(raw_key,0,sizeof(raw_key));
+	EVP_CIPHER_CTX_free(context);
 	if (NULL != private_key) EVP_PKEY_free(private_key);
 	return is_successful;
 }
@@ -0,0 +1,341 @@
+#include "crypto_i.h"
+#include "thread_i.h"
+#include "gale/globals.h"
+
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+
+/* Wrapping a session key costs an RSA operation per recipient, which adds
+   up for a bot posting to a large private group every few seconds.  If
+   GALE_SESSION_REUSE is set to a number of seconds, senders remember the
+   session key and wrapped key block for each recipient list (and cipher)
+   they seal to, and reuse them for up to that long or GALE_SESSION_MESSAGES
+   messages (default 100), whichever comes first.  Every message still gets
+   a fresh IV, and the sealed format doesn't change.
+
+   Receivers remember the session keys they unwrap, keyed by a SHA-256 hash
+   of the private key's fingerprint and the wrapped key, so a reused key
+   block costs them no RSA either.  That cache holds GALE_SESSION_CACHE
+   keys (default 64) and drops the least recently used one when it's full.
+
+   Both caches are shared with worker threads (under session_lock). */
+
+#define DEFAULT_SESSION_MESSAGES 100
+#define DEFAULT_SESSION_CACHE 64
+#define MAX_SESSIONS 16
+
+struct session {
+	struct gale_data set,block;
+	u32 count;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	int key_len,uses;
+	struct gale_time expires;
+	struct session *next;
+};
+
+struct unwrapped {
+	struct gale_data hash;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	int key_len;
+	struct unwrapped *prev,*next;
+};
+
+struct session_cache {
+	struct session *sessions;
+	int lifetime,max_uses,session_count;
+	struct gale_map *map;
+	struct unwrapped *head,*tail;
+	int count,limit;
+	unsigned long reused,created,hits,misses;
+};
+
+THREAD_LOCK(session_lock);
+static struct session_cache *session_cache = NULL;
+
+static struct gale_text session_report(void *x) {
+	return gale_text_concat(13,
+		G_("sessions: reused="),
+		gale_text_from_number(session_cache->reused,10,0),
+		G_(", new="),gale_text_from_number(session_cache->created,10,0),
+		G_(", unwrapped="),
+		gale_text_from_number(session_cache->count,10,0),
+		G_("/"),gale_text_from_number(session_cache->limit,10,0),
+		G_(", hits="),gale_text_from_number(session_cache->hits,10,0),
+		G_(", misses="),gale_text_from_number(session_cache->misses,10,0),
+		G_("\n"));
+}
+
+/* Call with session_lock held.  Worker threads only find it already set
+   up, by crypto_i_session_init() from crypto_i_threads(). */
+static struct session_cache *get_cache(void) {
+	if (NULL == session_cache) {
+		session_cache = gale_malloc_safe(sizeof(*session_cache));
+		session_cache->sessions = NULL;
+		session_cache->session_count = 0;
+		session_cache->lifetime = gale_text_to_number(
+			gale_var(G_("GALE_SESSION_REUSE")));
+		session_cache->max_uses = gale_text_to_number(
+			gale_var(G_("GALE_SESSION_MESSAGES")));
+		if (session_cache->max_uses <= 0)
+			session_cache->max_uses = DEFAULT_SESSION_MESSAGES;
+
+		session_cache->map = gale_make_map(0);
+		session_cache->head = session_cache->tail = NULL;
+		session_cache->count = 0;
+		session_cache->limit = gale_text_to_number(
+			gale_var(G_("GALE_SESSION_CACHE")));
+		if (session_cache->limit <= 0)
+			session_cache->limit = DEFAULT_SESSION_CACHE;
+
+		session_cache->reused = session_cache->created = 0;
+		session_cache->hits = session_cache->misses = 0;
+		gale_report_add(gale_global->report,session_report,NULL);
+	}
+
+	return session_cache;
+}
+
+/** \internal Set up the session caches. */
+void crypto_i_session_init(void) {
+	thread_lock(session_lock);
+	get_cache();
+	thread_unlock(session_lock);
+}
+
+/* Start a SHA-256 hash, or return NULL if we can't. */
+static EVP_MD_CTX *hash_init(void) {
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
+	if (NULL == context || !EVP_DigestInit(context,EVP_sha256())) {
+		crypto_i_error();
+		if (NULL != context) EVP_MD_CTX_free(context);
+		return NULL;
+	}
+	return context;
+}
+
+static void update_length(EVP_MD_CTX *context,size_t l) {
+	byte buf[sizeof(u32)];
+	struct gale_data len;
+	len.p = buf;
+	len.l = 0;
+	gale_pack_u32(&len,l);
+	EVP_DigestUpdate(context,len.p,len.l);
+}
+
+/* Finish a hash started with hash_init(), and release the context. */
+static struct gale_data hash_final(EVP_MD_CTX *context) {
+	struct gale_data hash;
+	unsigned int hash_len;
+	hash.p = gale_malloc_atomic(EVP_MAX_MD_SIZE);
+	EVP_DigestFinal(context,hash.p,&hash_len);
+	EVP_MD_CTX_free(context);
+	hash.l = hash_len;
+	return hash;
+}
+
+/** \internal Identify a recipient list, for session key reuse.
+ *  \param key_count Number of keys in the \a keys array.
+ *  \param keys Recipient keys.
+ *  \param format Cipher the message will be sealed with.
+ *  \return A hash of the keys and cipher, or null_data if session keys
+ *          are not to be reused. */
+struct gale_data crypto_i_session_set(
+	int key_count,const struct gale_group *keys,u32 format)
+{
+	EVP_MD_CTX *context;
+	int i,lifetime;
+
+	thread_lock(session_lock);
+	lifetime = get_cache()->lifetime;
+	thread_unlock(session_lock);
+	if (lifetime <= 0) return null_data;
+
+	context = hash_init();
+	if (NULL == context) return null_data;
+	update_length(context,format);
+	update_length(context,key_count);
+	for (i = 0; i < key_count; ++i) {
+		const struct gale_data print = crypto_i_fingerprint(keys[i]);
+		update_length(context,print.l);
+		EVP_DigestUpdate(context,print.p,print.l);
+	}
+
+	return hash_final(context);
+}
+
+static void drop_session(struct session_cache *cache,struct session **ptr) {
+	struct session * const session = *ptr;
+	*ptr = session->next;
+	memset(session->key,0,sizeof(session->key));
+	--(cache->session_count);
+}
+
+/** \internal Find a session key to reuse.
+ *  \param set Recipient list, from crypto_i_session_set().
+ *  \param key Buffer for the session key.
+ *  \param key_len Length of session key required.
+ *  \param block Set to the block of wrapped keys.
+ *  \param count Set to the number of wrapped keys in the block.
+ *  \return Nonzero iff a session key was found. */
+int crypto_i_session_find(struct gale_data set,
+	unsigned char *key,int key_len,
+	struct gale_data *block,u32 *count)
+{
+	const struct gale_time now = gale_time_now();
+	struct session_cache *cache;
+	struct session **ptr;
+	int found = 0;
+
+	if (0 == set.l) return 0;
+	thread_lock(session_lock);
+	cache = get_cache();
+	ptr = &cache->sessions;
+	while (NULL != *ptr) {
+		struct session * const session = *ptr;
+		if (gale_time_compare(now,session->expires) >= 0
+		||  session->uses >= cache->max_uses)
+			drop_session(cache,ptr);
+		else if (!found
+		     &&  key_len == session->key_len
+		     &&  !gale_data_compare(set,session->set)) {
+			memcpy(key,session->key,key_len);
+			*block = session->block;
+			*count = session->count;
+			++(session->uses);
+			++(cache->reused);
+			found = 1;
+			ptr = &session->next;
+		} else
+			ptr = &session->next;
+	}
+	thread_unlock(session_lock);
+	return found;
+}
+
+/** \internal Remember a new session key for reuse.
+ *  \param set Recipient list, from crypto_i_session_set().
+ *  \param key The session key.
+ *  \param key_len Length of the session key.
+ *  \param block The block of wrapped keys.
+ *  \param count Number of wrapped keys in the block. */
+void crypto_i_session_add(struct gale_data set,
+	const unsigned char *key,int key_len,
+	struct gale_data block,u32 count)
+{
+	struct session_cache *cache;
+	struct session *session,**ptr;
+
+	if (0 == set.l) return;
+	gale_create(session);
+	session->set = set;
+	session->block = block;
+	session->count = count;
+	memcpy(session->key,key,key_len);
+	session->key_len = key_len;
+	session->uses = 1;
+
+	thread_lock(session_lock);
+	cache = get_cache();
+	session->expires = gale_time_add(
+		gale_time_now(),gale_time_seconds(cache->lifetime));
+
+	/* The oldest session is at the end. */
+	if (cache->session_count >= MAX_SESSIONS) {
+		for (ptr = &cache->sessions; NULL != (*ptr)->next;
+		     ptr = &(*ptr)->next) ;
+		drop_session(cache,ptr);
+	}
+
+	session->next = cache->sessions;
+	cache->sessions = session;
+	++(cache->session_count);
+	++(cache->created);
+	thread_unlock(session_lock);
+}
+
+static void unlink_unwrapped(struct session_cache *cache,struct unwrapped *u) {
+	if (NULL != u->prev) u->prev->next = u->next;
+	else cache->head = u->next;
+	if (NULL != u->next) u->next->prev = u->prev;
+	else cache->tail = u->prev;
+	u->prev = u->next = NULL;
+}
+
+static void link_unwrapped(struct session_cache *cache,struct unwrapped *u) {
+	u->prev = NULL;
+	u->next = cache->head;
+	if (NULL != cache->head) cache->head->prev = u;
+	else cache->tail = u;
+	cache->head = u;
+}
+
+/** \internal Unwrap a session key.
+ *  \param key Private key data.
+ *  \param pkey The same key, from crypto_i_private().  Must be RSA.
+ *  \param wrapped Session key, as wrapped for this key.
+ *  \param raw Buffer (of EVP_MAX_KEY_LENGTH bytes) for the session key.
+ *  \return Length of the session key, or -1 if it couldn't be unwrapped. */
+int crypto_i_unwrap(struct gale_group key,EVP_PKEY *pkey,
+	struct gale_data wrapped,unsigned char *raw)
+{
+	const struct gale_data print = crypto_i_fingerprint(key);
+	struct session_cache *cache;
+	struct unwrapped *u;
+	struct gale_data hash;
+	EVP_MD_CTX *context;
+	unsigned char *buffer;
+	int length;
+
+	context = hash_init();
+	if (NULL == context) return -1;
+	update_length(context,print.l);
+	EVP_DigestUpdate(context,print.p,print.l);
+	EVP_DigestUpdate(context,wrapped.p,wrapped.l);
+	hash = hash_final(context);
+
+	thread_lock(session_lock);
+	cache = get_cache();
+	u = gale_map_find(cache->map,hash);
+	if (NULL != u) {
+		++(cache->hits);
+		unlink_unwrapped(cache,u);
+		link_unwrapped(cache,u);
+		length = u->key_len;
+		memcpy(raw,u->key,length);
+	} else
+		++(cache->misses);
+	thread_unlock(session_lock);
+	if (NULL != u) return length;
+
+	/* The RSA output may be longer than any session key. */
+	buffer = gale_malloc_atomic(EVP_PKEY_size(pkey));
+	length = RSA_private_decrypt(wrapped.l,wrapped.p,buffer,
+		(RSA *) EVP_PKEY_get0_RSA(pkey),RSA_PKCS1_PADDING);
+	if (length > EVP_MAX_KEY_LENGTH) length = -1;
+	if (length > 0) memcpy(raw,buffer,length);
+	memset(buffer,0,EVP_PKEY_size(pkey));
+	if (length <= 0) return -1;
+
+	gale_create(u);
+	u->hash = hash;
+	u->key_len = length;
+	memcpy(u->key,raw,length);
+
+	thread_lock(session_lock);
+	if (NULL == gale_map_find(cache->map,hash)) {
+		while (cache->count >= cache->limit && NULL != cache->tail) {
+			struct unwrapped * const old = cache->tail;
+			unlink_unwrapped(cache,old);
+			gale_map_add(cache->map,old->hash,NULL);
+			memset(old->key,0,sizeof(old->key));
+			--(cache->count);
+		}
+
+		gale_map_add(cache->map,u->hash,u);
+		link_unwrapped(cache,u);
+		++(cache->count);
+	}
+	thread_unlock(session_lock);
+	return length;
+}
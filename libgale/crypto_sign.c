@@ -32,29 +32,27 @@ int gale_crypto_sign(int key_count,
 			gale_alert(GALE_WARNING,G_("cannot sign without private key"),0);
 			return 0;
 		}
-		if (!gale_group_lookup(keys[i],G_("key.id"),frag_text,&frag)) {
+		if (!gale_group_lookup(keys[i],GA_("key.id"),frag_text,&frag)) {
 			gale_alert(GALE_WARNING,G_("key with no name"),0);
 			return 0;
 		}
 		name[i] = frag.value.text;
 
-		if (gale_group_lookup(keys[i],G_("key.source"),frag_data,&frag))
+		if (gale_group_lookup(keys[i],GA_("key.source"),frag_data,&frag))
 			source[i] = frag.value.data;
 		else
 			source[i] = null_data;
 	}
 
-	original.l = 0;
-	original.p = gale_malloc(gale_u32_size() + gale_group_size(*data));
-	gale_pack_u32(&original,0);
-	gale_pack_group(&original,*data);
-	sigs = gale_crypto_sign_raw(key_count,keys,original);
-	if (NULL == sigs) return 0;
-
-	if (1 == key_count
+	/* A single RSA signature uses the old security/signature format;
+	   otherwise, each signature is a member of auth.signature, stored as
+	   "data" (RSA with MD5) or "ed25519" (Ed25519 with SHA-512). */
+	if (1 == key_count && !crypto_i_is_ed25519(keys[0])
 	&& (0 == source[0].l
 	|| !gale_text_compare(name[0],key_i_name(source[0])))) {
 		struct gale_fragment frag;
+		size_t reserve;
+		byte *buffer;
 		int sig_len;
 
 		if (0 == source[0].l) {
@@ -66,6 +64,23 @@ int gale_crypto_sign(int key_count,
 			gale_pack_text(&source[0],raw_name);
 		}
 
+		/* The original data goes at the end of the signature fragment;
+		   pack it there directly, leaving room for the header. */
+		reserve = gale_u32_size()
+			+ sizeof(sig_magic)
+			+ gale_u32_size()
+			+ gale_copy_size(GALE_SIGNATURE_LEN)
+			+ gale_copy_size(source->l);
+		buffer = gale_malloc(
+			reserve + gale_u32_size() + gale_group_size(*data));
+		original.p = buffer + reserve;
+		original.l = 0;
+		gale_pack_u32(&original,0);
+		gale_pack_group(&original,*data);
+
+		sigs = gale_crypto_sign_raw(key_count,keys,original);
+		if (NULL == sigs) return 0;
+
 		sig_len = sizeof(sig_magic)
 			+ gale_u32_size()
 			+ gale_copy_size(sigs->l)
@@ -74,10 +89,17 @@ int gale_crypto_sign(int key_count,
 		frag.name = G_("security/signature");
 		frag.type = frag_data;
 		frag.value.data.l = 0;
-		frag.value.data.p = gale_malloc(
-			  gale_u32_size()
-			+ sig_len
-			+ gale_copy_size(original.l));
+		if (gale_u32_size() + sig_len <= reserve)
+			frag.value.data.p = original.p - gale_u32_size() - sig_len;
+		else {
+			/* Larger signature than expected. */
+			frag.value.data.p = gale_malloc(
+				  gale_u32_size()
+				+ sig_len
+				+ gale_copy_size(original.l));
+			memcpy(frag.value.data.p + gale_u32_size() + sig_len,
+			       original.p,original.l);
+		}
 
 		gale_pack_u32(&frag.value.data,sig_len);
 		gale_pack_copy(&frag.value.data,sig_magic,sizeof(sig_magic));
@@ -85,12 +107,16 @@ int gale_crypto_sign(int key_count,
 		gale_pack_copy(&frag.value.data,sigs->p,sigs->l);
 		gale_pack_copy(&frag.value.data,source->p,source->l);
 		assert(sig_len + gale_u32_size() == frag.value.data.l);
-		gale_pack_copy(&frag.value.data,original.p,original.l);
+		frag.value.data.l += original.l;
 
 		*data = gale_group_empty();
 		gale_group_add(data,frag);
 	} else {
 		struct gale_fragment frag;
+
+		sigs = crypto_i_sign_group(key_count,keys,*data);
+		if (NULL == sigs) return 0;
+
 		frag.name = G_("auth.signature");
 		frag.type = frag_group;
 		frag.value.group = gale_group_empty();
@@ -109,7 +135,8 @@ int gale_crypto_sign(int key_count,
 				gale_group_add(&sub.value.group,subsub);
 			}
 
-			subsub.name = G_("data");
+			subsub.name = crypto_i_is_ed25519(keys[i]) 
+				? G_("ed25519") : G_("data");
 			subsub.type = frag_data;
 			subsub.value.data = sigs[i];
 			gale_group_add(&sub.value.group,subsub);
@@ -136,7 +163,7 @@ const struct gale_text *gale_crypto_sender(struct gale_group signed_group) {
 	if (gale_group_null(signed_group)) return &null_text;
 
 	if (gale_group_lookup(signed_group,
-		G_("security/signature"),frag_data,&frag))
+		GA_("security/signature"),frag_data,&frag))
 	{
 		u32 len;
 		struct gale_data sig = frag.value.data;
@@ -157,7 +184,7 @@ const struct gale_text *gale_crypto_sender(struct gale_group signed_group) {
 
 	frag = gale_group_first(signed_group);
 	if (frag_group == frag.type
-	&& !gale_text_compare(frag.name,G_("auth.signature")))
+	&& !gale_text_compare(frag.name,GA_("auth.signature")))
 	{
 		struct gale_group group = frag.value.group;
 		int count = 0;
@@ -197,7 +224,7 @@ const struct gale_data *gale_crypto_bundled(struct gale_group signed_group) {
 
 	frag = gale_group_first(signed_group);
 	if (frag_group == frag.type
-	&& !gale_text_compare(frag.name,G_("auth.signature")))
+	&& !gale_text_compare(frag.name,GA_("auth.signature")))
 	{
 		struct gale_group group = frag.value.group;
 		int count = 0;
@@ -215,7 +242,7 @@ const struct gale_data *gale_crypto_bundled(struct gale_group signed_group) {
 			struct gale_fragment subsub;
 			group = gale_group_rest(group);
 			if (frag_group == sub.type
-			&&  gale_group_lookup(sub.value.group,G_("key"),
+			&&  gale_group_lookup(sub.value.group,GA_("key"),
 				frag_data,&subsub))
 				output[count++] = subsub.value.data;
 		}
@@ -225,7 +252,7 @@ const struct gale_data *gale_crypto_bundled(struct gale_group signed_group) {
 	}
 
 	if (gale_group_lookup(signed_group,
-		G_("security/signature"),
+		GA_("security/signature"),
 		frag_data,&frag))
 	{
 		u32 len;
@@ -263,11 +290,11 @@ struct gale_group gale_crypto_original(struct gale_group signed_group)
 	frag = gale_group_first(signed_group);
 
 	if (frag_group == frag.type
-	&& !gale_text_compare(frag.name,G_("auth.signature")))
+	&& !gale_text_compare(frag.name,GA_("auth.signature")))
 		return gale_group_rest(signed_group);
 
 	if (gale_group_lookup(signed_group,
-		G_("security/signature"),
+		GA_("security/signature"),
 		frag_data,&frag))
 	{
 		struct gale_data data = frag.value.data;
@@ -275,7 +302,7 @@ struct gale_group gale_crypto_original(struct gale_group signed_group)
 		u32 zero;
 		if (gale_unpack_skip(&data)
 		&&  gale_unpack_u32(&data,&zero) && 0 == zero
-		&&  gale_unpack_group(&data,&output)) return output;
+		&&  gale_view_group(&data,&output)) return output;
 	}
 
 	return signed_group;
@@ -293,7 +320,7 @@ int gale_crypto_verify(int key_count,
 	const struct gale_group *keys,
 	struct gale_group signed_group) 
 {
-	int i;
+	int i,is_group = 0;
 	struct gale_fragment frag;
 	struct gale_data *sigs,original_data = null_data;
 	struct gale_text *names;
@@ -302,7 +329,7 @@ int gale_crypto_verify(int key_count,
 	gale_create_array(sigs,key_count);
 	for (i = 0; i < key_count; ++i) {
 		struct gale_fragment frag;
-		if (!gale_group_lookup(keys[i],G_("key.id"),frag_text,&frag)) {
+		if (!gale_group_lookup(keys[i],GA_("key.id"),frag_text,&frag)) {
 			gale_alert(GALE_WARNING,G_("key with no name"),0);
 			return 0;
 		}
@@ -312,30 +339,27 @@ int gale_crypto_verify(int key_count,
 
 	frag = gale_group_first(signed_group);
 	if (frag_group == frag.type
-	&& !gale_text_compare(frag.name,G_("auth.signature"))) {
-		struct gale_group orig = gale_group_rest(signed_group);
-		original_data.p = gale_malloc(
-			  gale_u32_size()
-			+ gale_group_size(orig));
-		original_data.l = 0;
-		gale_pack_u32(&original_data,0);
-		gale_pack_group(&original_data,orig);
-
-		while (!gale_group_null(frag.value.group)) {
-			struct gale_fragment sub,subsub;
-			sub = gale_group_first(frag.value.group);
-			frag.value.group = 
-				gale_group_rest(frag.value.group);
-			for (i = 0; i < key_count; ++i)
-				if (frag_group == sub.type
-				&& !gale_text_compare(sub.name,names[i])
-				&& gale_group_lookup(sub.value.group,
-					G_("data"),frag_data,&subsub))
+	&& !gale_text_compare(frag.name,GA_("auth.signature"))) {
+		const struct gale_group_index *index = 
+			gale_make_group_index(frag.value.group);
+
+		is_group = 1;
+		for (i = 0; i < key_count; ++i) {
+			const struct gale_text sig_name = 
+				crypto_i_is_ed25519(keys[i])
+				? GA_("ed25519") : GA_("data");
+			const struct gale_fragment *sub;
+			struct gale_fragment subsub;
+			int j,count = gale_index_find(index,
+				names[i],frag_group,&sub);
+			for (j = 0; j < count; ++j)
+				if (gale_group_lookup(sub[j].value.group,
+					sig_name,frag_data,&subsub))
 					sigs[i] = subsub.value.data;
 		}
 	}
 	else if (gale_group_lookup(signed_group,
-		G_("security/signature"),
+		GA_("security/signature"),
 		frag_data,&frag)) 
 	{
 		struct gale_data key,sig;
@@ -361,12 +385,16 @@ int gale_crypto_verify(int key_count,
 
 		name = key_i_name(key);
 		for (i = 0; i < key_count; ++i)
-			if (!gale_text_compare(name,names[i]))
+			if (!crypto_i_is_ed25519(keys[i])
+			&&  !gale_text_compare(name,names[i]))
 				sigs[i] = sig;
 	}
 
 	for (i = 0; i < key_count; ++i)
 		if (0 == sigs[i].l) return 0;
 
+	if (is_group)
+		return crypto_i_verify_group(key_count,keys,sigs,
+			gale_group_rest(signed_group));
 	return gale_crypto_verify_raw(key_count,keys,sigs,original_data);
 }
@@ -1,42 +1,151 @@
 #include "crypto_i.h"
+#include "thread_i.h"
 #include "gale/crypto.h"
+#include "gale/globals.h"
 
 #include <assert.h>
 #include <openssl/evp.h>
 
-/** Low-level signature operation.
- *  \param key_count Number of keys in the \a source array.
- *  \param source Array of keys.  The keys must include private key data.
- *  \param data Data to sign.
- *  \return Array of signatures, one for each key,
- *          or NULL if the operation failed. 
- *  \sa gale_crypto_verify_raw(), gale_crypto_sign() */
-const struct gale_data *gale_crypto_sign_raw(int key_count,
-        const struct gale_group *source,
-        struct gale_data data)
+/* RSA keys sign an MD5 digest of the data; Ed25519 keys sign its SHA-512
+   digest.  Whichever the keys need are computed in the same pass. */
+struct digest {
+	EVP_MD_CTX *md5,*sha512; /* NULL if not needed */
+};
+
+/* Returns zero if the contexts couldn't be set up; 
+   call digest_free() either way. */
+static int digest_init(struct digest *digest,
+	int key_count,const struct gale_group *keys)
 {
+	int i,use_md5 = 0,use_sha512 = 0;
+	for (i = 0; i < key_count; ++i)
+		if (crypto_i_is_ed25519(keys[i])) 
+			use_sha512 = 1;
+		else
+			use_md5 = 1;
+
+	digest->md5 = use_md5 ? EVP_MD_CTX_new() : NULL;
+	digest->sha512 = use_sha512 ? EVP_MD_CTX_new() : NULL;
+	if ((use_md5 && (NULL == digest->md5 
+	                 || !EVP_DigestInit(digest->md5,EVP_md5())))
+	||  (use_sha512 && (NULL == digest->sha512 
+	                 || !EVP_DigestInit(digest->sha512,EVP_sha512())))) {
+		crypto_i_error();
+		return 0;
+	}
+
+	return 1;
+}
+
+static void digest_free(struct digest *digest) {
+	if (NULL != digest->md5) EVP_MD_CTX_free(digest->md5);
+	if (NULL != digest->sha512) EVP_MD_CTX_free(digest->sha512);
+}
+
+static void digest_update(struct gale_data data,void *user) {
+	struct digest * const digest = (struct digest *) user;
+	if (NULL != digest->md5) 
+		EVP_DigestUpdate(digest->md5,data.p,data.l);
+	if (NULL != digest->sha512) 
+		EVP_DigestUpdate(digest->sha512,data.p,data.l);
+}
+
+/* Finish a copy of a digest, so the original can be used again. */
+static unsigned int digest_final(EVP_MD_CTX *context,unsigned char *out) {
+	EVP_MD_CTX *copy = EVP_MD_CTX_new();
+	unsigned int len = 0;
+	if (NULL == copy) return 0;
+	if (EVP_MD_CTX_copy(copy,context)) EVP_DigestFinal(copy,out,&len);
+	EVP_MD_CTX_free(copy);
+	return len;
+}
+
+/* Signed groups are prefixed with a (zero) version number. */
+static void group_update(struct digest *digest,struct gale_group group) {
+	byte buf[sizeof(u32)];
+	struct gale_data zero;
+	zero.p = buf;
+	zero.l = 0;
+	gale_pack_u32(&zero,0);
+	digest_update(zero,digest);
+	gale_write_group(group,digest_update,digest);
+}
+
+#ifdef EVP_PKEY_ED25519
+static int is_ed25519(EVP_PKEY *key) {
+	return EVP_PKEY_ED25519 == EVP_PKEY_id(key);
+}
+
+static int ed25519_sign(EVP_PKEY *key,
+	const unsigned char *digest,unsigned int digest_len,
+	struct gale_data *sig)
+{
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
+	size_t sig_len = GALE_ED25519_SIGNATURE_LEN;
+	int ok;
+
+	sig->p = gale_malloc_atomic(sig_len);
+	ok = NULL != context
+	  && EVP_DigestSignInit(context,NULL,NULL,NULL,key)
+	  && EVP_DigestSign(context,sig->p,&sig_len,digest,digest_len);
+	sig->l = sig_len;
+	EVP_MD_CTX_free(context);
+	return ok;
+}
+
+static int ed25519_verify(EVP_PKEY *key,
+	const unsigned char *digest,unsigned int digest_len,
+	struct gale_data sig)
+{
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
+	int ok = NULL != context
+	  && EVP_DigestVerifyInit(context,NULL,NULL,NULL,key)
+	  && 1 == EVP_DigestVerify(context,sig.p,sig.l,digest,digest_len);
+	EVP_MD_CTX_free(context);
+	return ok;
+}
+#else
+#define is_ed25519(key) 0
+#define ed25519_sign(key,digest,digest_len,sig) 0
+#define ed25519_verify(key,digest,digest_len,sig) 0
+#endif
+
+static const struct gale_data *sign_final(int key_count,
+	const struct gale_group *source,
+	struct digest *digest)
+{
+	unsigned char sha512[EVP_MAX_MD_SIZE];
+	unsigned int sha512_len = 0,sig_len;
 	int i;
 	struct gale_data *output;
-	EVP_MD_CTX context;
-	EVP_SignInit(&context,EVP_md5());
-	EVP_SignUpdate(&context,data.p,data.l);
+
+	if (NULL != digest->sha512) 
+		sha512_len = digest_final(digest->sha512,sha512);
 
 	gale_create_array(output,key_count);
 	for (i = 0; NULL != output && i < key_count; ++i) {
-		EVP_PKEY *key = EVP_PKEY_new();
-		EVP_PKEY_assign_RSA(key,RSA_new());
-		crypto_i_rsa(source[i],key->pkey.rsa);
-		if (!crypto_i_private_valid(key->pkey.rsa)) {
+		EVP_PKEY *key = crypto_i_private(source[i],NULL);
+		if (NULL == key) {
 			gale_alert(GALE_WARNING,G_("invalid private key"),0);
 			output = NULL;
-			goto cleanup;
+			break;
 		}
 
-		output[i].p = gale_malloc(EVP_PKEY_size(key));
-		if (!EVP_SignFinal(&context,output[i].p,&output[i].l,key)) {
-			crypto_i_error();
-			output = NULL;
-			goto cleanup;
+		if (is_ed25519(key)) {
+			if (!ed25519_sign(key,sha512,sha512_len,&output[i])) {
+				crypto_i_error();
+				output = NULL;
+				goto cleanup;
+			}
+		} else {
+			output[i].p = gale_malloc(EVP_PKEY_size(key));
+			if (!EVP_SignFinal(digest->md5,
+				output[i].p,&sig_len,key)) {
+				crypto_i_error();
+				output = NULL;
+				goto cleanup;
+			}
+			output[i].l = sig_len;
 		}
 
 	cleanup:
@@ -46,42 +155,284 @@ const struct gale_data *gale_crypto_sign_raw(int key_count,
 	return output;
 }
 
-/** Low-level signature verification.
- *  \param key_count Number of keys in the \a keys array 
- *         and number fo signatures in the \a sigs array.
- *  \param keys Array of keys.  The keys must include public key data.
- *  \param sigs Array of signatures, as returned from gale_crypto_sign_raw().
- *  \param data Data to verify against signatures.
- *  \return Nonzero iff the all signatures are valid. */
-int gale_crypto_verify_raw(int key_count,
-        const struct gale_group *keys,
-        const struct gale_data *sigs,
-        struct gale_data data)
+/* Successful verifications are remembered, so a signature we've already
+   checked (a bundled key that comes with every message, say) doesn't cost
+   another public-key operation.  Entries are keyed by a SHA-256 hash of the
+   key's fingerprint, the digest of the signed data and the signature;
+   they also keep the key fingerprint, so crypto_i_forget_verified() can
+   find them.  The cache holds at most GALE_VERIFY_CACHE entries (default
+   1024) and drops the least recently used one when it's full.  Failures
+   are not cached.  The cache is shared with worker threads (under verify_lock). */
+
+#define DEFAULT_VERIFY_CACHE 1024
+
+struct verified {
+	struct gale_data hash,print;
+	struct verified *prev,*next;
+};
+
+struct verify_cache {
+	struct gale_map *map;
+	struct verified *head,*tail;
+	int count,limit;
+	unsigned long hits,misses,evictions,forgotten;
+};
+
+THREAD_LOCK(verify_lock);
+static struct verify_cache *verify_cache = NULL;
+
+static struct gale_text verify_cache_report(void *x) {
+	return gale_text_concat(13,
+		G_("signatures: cached="),
+		gale_text_from_number(verify_cache->count,10,0),
+		G_("/"),gale_text_from_number(verify_cache->limit,10,0),
+		G_(", hits="),gale_text_from_number(verify_cache->hits,10,0),
+		G_(", misses="),gale_text_from_number(verify_cache->misses,10,0),
+		G_(", evictions="),
+		gale_text_from_number(verify_cache->evictions,10,0),
+		G_(", forgotten="),
+		gale_text_from_number(verify_cache->forgotten,10,0),
+		G_("\n"));
+}
+
+/** \internal Set up the verification cache. */
+void crypto_i_verify_init(void) {
+	thread_lock(verify_lock);
+	if (NULL == verify_cache) {
+		verify_cache = gale_malloc_safe(sizeof(*verify_cache));
+		verify_cache->map = gale_make_map(0);
+		verify_cache->head = verify_cache->tail = NULL;
+		verify_cache->count = 0;
+		verify_cache->limit = gale_text_to_number(
+			gale_var(G_("GALE_VERIFY_CACHE")));
+		if (verify_cache->limit <= 0) 
+			verify_cache->limit = DEFAULT_VERIFY_CACHE;
+		verify_cache->hits = verify_cache->misses = 0;
+		verify_cache->evictions = verify_cache->forgotten = 0;
+		gale_report_add(gale_global->report,verify_cache_report,NULL);
+	}
+	thread_unlock(verify_lock);
+}
+
+static void unlink_verified(struct verify_cache *cache,struct verified *v) {
+	if (NULL != v->prev) v->prev->next = v->next;
+	else cache->head = v->next;
+	if (NULL != v->next) v->next->prev = v->prev;
+	else cache->tail = v->prev;
+	v->prev = v->next = NULL;
+}
+
+static void link_verified(struct verify_cache *cache,struct verified *v) {
+	v->prev = NULL;
+	v->next = cache->head;
+	if (NULL != cache->head) cache->head->prev = v;
+	else cache->tail = v;
+	cache->head = v;
+}
+
+static void drop_verified(struct verify_cache *cache,struct verified *v) {
+	unlink_verified(cache,v);
+	gale_map_add(cache->map,v->hash,NULL);
+	--(cache->count);
+}
+
+static struct gale_data verify_hash(
+	struct gale_data print,
+	const unsigned char *digest,unsigned int digest_len,
+	struct gale_data sig)
 {
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
+	struct gale_data hash;
+	byte buf[sizeof(u32)];
+	struct gale_data len;
+	unsigned int hash_len;
+
+	/* Without a hash, the signature just won't be cached. */
+	if (NULL == context) return null_data;
+	hash.p = gale_malloc_atomic(EVP_MAX_MD_SIZE);
+	EVP_DigestInit(context,EVP_sha256());
+
+	/* Length-prefix the variable parts so they can't run together. */
+	len.p = buf;
+	len.l = 0;
+	gale_pack_u32(&len,print.l);
+	EVP_DigestUpdate(context,len.p,len.l);
+	EVP_DigestUpdate(context,print.p,print.l);
+	EVP_DigestUpdate(context,digest,digest_len);
+	EVP_DigestUpdate(context,sig.p,sig.l);
+	EVP_DigestFinal(context,hash.p,&hash_len);
+	EVP_MD_CTX_free(context);
+	hash.l = hash_len;
+	return hash;
+}
+
+/** \internal Forget any signatures verified with a key.
+ *  \param print Key fingerprint, from crypto_i_fingerprint(). */
+void crypto_i_forget_verified(struct gale_data print) {
+	struct verified *v,*next;
+	if (NULL == verify_cache) return;
+	thread_lock(verify_lock);
+	for (v = verify_cache->head; NULL != v; v = next) {
+		next = v->next;
+		if (!gale_data_compare(v->print,print)) {
+			++(verify_cache->forgotten);
+			drop_verified(verify_cache,v);
+		}
+	}
+	thread_unlock(verify_lock);
+}
+
+static int verify_final(int key_count,
+	const struct gale_group *keys,
+	const struct gale_data *sigs,
+	struct digest *digest)
+{
+	struct verify_cache *cache;
+	unsigned char md5[EVP_MAX_MD_SIZE],sha512[EVP_MAX_MD_SIZE];
+	unsigned int md5_len = 0,sha512_len = 0;
 	int i,is_valid = 1;
-	EVP_MD_CTX context;
 
-	EVP_VerifyInit(&context,EVP_md5());
-	EVP_VerifyUpdate(&context,data.p,data.l);
+	if (NULL != digest->md5) md5_len = digest_final(digest->md5,md5);
+	if (NULL != digest->sha512) 
+		sha512_len = digest_final(digest->sha512,sha512);
+
+	crypto_i_verify_init();
+	cache = verify_cache;
 	for (i = 0; is_valid && i < key_count; ++i) {
-		EVP_PKEY *key = EVP_PKEY_new();
-		EVP_PKEY_assign_RSA(key,RSA_new());
-		crypto_i_rsa(keys[i],key->pkey.rsa);
-		if (!crypto_i_public_valid(key->pkey.rsa)) {
+		const int use_sha512 = crypto_i_is_ed25519(keys[i]);
+		const struct gale_data print = crypto_i_fingerprint(keys[i]);
+		const struct gale_data hash = use_sha512
+			? verify_hash(print,sha512,sha512_len,sigs[i])
+			: verify_hash(print,md5,md5_len,sigs[i]);
+		struct verified *v;
+		EVP_PKEY *key;
+
+		thread_lock(verify_lock);
+		v = 0 == hash.l ? NULL : gale_map_find(cache->map,hash);
+		if (NULL != v) {
+			++(cache->hits);
+			unlink_verified(cache,v);
+			link_verified(cache,v);
+		} else
+			++(cache->misses);
+		thread_unlock(verify_lock);
+		if (NULL != v) continue;
+
+		key = crypto_i_public(keys[i],NULL);
+		if (NULL == key) {
+			gale_alert(GALE_WARNING,G_("invalid public key"),0);
+			is_valid = 0;
+			break;
+		}
+
+		if (use_sha512 != is_ed25519(key)) {
 			gale_alert(GALE_WARNING,G_("invalid public key"),0);
 			is_valid = 0;
 			goto cleanup;
 		}
 
-		if (!EVP_VerifyFinal(&context,sigs[i].p,sigs[i].l,key)) {
+		if (use_sha512 
+		?  !ed25519_verify(key,sha512,sha512_len,sigs[i])
+		:  !EVP_VerifyFinal(digest->md5,sigs[i].p,sigs[i].l,key)) {
 			crypto_i_error();
 			is_valid = 0;
 			goto cleanup;
 		}
 
+		if (0 == hash.l) goto cleanup;
+		gale_create(v);
+		v->hash = hash;
+		v->print = print;
+
+		thread_lock(verify_lock);
+		if (NULL == gale_map_find(cache->map,hash)) {
+			while (cache->count >= cache->limit 
+			&&     NULL != cache->tail) {
+				++(cache->evictions);
+				drop_verified(cache,cache->tail);
+			}
+
+			gale_map_add(cache->map,v->hash,v);
+			link_verified(cache,v);
+			++(cache->count);
+		}
+		thread_unlock(verify_lock);
+
 	cleanup:
 		EVP_PKEY_free(key);
 	}
 
 	return is_valid;
 }
+
+/** Low-level signature operation.
+ *  \param key_count Number of keys in the \a source array.
+ *  \param source Array of keys.  The keys must include private key data.
+ *  \param data Data to sign.
+ *  \return Array of signatures, one for each key,
+ *          or NULL if the operation failed. 
+ *  \sa gale_crypto_verify_raw(), gale_crypto_sign() */
+const struct gale_data *gale_crypto_sign_raw(int key_count,
+        const struct gale_group *source,
+        struct gale_data data)
+{
+	struct digest digest;
+	const struct gale_data *output = NULL;
+	if (digest_init(&digest,key_count,source)) {
+		digest_update(data,&digest);
+		output = sign_final(key_count,source,&digest);
+	}
+	digest_free(&digest);
+	return output;
+}
+
+const struct gale_data *crypto_i_sign_group(int key_count,
+        const struct gale_group *source,
+        struct gale_group group)
+{
+	struct digest digest;
+	const struct gale_data *output = NULL;
+	if (digest_init(&digest,key_count,source)) {
+		group_update(&digest,group);
+		output = sign_final(key_count,source,&digest);
+	}
+	digest_free(&digest);
+	return output;
+}
+
+/** Low-level signature verification.
+ *  \param key_count Number of keys in the \a keys array 
+ *         and number fo signatures in the \a sigs array.
+ *  \param keys Array of keys.  The keys must include public key data.
+ *  \param sigs Array of signatures, as returned from gale_crypto_sign_raw().
+ *  \param data Data to verify against signatures.
+ *  \return Nonzero iff the all signatures are valid. */
+int gale_crypto_verify_raw(int key_count,
+        const struct gale_group *keys,
+        const struct gale_data *sigs,
+        struct gale_data data)
+{
+	struct digest digest;
+	int is_valid = 0;
+	if (digest_init(&digest,key_count,keys)) {
+		digest_update(data,&digest);
+		is_valid = verify_final(key_count,keys,sigs,&digest);
+	}
+	digest_free(&digest);
+	return is_valid;
+}
+
+int crypto_i_verify_group(int key_count,
+        const struct gale_group *keys,
+        const struct gale_data *sigs,
+        struct gale_group group)
+{
+	struct digest digest;
+	int is_valid = 0;
+	if (digest_init(&digest,key_count,keys)) {
+		group_update(&digest,group);
+		is_valid = verify_final(key_count,keys,sigs,&digest);
+	}
+	digest_free(&digest);
+	return is_valid;
+}
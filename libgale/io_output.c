@@ -51,7 +51,7 @@ int output_buffer_ready(struct output_buffer *buf) {
 int output_buffer_write(struct output_buffer *buf,int fd) {
 	struct iovec vec[NUM_SEG];
 	size_t count = 0;
-	int sptr,w;
+	int sptr,w = 0;
 
 	while (buf->shead != buf->stail && buf->bhead != buf->btail
 	   &&  buf->state.ready(&buf->state)) {
@@ -60,24 +60,30 @@ int output_buffer_write(struct output_buffer *buf,int fd) {
 		if (prev == buf->shead) break;
 	}
 
+	/* Empty segments (say, a message with no content) need no iovec. */
 	sptr = buf->stail;
 	if (NUM_SEG == ++sptr) sptr = 0;
-	if (sptr != buf->shead) {
+	if (sptr == buf->shead) return 0;
+	if (buf->seg[sptr].data.l > buf->remnant) {
 		vec[count].iov_base = buf->seg[sptr].data.p + buf->remnant;
 		vec[count].iov_len = buf->seg[sptr].data.l - buf->remnant;
 		++count;
-		if (NUM_SEG == ++sptr) sptr = 0;
-		while (sptr != buf->shead) {
+	}
+	if (NUM_SEG == ++sptr) sptr = 0;
+	while (sptr != buf->shead) {
+		if (0 != buf->seg[sptr].data.l) {
 			vec[count].iov_base = buf->seg[sptr].data.p;
 			vec[count].iov_len = buf->seg[sptr].data.l;
 			++count;
-			if (NUM_SEG == ++sptr) sptr = 0;
 		}
+		if (NUM_SEG == ++sptr) sptr = 0;
 	}
 
-	if (0 == count) return 0;
-	w = writev(fd,vec,count);
-	if (w <= 0) return -(errno != EINTR);
+	/* If only empty segments are left, they're done without writing. */
+	if (0 != count) {
+		w = writev(fd,vec,count);
+		if (w <= 0) return -(errno != EINTR);
+	}
 
 	w += buf->remnant;
 	sptr = buf->stail;
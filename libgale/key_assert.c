@@ -1,4 +1,5 @@
 #include "key_i.h"
+#include "crypto_i.h"
 #include "gale/key.h"
 #include "gale/crypto.h"
 #include "gale/misc.h"
@@ -17,6 +18,7 @@ static struct gale_key_assertion *create(struct gale_time time,int is_trusted) {
 	output->group = gale_group_empty();
 	output->stamp = time;
 	output->signer = NULL;
+	output->index = NULL;
 	return output;
 }
 
@@ -46,7 +48,7 @@ static int public_good(struct gale_key_assertion *assert) {
 static int not_expired(struct gale_key *key,struct gale_time now) {
 	struct gale_fragment f;
 	if (key->public->trust_count > 0) return 1;
-	if (gale_group_lookup(key->public->group,G_("key.expires"),frag_time,&f)
+	if (gale_group_lookup(key->public->group,GA_("key.expires"),frag_time,&f)
 	&& !gale_time_compare(now,f.value.time)) return 0;
 	return not_expired(key->signer,now);
 }
@@ -167,11 +169,11 @@ static int beats(
 		assert(!challenger->trust_count);
 
 		if (!gale_group_lookup(challenger->group,
-			G_("key.signed"),frag_time,&c))
+			GA_("key.signed"),frag_time,&c))
 			c.value.time = gale_time_zero();
 
 		if (!gale_group_lookup(incumbent->group,
-			G_("key.signed"),frag_time,&i))
+			GA_("key.signed"),frag_time,&i))
 			i.value.time = gale_time_zero();
 
 		compare = gale_time_compare(i.value.time,c.value.time);
@@ -250,6 +252,7 @@ struct gale_key_assertion *gale_key_assert(
 				G_("\": replacing obsolete private key "),
                                 key->private->from,G_(" with key "),
                                 from),0);
+			crypto_i_forget(gale_key_data(key->private));
 			key->private->key = NULL;
 		}
 
@@ -306,9 +309,11 @@ struct gale_key_assertion *gale_key_assert(
                                 key->public->from,G_(" with key "),
                                 from),0);
 			assert(key->public->key == key);
+			crypto_i_forget(gale_key_data(key->public));
 			key->public->key = NULL;
 		}
 		key->public = output;
+		++(key->version);
 		assert(key->public->key == key);
 	} else {
 		if (NULL == key->public)
@@ -358,9 +363,11 @@ void gale_key_retract(struct gale_key_assertion *ass,int is_trusted) {
 		gale_key_retract(*ass->bundled++,0);
 
 	if (NULL != ass->key) {
-		if (ass->key->public == ass)
+		crypto_i_forget(gale_key_data(ass));
+		if (ass->key->public == ass) {
 			ass->key->public = NULL;
-		else if (ass->key->private == ass)
+			++(ass->key->version);
+		} else if (ass->key->private == ass)
 			ass->key->private = NULL;
 		ass->key = NULL;
 	}
@@ -403,6 +410,16 @@ struct gale_group gale_key_data(const struct gale_key_assertion *assert) {
 	return gale_crypto_original(assert->group);
 }
 
+const struct gale_group_index *key_i_index(
+	const struct gale_key_assertion *assert) 
+{
+	struct gale_key_assertion * const cache = 
+		(struct gale_key_assertion *) assert;
+	if (NULL == cache->index) 
+		cache->index = gale_make_group_index(gale_key_data(assert));
+	return cache->index;
+}
+
 /** Get the original, raw data associated with a key.
  *  \param assert Assertion handle from gale_key_public() 
  *         or gale_key_private(). */
@@ -1,6 +1,34 @@
 #include "key_i.h"
 #include "gale/misc.h"
 
+/* Each root key remembers its last expansion (for each kind of membership
+   fragment): every key reached, with the version and public key its direct
+   members came from.  The next expansion starts from there.  The root is
+   always searched; other keys whose version and public key haven't changed
+   are expanded from the cache without a search, and only keys that have
+   changed (or are new to the expansion) are searched, with the caller's
+   flags, and expanded afresh.  Once an expansion is GALE_GRAPH_REFRESH
+   seconds old (default 300), the whole graph is searched again, so changes
+   only a slow search (like AKD) would find are still picked up. */
+
+#define DEFAULT_GRAPH_REFRESH 300
+
+struct graph_node {
+	struct gale_key *key;
+	int version;
+	const struct gale_key_assertion *ass;
+	struct gale_text *members;
+	int count,has_null;
+};
+
+struct key_i_closure {
+	struct gale_text name;
+	int flags;
+	struct gale_time expires;
+	struct gale_map *nodes; /* key name -> struct graph_node */
+	struct key_i_closure *next;
+};
+
 struct graph {
 	struct gale_text name;
 	int flags;
@@ -8,6 +36,8 @@ struct graph {
 	void *user;
 	struct gale_time now;
 	struct gale_map *map;
+	struct key_i_closure *closure;
+	struct gale_map *old,*nodes;
 	int is_complete;
 	int has_null;
 	int out;
@@ -15,6 +45,98 @@ struct graph {
 
 static gale_key_call found;
 
+static int refresh_interval(void) {
+	static int refresh = 0;
+	if (0 == refresh) {
+		refresh = gale_text_to_number(gale_var(G_("GALE_GRAPH_REFRESH")));
+		if (refresh <= 0) refresh = DEFAULT_GRAPH_REFRESH;
+	}
+	return refresh;
+}
+
+static struct key_i_closure *get_closure(
+	struct gale_key *root,struct gale_text name)
+{
+	struct key_i_closure *c = root->closures;
+	while (NULL != c && gale_text_compare(c->name,name)) c = c->next;
+	if (NULL == c) {
+		gale_create(c);
+		c->name = name;
+		c->flags = 0;
+		c->expires = gale_time_zero();
+		c->nodes = NULL;
+		c->next = root->closures;
+		root->closures = c;
+	}
+	return c;
+}
+
+/* Is a cached node still good for this key? */
+static const struct graph_node *current(const struct graph *g,
+	struct gale_key *key)
+{
+	const struct gale_key_assertion *ass;
+	const struct graph_node *node;
+	if (NULL == g->old) return NULL;
+	node = gale_map_find(g->old,gale_text_as_data(gale_key_name(key)));
+	if (NULL == node || node->version != key->version) return NULL;
+	ass = gale_key_public(key,g->now);
+	return (NULL != ass && node->ass == ass) ? node : NULL;
+}
+
+static const struct graph_node *make_node(const struct graph *g,
+	struct gale_key *key,const struct gale_key_assertion *ass)
+{
+	const struct gale_fragment *members;
+	struct graph_node *node;
+	int i;
+
+	gale_create(node);
+	node->key = key;
+	node->version = key->version;
+	node->ass = ass;
+	node->count = gale_index_find(key_i_index(ass),g->name,frag_text,&members);
+	node->has_null = 0;
+	gale_create_array(node->members,node->count);
+	for (i = 0; i < node->count; ++i) {
+		node->members[i] = members[i].value.text;
+		if (0 == node->members[i].l) node->has_null = 1;
+	}
+
+	return node;
+}
+
+static void visit(oop_source *,struct graph *,struct gale_key *);
+
+static void expand(oop_source *oop,struct graph *g,
+	const struct graph_node *node)
+{
+	int i;
+	gale_map_add(g->nodes,
+		gale_text_as_data(gale_key_name(node->key)),(void *) node);
+	if (node->has_null) g->has_null = 1;
+	for (i = 0; i < node->count; ++i) {
+		const struct gale_data name = gale_text_as_data(node->members[i]);
+		if (0 != name.l && NULL == gale_map_find(g->map,name)) {
+			struct gale_key * const member =
+				gale_key_handle(node->members[i]);
+			gale_map_add(g->map,name,member);
+			visit(oop,g,member);
+		}
+	}
+}
+
+/* Expand a member from the cache if we can; otherwise search for it. */
+static void visit(oop_source *oop,struct graph *g,struct gale_key *key) {
+	const struct graph_node * const node = current(g,key);
+	if (NULL != node)
+		expand(oop,g,node);
+	else {
+		++(g->out);
+		gale_key_search(oop,key,g->flags,found,g);
+	}
+}
+
 static void *found(oop_source *oop,struct gale_key *key,void *user) {
 	struct graph * const g = (struct graph *) user;
 	const struct gale_key_assertion * const ass = gale_key_public(key,g->now);
@@ -22,29 +144,19 @@ static void *found(oop_source *oop,struct gale_key *key,void *user) {
 	if (NULL == ass)
 		g->is_complete = 0;
 	else {
-		struct gale_group data = gale_key_data(ass);
-		data = gale_group_find(data,g->name,frag_text);
-		while (!gale_group_null(data)) {
-			const struct gale_fragment frag = 
-				gale_group_first(data);
-			const struct gale_data name = 
-				gale_text_as_data(frag.value.text);
-			if (0 == name.l)
-				g->has_null = 1;
-			else if (NULL == gale_map_find(g->map,name)) {
-				struct gale_key *key; 
-				++(g->out);
-				key = gale_key_handle(frag.value.text);
-				gale_map_add(g->map,name,key);
-				gale_key_search(oop,key,g->flags,found,g);
-			}
-
-			data = gale_group_find(gale_group_rest(data),
-				g->name,frag_text);
-		}
+		const struct graph_node *node = current(g,key);
+		if (NULL == node) node = make_node(g,key,ass);
+		expand(oop,g,node);
 	}
 
 	if (0 != --(g->out)) return OOP_CONTINUE;
+
+	/* Remember this expansion; a full one starts a new refresh period. */
+	if (NULL == g->old)
+		g->closure->expires = gale_time_add(g->now,
+			gale_time_seconds(refresh_interval()));
+	g->closure->flags = g->flags;
+	g->closure->nodes = g->nodes;
 	return g->func(oop,g->map,g->is_complete,g->has_null,g->user);
 }
 
@@ -59,9 +171,19 @@ void key_i_graph(oop_source *oop,
 	graph->func = func;
 	graph->user = user;
 	graph->now = gale_time_now();
-	graph->map = gale_make_map(0);
+	graph->map = gale_make_ordered_map(0);
+	graph->closure = get_closure(root,name);
+	graph->nodes = gale_make_map(0);
 	graph->is_complete = 1;
 	graph->has_null = 0;
 	graph->out = 1;
+
+	/* Reuse the last expansion unless it's due for a refresh, or was
+	   made with a less thorough search than this one. */
+	graph->old = graph->closure->nodes;
+	if (0 <= gale_time_compare(graph->now,graph->closure->expires)
+	||  0 != (flags & ~search_early & ~graph->closure->flags))
+		graph->old = NULL;
+
 	gale_key_search(oop,root,flags,found,graph);
 }
@@ -41,6 +41,8 @@ struct gale_key *gale_key_handle(struct gale_text name) {
 		key->public = NULL;
 		key->private = NULL;
 		key->search = NULL;
+		key->closures = NULL;
+		key->version = 0;
 		key->signer = gale_text_compare(s,name) 
 		            ? gale_key_handle(s)
 		            : NULL;
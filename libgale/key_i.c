@@ -107,7 +107,7 @@ const struct gale_data *key_i_bundled(struct gale_data key) {
 		struct gale_text text;
 		struct gale_group group;
 		if (gale_unpack_text(&key,&text)
-		&&  gale_unpack_group(&key,&group))
+		&&  gale_view_group(&key,&group))
 			return gale_crypto_bundled(group);
 	}
 
@@ -255,7 +255,7 @@ struct gale_group key_i_group(struct gale_data key) {
 		struct gale_text name;
 		struct gale_group group;
 		if (gale_unpack_text(&key,&name)
-		&&  gale_unpack_group(&key,&group)) {
+		&&  gale_view_group(&key,&group)) {
 			struct gale_fragment frag;
 			frag.name = G_("key.id");
 			frag.type = frag_text;
@@ -279,7 +279,7 @@ struct gale_group key_i_group(struct gale_data key) {
 		struct gale_text name;
 		struct gale_group group;
 		if (gale_unpack_text(&key,&name)
-		&&  gale_unpack_group(&key,&group)) {
+		&&  gale_view_group(&key,&group)) {
 			struct gale_fragment frag;
 			frag.name = G_("key.id");
 			frag.type = frag_text;
@@ -342,7 +342,7 @@ int key_i_verify(struct gale_data original,struct gale_group signer) {
 		struct gale_text text;
 		struct gale_group group;
 		if (gale_unpack_text(&key,&text)
-		&&  gale_unpack_group(&key,&group))
+		&&  gale_view_group(&key,&group))
 			return gale_crypto_verify(1,&signer,group);
 	}
 
@@ -360,11 +360,12 @@ struct gale_data key_i_create(struct gale_group source) {
 		original = gale_group_rest(original);
 
 		if (frag_text == first.type
-		&& !gale_text_compare(G_("key.id"),first.name))
+		&& !gale_text_compare(GA_("key.id"),first.name))
 			name = key_i_swizzle(first.value.text);
 		else if (!gale_text_compare(
 			G_("rsa.private"),
-			gale_text_left(first.name,11)))
+			gale_text_left(first.name,11))
+		     ||  !gale_text_compare(G_("ed25519.private"),first.name))
 			is_private = 1;
 	}
 
@@ -16,6 +16,7 @@ struct gale_key_assertion {
 	struct gale_group group;
 	struct gale_time stamp;
 	struct gale_key_assertion *signer;
+	struct gale_group_index *index;
 };
 
 struct gale_key {
@@ -23,6 +24,8 @@ struct gale_key {
 	struct gale_key_assertion *public,*private;
 	struct gale_key *signer;
 	struct gale_key_search *search;
+	struct key_i_closure *closures; /* see key_graph.c */
+	int version; /* changes whenever "public" does */
 };
 
 /* Magic numbers for key formats. */
@@ -45,12 +48,24 @@ const struct gale_data *key_i_bundled(struct gale_data key);
 struct gale_group key_i_group(struct gale_data key);
 int key_i_verify(struct gale_data key,struct gale_group signer);
 
+/* Index of gale_key_data(), built on first use. */
+const struct gale_group_index *key_i_index(const struct gale_key_assertion *);
+
 /* Construct key data. */
 struct gale_data key_i_create(struct gale_group);
 
+/* Remember keys that could not be found. */
+int key_i_missing(struct gale_text name,struct gale_time now);
+void key_i_set_missing(struct gale_text name);
+void key_i_clear_missing(struct gale_text name);
+
+/* Add a search hook with a name for reports. */
+void key_i_add_hook(struct gale_text name,gale_key_hook *,void *user);
+
 /* Add standard search hooks. */
 void key_i_init_builtin(void);
 void key_i_init_dirs(void);
+void key_i_init_db(void);
 void key_i_init_akd(void);
 
 /* Recursively expand key relationships. */
@@ -0,0 +1,80 @@
+#include "key_i.h"
+#include "gale/globals.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+/* Keys that couldn't be found are remembered on disk, so that neither we
+   nor any of the user's other processes immediately repeats a slow
+   (network) search for them.  Each such key gets an empty file, named for
+   the key, in ~/.gale/auth/missing (private to the user, so nobody else can
+   hide keys from them); the key counts as missing for
+   GALE_KEY_MISSING seconds (default 1800, zero to disable) after the file
+   was written.  gale_key_search() leaves out search_slow for missing keys
+   unless asked to search_harder. */
+
+#define DEFAULT_MISSING 1800
+
+struct negative {
+	struct gale_text dir;
+	int interval;
+};
+
+static struct negative *negative = NULL;
+
+static struct negative *get_negative(void) {
+	if (NULL == negative) {
+		const struct gale_text var = gale_var(G_("GALE_KEY_MISSING"));
+		negative = gale_malloc_safe(sizeof(*negative));
+		negative->interval = (0 == var.l) 
+			? DEFAULT_MISSING : gale_text_to_number(var);
+		negative->dir = null_text;
+		if (negative->interval > 0)
+			negative->dir = sub_dir(sub_dir(gale_global->dot_gale,
+				G_("auth"),0700),G_("missing"),0700);
+	}
+
+	return negative;
+}
+
+static struct gale_text missing_file(struct gale_text name) {
+	return dir_file(get_negative()->dir,name);
+}
+
+/** \internal Check whether a key was recently found to be missing.
+ *  \param name Name of the key.
+ *  \param now The current time.
+ *  \return Nonzero if a search for the key failed recently. */
+int key_i_missing(struct gale_text name,struct gale_time now) {
+	struct timeval tv;
+	struct gale_time when;
+	struct stat buf;
+
+	if (0 == name.l || get_negative()->interval <= 0) return 0;
+	if (stat(gale_text_to(gale_global->enc_filesys,
+		missing_file(name)),&buf)) return 0;
+
+	tv.tv_sec = buf.st_mtime;
+	tv.tv_usec = 0;
+	gale_time_from(&when,&tv);
+	return gale_time_compare(now,gale_time_add(when,
+		gale_time_seconds(negative->interval))) < 0;
+}
+
+/** \internal Record that a search for a key failed.
+ *  \param name Name of the key. */
+void key_i_set_missing(struct gale_text name) {
+	if (0 == name.l || get_negative()->interval <= 0) return;
+	gale_write_file(missing_file(name),null_data,0,NULL);
+}
+
+/** \internal Record that a key was found after all.
+ *  \param name Name of the key. */
+void key_i_clear_missing(struct gale_text name) {
+	if (0 == name.l || get_negative()->interval <= 0) return;
+	if (unlink(gale_text_to(gale_global->enc_filesys,missing_file(name)))
+	&&  ENOENT != errno)
+		gale_alert(GALE_WARNING,missing_file(name),errno);
+}
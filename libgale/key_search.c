@@ -1,12 +1,22 @@
 #include "key_i.h"
 #include "gale/key.h"
+#include "gale/globals.h"
 
 #include <assert.h>
+#include <sys/time.h>
+
+/* Every hook is started on each search, and they run concurrently; the
+   callbacks normally wait until all of them are done.  Callers that ask
+   for search_early are released as soon as the key is good enough (a
+   trusted or signed public key, or the private key if they asked for it),
+   while slower hooks (like AKD) carry on in the background.  The time each
+   hook takes is recorded for the report. */
 
 struct key_callback {
 	gale_key_call *func;
         struct gale_key *key;
 	void *user;
+	int flags;
 	struct key_callback *next;
 };
 
@@ -14,6 +24,8 @@ struct gale_key_request {
 	void *cache;
 	const struct gale_key_assertion *last_public,*last_private;
 	int is_active,flags;
+	struct key_hook *hook;
+	struct gale_time started;
 	struct gale_key_request *next;
 };
 
@@ -28,6 +40,8 @@ struct gale_key_search {
 struct key_hook {
 	gale_key_hook *func;
 	void *user;
+	struct gale_text name;
+	unsigned long calls,total_usec,max_usec;
 	struct key_hook *next;
 };
 
@@ -35,19 +49,54 @@ static const int retry_interval = 5;
 static const int refresh_flag = 0x10000000;
 
 static struct key_hook **hook_list = NULL;
+static struct gale_slab *callback_slab = NULL;
+static unsigned long early_count = 0;
 
 static void *on_call(oop_source *oop,struct timeval when,void *x) {
         struct key_callback *call = (struct key_callback *) x;
         void *ret = OOP_CONTINUE;
         while (NULL != call && OOP_CONTINUE == ret) {
+                struct key_callback *next = call->next;
                 ret = call->func(oop,call->key,call->user);
-                call = call->next;
+                gale_slab_free(callback_slab,call);
+                call = next;
         }
         if (NULL != call)
                 oop->on_time(oop,when,on_call,call);
         return ret;
 }
 
+/* Is the key good enough to release a search_early caller? */
+static int is_sufficient(struct gale_key *key,int flags,struct gale_time now) {
+	const struct gale_key_assertion *pub;
+	if (flags & search_private) return NULL != gale_key_private(key);
+	pub = gale_key_public(key,now);
+	return NULL != pub 
+	    && (gale_key_trusted(pub) || NULL != gale_key_signed(pub));
+}
+
+static void release_early(oop_source *oop,struct gale_key *key,
+	struct gale_time now)
+{
+	struct key_callback **ptr = &key->search->chain,*early = NULL;
+	struct key_callback **tail = &early;
+	while (NULL != *ptr) {
+		struct key_callback * const call = *ptr;
+		if ((call->flags & search_early)
+		&&  is_sufficient(key,call->flags,now)) {
+			/* Keep them in the same order as the rest. */
+			*ptr = call->next;
+			call->next = NULL;
+			*tail = call;
+			tail = &call->next;
+			++early_count;
+		} else
+			ptr = &call->next;
+	}
+
+	if (NULL != early) oop->on_time(oop,OOP_TIME_NOW,on_call,early);
+}
+
 static void wakeup(oop_source *oop,struct gale_key *key) {
 	struct gale_time now;
 	struct key_hook *hook;
@@ -73,6 +122,7 @@ static void wakeup(oop_source *oop,struct gale_key *key) {
 				(*req)->last_private = NULL;
 				(*req)->is_active = 0;
 				(*req)->flags = key->search->last_flags;
+				(*req)->hook = hook;
 				(*req)->next = NULL;
 				assert(0 != (*req)->flags);
 			}
@@ -94,6 +144,7 @@ static void wakeup(oop_source *oop,struct gale_key *key) {
 				(*req)->last_private = pri;
 				(*req)->is_active = 1;
 				(*req)->flags = 0;
+				(*req)->started = now;
 				hook->func(now,oop,
 					key,flags,*req,
 					hook->user,&(*req)->cache);
@@ -108,7 +159,8 @@ static void wakeup(oop_source *oop,struct gale_key *key) {
 	if (!is_active) {
                 oop->on_time(oop,OOP_TIME_NOW,on_call,key->search->chain);
 		key->search->chain = NULL;
-	}
+	} else
+		release_early(oop,key,now);
 }
 
 static void *search_chain(oop_source *oop,struct gale_key *key,void *user) {
@@ -141,13 +193,27 @@ void gale_key_search(oop_source *source,
 		key->search->in_wakeup = 0;
 	}
 
-	gale_create(callback);
+	if (NULL == callback_slab)
+		callback_slab = gale_make_slab(
+			G_("key callback"),sizeof(*callback));
+
+	gale_slab_create(callback_slab,callback);
 	callback->func = call;
         callback->key = key;
 	callback->user = user;
+	callback->flags = flags;
 	callback->next = key->search->chain;
 	key->search->chain = callback;
 
+	/* That's just for us; the hooks don't care. */
+	flags &= ~search_early;
+
+	/* Don't bother with slow searches that recently failed. */
+	if ((flags & search_slow) && !(flags & search_harder)
+	&&  NULL == gale_key_public(key,now)
+	&&  key_i_missing(gale_key_name(key),now))
+		flags &= ~search_slow;
+
 	if (0 < gale_time_compare(now,gale_time_add(
 		key->search->last,
 		gale_time_seconds(retry_interval))))
@@ -168,16 +234,36 @@ void gale_key_search(oop_source *source,
 		gale_key_search(source,parent,0,search_chain,key);
 }
 
-/** Add a search strategy hook that will be called when looking for keys.
- *  The hook function should call gale_key_hook_done() when it is finished
- *  processing.
+static struct gale_text hook_report(void *x) {
+	struct gale_text_accumulator out = null_accumulator;
+	const struct key_hook *hook;
+
+	gale_text_accumulate(&out,gale_text_concat(3,
+		G_("key search: early="),
+		gale_text_from_number(early_count,10,0),G_("\n")));
+	for (hook = *hook_list; NULL != hook; hook = hook->next)
+		gale_text_accumulate(&out,gale_text_concat(9,
+			G_("key hook "),
+			(0 == hook->name.l) ? G_("(unnamed)") : hook->name,
+			G_(": calls="),gale_text_from_number(hook->calls,10,0),
+			G_(", avg="),gale_text_from_number(0 == hook->calls 
+				? 0 : hook->total_usec / hook->calls,10,0),
+			G_("us, max="),gale_text_from_number(hook->max_usec,10,0),
+			G_("us\n")));
+	return gale_text_collect(&out);
+}
+
+/** \internal Add a named search strategy hook.
+ *  \param name Name for the hook, in reports.
  *  \param hook Callback to invoke whenever the system is looking for a key.
- *  \param user User-specified opaque pointer to pass to the callback. */
-void gale_key_add_hook(gale_key_hook *hook,void *user) {
+ *  \param user User-specified opaque pointer to pass to the callback.
+ *  \sa gale_key_add_hook() */
+void key_i_add_hook(struct gale_text name,gale_key_hook *hook,void *user) {
 	struct key_hook **ptr;
 	if (NULL == hook_list) {
 		hook_list = gale_malloc_safe(sizeof(*hook_list));
 		*hook_list = NULL;
+		gale_report_add(gale_global->report,hook_report,NULL);
 	}
 
 	ptr = hook_list;
@@ -185,9 +271,20 @@ void gale_key_add_hook(gale_key_hook *hook,void *user) {
 	gale_create(*ptr);
 	(*ptr)->func = hook;
 	(*ptr)->user = user;
+	(*ptr)->name = name;
+	(*ptr)->calls = (*ptr)->total_usec = (*ptr)->max_usec = 0;
 	(*ptr)->next = NULL;
 }
 
+/** Add a search strategy hook that will be called when looking for keys.
+ *  The hook function should call gale_key_hook_done() when it is finished
+ *  processing.
+ *  \param hook Callback to invoke whenever the system is looking for a key.
+ *  \param user User-specified opaque pointer to pass to the callback. */
+void gale_key_add_hook(gale_key_hook *hook,void *user) {
+	key_i_add_hook(null_text,hook,user);
+}
+
 /** Notify the system that search is complete.
  *  Called from a ::gale_key_hook function when the callback is done.
  *  \param source Liboop event source to use.
@@ -196,7 +293,18 @@ void gale_key_add_hook(gale_key_hook *hook,void *user) {
 void gale_key_hook_done(oop_source *source,
 	struct gale_key *key,struct gale_key_request *handle) 
 {
+	struct key_hook * const hook = handle->hook;
+	struct timeval tv;
+	unsigned long usec;
+
 	assert(handle->is_active);
 	handle->is_active = 0;
+
+	gale_time_to(&tv,gale_time_diff(gale_time_now(),handle->started));
+	usec = tv.tv_sec * 1000000UL + tv.tv_usec;
+	++(hook->calls);
+	hook->total_usec += usec;
+	if (usec > hook->max_usec) hook->max_usec = usec;
+
 	wakeup(source,key);
 }
@@ -2,56 +2,126 @@
 #include "gale/crypto.h"
 #include "gale/core.h"
 #include "gale/client.h"
+#include "gale/globals.h"
 
 #include <assert.h>
 
+/* Automatic key distribution: ask the key's domain for any key we can't
+   find (or haven't refreshed in a while).  All queries share one link to
+   the server, which stays open while any are outstanding (and for
+   linger_interval afterwards).  Changes are collected and sent together
+   once the event loop is idle: a single subscription covering every
+   outstanding query, followed by any new queries.  (Concurrent searches
+   for the same key already share one call to this hook, so there's never
+   more than one query per key.)  A query ends when it's answered, or after
+   timeout_interval. */
+
 struct cache {
 	oop_source *oop;
 	struct gale_key *key;
 	struct gale_key_request *handle;
-	struct gale_link *link;
-	struct gale_server *server;
 	struct gale_text local,domain;
 	struct gale_message *query_message;
+	struct gale_packet *query_packet;
 	struct gale_text key_routing;
 	struct gale_time last_attempt;
 	struct gale_time last_refresh;
-	int waiting_for_query;
+	struct timeval timeout;
+	int is_packing,is_sent;
+	struct cache *next; /* in the active list */
+};
+
+struct akd {
+	oop_source *oop;
+	struct gale_link *link;
+	struct gale_server *server;
+	struct cache *active;
+	struct timeval linger;
+	int is_connected,is_flushing,is_lingering,is_changed;
+	unsigned long sent,answered,timeouts,connections;
 };
 
 static const int timeout_interval = 20;
 static const int retry_interval = 300;
 static const int refresh_interval = 86400;
+static const int linger_interval = 20;
+
+static struct akd *akd = NULL;
+
+static struct gale_text akd_report(void *x) {
+	return gale_text_concat(9,
+		G_("akd: queries="),gale_text_from_number(akd->sent,10,0),
+		G_(", answered="),gale_text_from_number(akd->answered,10,0),
+		G_(", timeouts="),gale_text_from_number(akd->timeouts,10,0),
+		G_(", connections="),
+		gale_text_from_number(akd->connections,10,0),
+		G_("\n"));
+}
 
-static oop_call_time on_timeout;
+/* Send whatever has changed since the last flush. */
+static void *on_flush(oop_source *oop,struct timeval when,void *x) {
+	struct cache *cache;
+	akd->is_flushing = 0;
+	if (!akd->is_connected) return OOP_CONTINUE;
+
+	if (akd->is_changed) {
+		struct gale_text_accumulator spec = null_accumulator;
+		akd->is_changed = 0;
+		for (cache = akd->active; NULL != cache; cache = cache->next)
+			if (0 != cache->key_routing.l) {
+				if (!gale_text_accumulator_empty(&spec))
+					gale_text_accumulate(&spec,G_(":"));
+				gale_text_accumulate(&spec,cache->key_routing);
+			}
+		link_subscribe(akd->link,gale_text_collect(&spec));
+	}
 
-static void *on_packed_query(struct gale_packet *packet,void *x) {
-	struct cache *cache = (struct cache *) x;
-	packet->routing = gale_text_concat(7,
-		packet->routing,G_(":"),G_("@"),
-		gale_text_replace(gale_text_replace(cache->domain,
-			G_(":"),G_("..")),
-			G_("/"),G_(".|")),
-		G_("/auth/query/"),
-		gale_text_replace(cache->local,G_(":"),G_("..")),G_("/"));
+	for (cache = akd->active; NULL != cache; cache = cache->next)
+		if (NULL != cache->query_packet && !cache->is_sent) {
+			cache->is_sent = 1;
+			link_put(akd->link,cache->query_packet);
+			++(akd->sent);
+		}
 
-	link_put(cache->link,packet);
 	return OOP_CONTINUE;
 }
 
+static void flush(void) {
+	if (!akd->is_flushing) {
+		akd->is_flushing = 1;
+		akd->oop->on_time(akd->oop,OOP_TIME_NOW,on_flush,NULL);
+	}
+}
+
 static void *on_connect(struct gale_server *s,
 	struct gale_text h,struct sockaddr_in a,void *x)
 {
-	struct cache *cache = (struct cache *) x;
-	assert(s == cache->server);
+	struct cache *cache;
+	assert(s == akd->server);
+
+	/* Everything must be sent again. */
+	akd->is_connected = 1;
+	akd->is_changed = 1;
+	for (cache = akd->active; NULL != cache; cache = cache->next)
+		cache->is_sent = 0;
+	++(akd->connections);
+	flush();
+	return OOP_CONTINUE;
+}
 
-	if (0 != cache->key_routing.l) 
-		link_subscribe(cache->link,cache->key_routing);
+/* Queries sent on a broken connection never reached the server. */
+static void *on_disconnect(struct gale_server *s,void *x) {
+	if (s == akd->server) akd->is_connected = 0;
+	return OOP_CONTINUE;
+}
 
-	if (!(cache->waiting_for_query = (NULL == cache->query_message)))
-		gale_pack_message(
-			cache->oop,cache->query_message,
-			on_packed_query,cache);
+static void *on_linger(oop_source *oop,struct timeval when,void *x) {
+	akd->is_lingering = 0;
+	if (NULL == akd->active && NULL != akd->server) {
+		gale_close(akd->server);
+		akd->server = NULL;
+		akd->is_connected = 0;
+	}
 
 	return OOP_CONTINUE;
 }
@@ -68,25 +138,40 @@ static void *on_ignore(oop_source *oop,struct gale_key *key,void *x) {
 	return OOP_CONTINUE;
 }
 
-static void *on_timeout(oop_source *oop,struct timeval when,void *x) {
-	struct cache * const cache = (struct cache *) x;
+/* The query is answered (or abandoned). */
+static void end_query(struct cache *cache) {
 	const struct gale_time now = gale_time_now();
+	oop_source * const oop = cache->oop;
 	const struct gale_key_assertion * const ass = 
 		gale_key_public(cache->key,now);
-	cache->waiting_for_query = 0;
+	struct cache **ptr;
+
+	for (ptr = &akd->active; cache != *ptr; ptr = &(*ptr)->next)
+		assert(NULL != *ptr);
+	*ptr = cache->next;
+	cache->next = NULL;
+	cache->query_packet = NULL;
+	akd->is_changed = 1;
+	flush();
+
+	if (NULL == akd->active && !akd->is_lingering) {
+		akd->is_lingering = 1;
+		gale_time_to(&akd->linger,now);
+		akd->linger.tv_sec += linger_interval;
+		akd->oop->on_time(akd->oop,akd->linger,on_linger,NULL);
+	}
 
 	if (NULL != cache->handle) {
 		gale_alert(GALE_WARNING,gale_text_concat(3,
 			G_("cannot find \""),
 			gale_key_name(cache->key),G_("\", giving up")),0);
+		/* Only a query the server got counts; an outage doesn't. */
+		if (cache->is_sent && akd->is_connected)
+			key_i_set_missing(gale_key_name(cache->key));
 		end_search(cache);
 	}
 
-	if (NULL != cache->server) {
-		gale_close(cache->server);
-		cache->server = NULL;
-	}
-
+	cache->oop = NULL;
 	if (NULL != ass) {
 		/* Update the timestamp if we didn't find anything. */
 		if (!gale_time_compare(cache->last_refresh,gale_key_time(ass)))
@@ -98,21 +183,39 @@ static void *on_timeout(oop_source *oop,struct timeval when,void *x) {
 			(search_all & ~search_private & ~search_slow),
 			on_ignore,NULL);
 	}
+}
 
-	cache->oop = NULL;
+static void *on_timeout(oop_source *oop,struct timeval when,void *x) {
+	++(akd->timeouts);
+	end_query((struct cache *) x);
 	return OOP_CONTINUE;
 }
 
+/* Nonzero if any category of a packet falls under a subscription. */
+static int is_routed(struct gale_text routing,struct gale_text spec) {
+	struct gale_text cat = null_text;
+	while (gale_text_token(routing,':',&cat)) {
+		struct gale_text sub = null_text;
+		while (gale_text_token(spec,':',&sub))
+			if (0 != sub.l && !gale_text_compare(sub,
+				gale_text_left(cat,sub.l)))
+				return 1;
+	}
+
+	return 0;
+}
+
 static void *on_packet(struct gale_link *l,struct gale_packet *packet,void *x) {
 	struct gale_group group,original;
 	struct gale_fragment frag;
-        struct gale_text from;
+	struct gale_text from;
 	struct gale_time now = gale_time_now(),then;
 	const struct gale_data *bundled;
-	struct cache *cache = (struct cache *) x;
-	struct gale_key *signer = gale_key_parent(cache->key);
 	struct gale_data copy = packet->content;
-	if (!gale_unpack_group(&copy,&group)) {
+	struct cache *cache,*next;
+	int is_error;
+
+	if (!gale_view_group(&copy,&group)) {
 		gale_alert(GALE_WARNING,gale_text_concat(3,
 			G_("error decoding message on \""),
 			packet->routing,G_("\"")),0);
@@ -120,48 +223,104 @@ static void *on_packet(struct gale_link *l,struct gale_packet *packet,void *x) {
 	}
 
 	original = gale_crypto_original(group);
-	if (gale_group_lookup(original,G_("id/time"),frag_time,&frag))
+	if (gale_group_lookup(original,GA_("id/time"),frag_time,&frag))
 		then = frag.value.time;
 	else
 		then = now;
 
-        if (gale_group_lookup(original,G_("id/instance"),frag_text,&frag))
-                from = frag.value.text;
-        else
-                from = G_("(unknown)");
+	if (gale_group_lookup(original,GA_("id/instance"),frag_text,&frag))
+		from = frag.value.text;
+	else
+		from = G_("(unknown)");
 
 	bundled = gale_crypto_bundled(group);
 	while (NULL != bundled && 0 != bundled->l)
 		gale_key_assert(*bundled++,gale_text_concat(2,
-                            G_("bundled with AKD response from "),from),then,0);
+			G_("bundled with AKD response from "),from),then,0);
 
-	if (gale_group_lookup(original,G_("answer/key"),frag_data,&frag)
-	||  gale_group_lookup(original,G_("answer.key"),frag_data,&frag)) {
+	if (gale_group_lookup(original,GA_("answer/key"),frag_data,&frag)
+	||  gale_group_lookup(original,GA_("answer.key"),frag_data,&frag)) {
 		gale_key_assert(frag.value.data,gale_text_concat(2,
-                            G_("in AKD response from "),from),then,0);
-        }
+			G_("in AKD response from "),from),then,0);
+	}
 
-	if (NULL != gale_key_public(cache->key,now))
-		end_search(cache);
+	is_error = 
+	   gale_group_lookup(original,GA_("answer/key/error"),frag_text,&frag)
+	|| gale_group_lookup(original,GA_("answer.key.error"),frag_text,&frag);
+
+	/* One response (with bundled keys) may answer several queries. */
+	for (cache = akd->active; NULL != cache; cache = next) {
+		const struct gale_key_assertion * const pub = 
+			gale_key_public(cache->key,now);
+		struct gale_key * const signer = gale_key_parent(cache->key);
+		int is_done = 0;
+		next = cache->next;
 
-	if (NULL != signer && NULL != cache->handle
-	&& (gale_group_lookup(original,G_("answer/key/error"),frag_text,&frag)
-	||  gale_group_lookup(original,G_("answer.key.error"),frag_text,&frag)))
-	{
-		const struct gale_key_assertion *pub;
-		pub = gale_key_public(signer,now);
+		/* Other keys' answers share the link; only ours count. */
 		if (NULL != pub) {
-			struct gale_group verify = gale_key_data(pub);
-			if (gale_crypto_verify(1,&verify,group)) {
-				gale_alert(GALE_WARNING,frag.value.text,0);
+			is_done = gale_time_compare(
+				cache->last_refresh,gale_key_time(pub));
+			if (is_done && !gale_time_compare(
+				cache->last_refresh,gale_time_zero()))
+				key_i_clear_missing(gale_key_name(cache->key));
+			if (is_done
+			||  is_routed(packet->routing,cache->key_routing))
 				end_search(cache);
+		}
+
+		if (is_error && NULL != signer && NULL != cache->handle
+		&&  is_routed(packet->routing,cache->key_routing)) {
+			const struct gale_key_assertion * const spub =
+				gale_key_public(signer,now);
+			if (NULL != spub) {
+				struct gale_group verify = gale_key_data(spub);
+				if (gale_crypto_verify(1,&verify,group)) {
+					gale_alert(GALE_WARNING,
+						frag.value.text,0);
+					key_i_set_missing(
+						gale_key_name(cache->key));
+					end_search(cache);
+					is_done = 1;
+				}
 			}
 		}
+
+		if (is_done) {
+			akd->oop->cancel_time(akd->oop,
+				cache->timeout,on_timeout,cache);
+			++(akd->answered);
+			end_query(cache);
+		}
 	}
 
 	return OOP_CONTINUE;
 }
 
+static void *on_packed_query(struct gale_packet *packet,void *x) {
+	struct cache *cache = (struct cache *) x;
+	cache->is_packing = 0;
+	if (NULL == cache->oop || NULL == packet) return OOP_CONTINUE;
+
+	packet->routing = gale_text_concat(7,
+		packet->routing,G_(":"),G_("@"),
+		gale_text_replace(gale_text_replace(cache->domain,
+			G_(":"),G_("..")),
+			G_("/"),G_(".|")),
+		G_("/auth/query/"),
+		gale_text_replace(cache->local,G_(":"),G_("..")),G_("/"));
+
+	cache->query_packet = packet;
+	cache->is_sent = 0;
+	flush();
+	return OOP_CONTINUE;
+}
+
+static void pack_query(struct cache *cache) {
+	if (NULL == cache->query_message || cache->is_packing) return;
+	cache->is_packing = 1;
+	gale_pack_message(akd->oop,cache->query_message,on_packed_query,cache);
+}
+
 static void *on_query_location(
 	struct gale_text name,
 	struct gale_location *loc,void *x)
@@ -188,13 +347,7 @@ static void *on_query_location(
 	cache->query_message->to[1] = NULL;
 	cache->query_message->from = NULL;
 
-	if (cache->waiting_for_query) {
-		cache->waiting_for_query = 0;
-		gale_pack_message(
-			cache->oop,cache->query_message,
-			on_packed_query,cache);
-	}
-
+	if (NULL != cache->oop) pack_query(cache);
 	return OOP_CONTINUE;
 }
 
@@ -214,10 +367,41 @@ static void *on_key_location(
 			G_("/"),G_(".|")),
 		G_("/auth/key/"),
 		gale_text_replace(cache->local,G_(":"),G_("..")));
-	link_subscribe(cache->link,cache->key_routing);
+
+	if (NULL != cache->oop) {
+		akd->is_changed = 1;
+		flush();
+	}
+
 	return OOP_CONTINUE;
 }
 
+static void start_query(struct cache *cache,struct gale_time now) {
+	cache->is_sent = 0;
+	cache->next = akd->active;
+	akd->active = cache;
+	akd->is_changed = 1;
+
+	gale_time_to(&cache->timeout,now);
+	cache->timeout.tv_sec += timeout_interval;
+	akd->oop->on_time(akd->oop,cache->timeout,on_timeout,cache);
+
+	if (akd->is_lingering) {
+		akd->is_lingering = 0;
+		akd->oop->cancel_time(akd->oop,akd->linger,on_linger,NULL);
+	}
+
+	if (NULL == akd->server) {
+		akd->is_connected = 0;
+		akd->server = gale_make_server(akd->oop,akd->link,null_text,0);
+		gale_on_connect(akd->server,on_connect,NULL);
+		gale_on_disconnect(akd->server,on_disconnect,NULL);
+	}
+
+	pack_query(cache);
+	flush();
+}
+
 static void on_search(struct gale_time now,oop_source *oop,
 	struct gale_key *key,int flags,
 	struct gale_key_request *handle,
@@ -226,7 +410,6 @@ static void on_search(struct gale_time now,oop_source *oop,
 	const struct gale_text key_name = gale_key_name(key);
 	struct cache *cache = (struct cache *) *ptr;
 	const struct gale_key_assertion *old;
-	struct timeval timeout;
 
 	if (!(flags & search_slow)
 	|| !gale_text_compare(gale_text_left(key_name,6),G_("_gale."))
@@ -236,6 +419,20 @@ static void on_search(struct gale_time now,oop_source *oop,
 		return;
 	}
 
+	if (NULL == akd) {
+		akd = gale_malloc_safe(sizeof(*akd));
+		akd->oop = oop;
+		akd->link = new_link(oop);
+		akd->server = NULL;
+		akd->active = NULL;
+		akd->is_connected = akd->is_flushing = 0;
+		akd->is_lingering = akd->is_changed = 0;
+		akd->sent = akd->answered = 0;
+		akd->timeouts = akd->connections = 0;
+		link_on_message(akd->link,on_packet,NULL);
+		gale_report_add(gale_global->report,akd_report,NULL);
+	}
+
 	if (NULL == cache) {
 		int at;
 		const struct gale_text name = key_i_swizzle(key_name);
@@ -246,18 +443,17 @@ static void on_search(struct gale_time now,oop_source *oop,
 		cache->oop = NULL;
 		cache->key = key;
 		cache->handle = NULL;
-		cache->server = NULL;
 		cache->local = gale_text_left(name,at);
 		cache->domain = gale_text_right(name,-at - 1);
 		cache->query_message = NULL;
+		cache->query_packet = NULL;
 		cache->key_routing = null_text;
 		cache->last_attempt = gale_time_zero();
 		cache->last_refresh = gale_time_zero();
-		cache->waiting_for_query = 0;
-		cache->link = new_link(oop);
+		cache->is_packing = cache->is_sent = 0;
+		cache->next = NULL;
 		*ptr = cache;
 
-		link_on_message(cache->link,on_packet,cache);
 		gale_find_exact_location(oop,gale_text_concat(2,
 			G_("_gale.query."),key_name),
 			on_query_location,cache);
@@ -271,13 +467,15 @@ static void on_search(struct gale_time now,oop_source *oop,
 		cache->last_attempt,
 		gale_time_seconds(retry_interval)))) goto skip;
 
+	/* The query is answered when this changes. */
 	old = gale_key_public(key,now);
+	cache->last_refresh = 
+		(NULL == old) ? gale_time_zero() : gale_key_time(old);
 	if (NULL != old && !(flags & search_harder)) {
 		struct gale_data random = gale_crypto_random(sizeof(unsigned));
 		const unsigned variant = refresh_interval +
 			(* (unsigned *) random.p) % refresh_interval;
 
-		cache->last_refresh = gale_key_time(old);
 		if (0 < gale_time_compare(cache->last_refresh,
 			gale_time_diff(now,gale_time_seconds(variant))))
 			goto skip;
@@ -289,24 +487,16 @@ static void on_search(struct gale_time now,oop_source *oop,
 		handle = NULL;
 	}
 
-	/* BUG?  We're assuming the timeout is actually scheduled... */
-	assert(NULL == cache->oop 
-	    && NULL == cache->handle 
-	    && NULL == cache->server);
+	assert(NULL == cache->oop && NULL == cache->handle);
 	cache->oop = oop;
 	cache->handle = handle;
-	cache->server = gale_make_server(oop,cache->link,null_text,0);
-	gale_on_connect(cache->server,on_connect,cache);
-
 	cache->last_attempt = now;
-	gale_time_to(&timeout,now);
-	timeout.tv_sec += timeout_interval;
-	oop->on_time(oop,timeout,on_timeout,cache);
+	start_query(cache,now);
 
 	gale_alert(GALE_NOTICE,gale_text_concat(3,
 		G_("requesting key \""),key_name,G_("\"")),0);
 }
 
 void key_i_init_akd(void) {
-	gale_key_add_hook(on_search,NULL);
+	key_i_add_hook(G_("akd"),on_search,NULL);
 }
@@ -39,5 +39,5 @@ static void builtin_hook(struct gale_time now,oop_source *oop,
 }
 
 void key_i_init_builtin(void) {
-	gale_key_add_hook(builtin_hook,NULL);
+	key_i_add_hook(G_("builtin"),builtin_hook,NULL);
 }
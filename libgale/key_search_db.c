@@ -0,0 +1,558 @@
+#include "key_i.h"
+#include "gale/key.h"
+#include "gale/globals.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A single-file key database, for shared key caches too large to keep as a
+   file per key.  If GALE_KEY_DB names one, it's searched like the shared
+   cache directory: it supplies (untrusted) public keys, and remembers any
+   signed public keys found elsewhere.  Unlike the cache directory, it
+   doesn't erase keys whose signature can't be checked (an imported key's
+   signer may simply not be at hand); a key is only erased once it has no
+   usable public key at all.  The file is mapped into memory.
+
+     magic, u32 slot count, u32 record count, u32 end of indexed records,
+     slots (u32 offset of a record, or zero), indexed records, new records
+
+   Each record is a u32 length, followed by the key name, a time stamp,
+   a u32 key length and the key itself.  A record with no key erases the
+   name.  The slots are a hash table (with linear probing) of the indexed
+   records; records appended since then are indexed in memory when the
+   file is mapped, and override the table.  New records are appended in a
+   single write, under an exclusive lock; readers ignore a partial record
+   at the end.  Every new record has to be indexed by every process that
+   maps the file, so once there are more than TAIL_MIN of them and more
+   than an eighth as many as indexed ones (or more than TAIL_MAX in any
+   case), the whole file is rewritten, without old or erased records, and
+   replaces the original.  That's done when the event loop next gets to it,
+   not in the middle of a search; gkimport compacts after importing, and
+   gale_key_db_compact() does it on demand.  Other processes notice when the
+   file grows or is replaced, checking at most every CHECK_INTERVAL.
+   A rewritten file keeps the original's permissions; users who can't
+   write the database just read it. */
+
+static const byte db_magic[] = { 0x47, 0x41, 0x4C, 0x45, 0x44, 0x42, 0x00, 0x01 };
+
+#define HEADER_LEN (sizeof(db_magic) + 3 * sizeof(u32))
+#define SLOTS_MIN 16
+#define TAIL_MIN 64
+#define TAIL_MAX 1024
+#define CHECK_INTERVAL 1 /* seconds */
+
+struct key_db {
+	struct gale_text path;
+	int fd,generation;
+	dev_t dev;
+	ino_t ino;
+	byte *map;
+	size_t map_len,scanned;
+	u32 slots,count,indexed_end;
+	struct gale_map *tail; /* packed name -> u32 offset */
+	int tail_count,is_readonly,is_scheduled;
+	struct gale_time checked;
+	unsigned long lookups,found,appends,compactions;
+};
+
+struct record {
+	struct gale_text name;
+	struct gale_time stamp;
+	struct gale_data key;
+	u32 end;
+};
+
+struct db_cache {
+	int generation;
+	u32 offset;
+	struct gale_key_assertion *ass;
+	const struct gale_key_assertion *written;
+};
+
+static struct gale_map **db_list = NULL;
+
+static u32 get_u32(const byte *p) {
+	struct gale_data data;
+	u32 value = 0;
+	data.p = (byte *) p;
+	data.l = sizeof(u32);
+	gale_unpack_u32(&data,&value);
+	return value;
+}
+
+static struct gale_data pack_name(struct gale_text name) {
+	struct gale_data packed;
+	packed.p = gale_malloc_atomic(gale_text_size(name));
+	packed.l = 0;
+	gale_pack_text(&packed,name);
+	return packed;
+}
+
+/* FNV-1a. */
+static u32 hash_name(struct gale_data packed) {
+	u32 hash = 2166136261U;
+	size_t i;
+	for (i = 0; i < packed.l; ++i) {
+		hash ^= packed.p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int read_record(const struct key_db *db,u32 offset,struct record *r) {
+	struct gale_data data;
+	u32 len;
+
+	if (offset < HEADER_LEN || offset >= db->map_len) return 0;
+	data.p = db->map + offset;
+	data.l = db->map_len - offset;
+	if (!gale_unpack_u32(&data,&len) || len > data.l) return 0;
+	data.l = len;
+	r->end = offset + sizeof(u32) + len;
+
+	if (!gale_unpack_text(&data,&r->name)
+	||  !gale_unpack_time(&data,&r->stamp)
+	||  !gale_unpack_u32(&data,&len) || len != data.l) return 0;
+	r->key = data;
+	return 1;
+}
+
+static void db_close(struct key_db *db) {
+	if (NULL != db->map) munmap(db->map,db->map_len);
+	if (db->fd >= 0) close(db->fd);
+	db->fd = -1;
+	db->map = NULL;
+	db->map_len = db->scanned = 0;
+	db->slots = db->count = db->indexed_end = 0;
+	db->tail = gale_make_map(0);
+	db->tail_count = 0;
+	db->is_readonly = 0;
+	++(db->generation);
+}
+
+/* Map the file (again), and index any records we haven't seen. */
+static void db_map(struct key_db *db,size_t size) {
+	struct record r;
+
+	if (NULL != db->map) munmap(db->map,db->map_len);
+	db->map = NULL;
+	db->map_len = 0;
+	if (size < HEADER_LEN) return;
+
+	db->map = mmap(NULL,size,PROT_READ,MAP_SHARED,db->fd,0);
+	if (MAP_FAILED == (void *) db->map) {
+		gale_alert(GALE_WARNING,db->path,errno);
+		db->map = NULL;
+		return;
+	}
+
+	db->map_len = size;
+	if (0 == db->scanned) {
+		const byte *p = db->map + sizeof(db_magic);
+		if (memcmp(db->map,db_magic,sizeof(db_magic))) {
+			gale_alert(GALE_WARNING,gale_text_concat(3,
+				G_("\""),db->path,G_("\" is not a key database")),0);
+			db_close(db);
+			return;
+		}
+
+		db->slots = get_u32(p);
+		db->count = get_u32(p + sizeof(u32));
+		db->indexed_end = get_u32(p + 2 * sizeof(u32));
+		db->scanned = db->indexed_end;
+		if (db->slots & (db->slots - 1)
+		||  HEADER_LEN + (size_t) db->slots * sizeof(u32) > db->indexed_end
+		||  db->indexed_end > size) {
+			gale_alert(GALE_WARNING,gale_text_concat(3,
+				G_("\""),db->path,G_("\" is corrupt")),0);
+			db_close(db);
+			return;
+		}
+	}
+
+	while (db->scanned < db->map_len
+	&&     read_record(db,db->scanned,&r)) {
+		u32 *offset = gale_malloc_atomic(sizeof(*offset));
+		const struct gale_data name = pack_name(r.name);
+		*offset = db->scanned;
+		if (NULL == gale_map_find(db->tail,name)) ++(db->tail_count);
+		gale_map_add(db->tail,name,offset);
+		db->scanned = r.end;
+	}
+}
+
+/* Catch up with changes to the file. */
+static void db_check(struct key_db *db) {
+	struct stat st;
+
+	if (stat(gale_text_to(gale_global->enc_filesys,db->path),&st)) {
+		if (db->fd >= 0) db_close(db);
+		return;
+	}
+
+	if (db->fd >= 0 && (st.st_dev != db->dev || st.st_ino != db->ino))
+		db_close(db);
+
+	if (db->fd < 0) {
+		db->fd = open(gale_text_to(gale_global->enc_filesys,db->path),
+			O_RDONLY);
+		if (db->fd < 0) return;
+		fcntl(db->fd,F_SETFD,FD_CLOEXEC);
+		if (fstat(db->fd,&st)) {
+			db_close(db);
+			return;
+		}
+		db->dev = st.st_dev;
+		db->ino = st.st_ino;
+	}
+
+	if ((size_t) st.st_size != db->map_len) db_map(db,st.st_size);
+}
+
+static void db_refresh(struct key_db *db,struct gale_time now) {
+	if (gale_time_compare(now,gale_time_add(
+		db->checked,gale_time_seconds(CHECK_INTERVAL))) < 0)
+		return;
+	db->checked = now;
+	db_check(db);
+}
+
+static struct gale_text db_report(void *x) {
+	const struct key_db *db = (const struct key_db *) x;
+	return gale_text_concat(15,
+		G_("key db "),db->path,
+		G_(": indexed="),gale_text_from_number(db->count,10,0),
+		G_(", new="),gale_text_from_number(db->tail_count,10,0),
+		G_(", lookups="),gale_text_from_number(db->lookups,10,0),
+		G_(", found="),gale_text_from_number(db->found,10,0),
+		G_(", appends="),gale_text_from_number(db->appends,10,0),
+		G_(", compactions="),
+		gale_text_from_number(db->compactions,10,0),
+		G_("\n"));
+}
+
+static struct key_db *get_db(struct gale_text path) {
+	struct key_db *db;
+
+	if (NULL == db_list) {
+		db_list = gale_malloc_safe(sizeof(*db_list));
+		*db_list = gale_make_map(0);
+	}
+
+	db = gale_map_find(*db_list,gale_text_as_data(path));
+	if (NULL == db) {
+		gale_create(db);
+		memset(db,0,sizeof(*db));
+		db->path = path;
+		db->fd = -1;
+		db->tail = gale_make_map(0);
+		db->checked = gale_time_zero();
+		gale_map_add(*db_list,gale_text_as_data(db->path),db);
+		gale_report_add(gale_global->report,db_report,db);
+	}
+
+	db_check(db);
+	return db;
+}
+
+/* Find the latest record for a name; zero if there is none. */
+static u32 db_find(struct key_db *db,struct gale_text name) {
+	const struct gale_data packed = pack_name(name);
+	const u32 *offset;
+	u32 i,slot;
+
+	++(db->lookups);
+	offset = gale_map_find(db->tail,packed);
+	if (NULL != offset) {
+		++(db->found);
+		return *offset;
+	}
+
+	if (NULL == db->map || 0 == db->slots) return 0;
+	slot = hash_name(packed) & (db->slots - 1);
+	for (i = 0; i < db->slots; ++i) {
+		const u32 where = get_u32(db->map + HEADER_LEN
+			+ ((slot + i) & (db->slots - 1)) * sizeof(u32));
+		if (0 == where) break;
+		if (where + sizeof(u32) + packed.l <= db->indexed_end
+		&& !memcmp(db->map + where + sizeof(u32),packed.p,packed.l)) {
+			++(db->found);
+			return where;
+		}
+	}
+
+	return 0;
+}
+
+static int open_locked(struct key_db *db,int flags) {
+	const char *path = gale_text_to(gale_global->enc_filesys,db->path);
+	for (;;) {
+		struct stat st,fst;
+		int fd = open(path,flags,0666);
+		if (fd < 0) return -1;
+
+		while (flock(fd,LOCK_EX) && EINTR == errno) ;
+		/* Make sure it wasn't replaced while we waited. */
+		if (!stat(path,&st) && !fstat(fd,&fst)
+		&&  st.st_dev == fst.st_dev && st.st_ino == fst.st_ino)
+			return fd;
+		close(fd);
+	}
+}
+
+static int db_append(struct key_db *db,struct gale_text name,
+	struct gale_time stamp,struct gale_data key)
+{
+	struct gale_data record;
+	struct stat st;
+	int fd,ok;
+
+	if (db->is_readonly) return 0;
+	record.l = gale_u32_size()
+	         + gale_text_size(name) + gale_time_size()
+	         + gale_u32_size() + gale_copy_size(key.l);
+	record.p = gale_malloc_atomic(HEADER_LEN + record.l);
+	record.l = 0;
+
+	fd = open_locked(db,O_WRONLY | O_APPEND | O_CREAT);
+	if (fd < 0) {
+		if (EACCES == errno || EPERM == errno || EROFS == errno) {
+			gale_alert(GALE_NOTICE,gale_text_concat(3,
+				G_("can't write \""),db->path,
+				G_("\", using it read-only")),0);
+			db->is_readonly = 1;
+		} else
+			gale_alert(GALE_WARNING,db->path,errno);
+		return 0;
+	}
+
+	/* A new database starts with an empty index. */
+	if (!fstat(fd,&st) && 0 == st.st_size) {
+		gale_pack_copy(&record,db_magic,sizeof(db_magic));
+		gale_pack_u32(&record,0);
+		gale_pack_u32(&record,0);
+		gale_pack_u32(&record,HEADER_LEN);
+	}
+
+	gale_pack_u32(&record,gale_text_size(name) + gale_time_size()
+		+ gale_u32_size() + gale_copy_size(key.l));
+	gale_pack_text(&record,name);
+	gale_pack_time(&record,stamp);
+	gale_pack_u32(&record,key.l);
+	gale_pack_copy(&record,key.p,key.l);
+
+	ok = gale_write_to(fd,record);
+	close(fd);
+	if (!ok) return 0;
+
+	++(db->appends);
+	db_check(db);
+	return 1;
+}
+
+/* Are there enough new records to make compaction worthwhile? */
+static int is_compact_due(const struct key_db *db) {
+	return db->tail_count > TAIL_MAX
+	    || (db->tail_count > TAIL_MIN && db->tail_count > db->count / 8);
+}
+
+static int db_compact(struct key_db *db) {
+	struct gale_data *keep,output;
+	struct stat st;
+	u32 i,count,slots,offset;
+	int fd,ok;
+
+	fd = open_locked(db,O_RDONLY);
+	if (fd < 0) return 0;
+	if (fstat(fd,&st)) {
+		gale_alert(GALE_WARNING,db->path,errno);
+		close(fd);
+		return 0;
+	}
+	db_check(db);
+
+	/* Find the latest record for each name.  (Don't trust the header's
+	   count; each slot and each new name can contribute one.) */
+	gale_create_array(keep,db->slots + db->tail_count);
+	count = 0;
+	for (i = 0; i < db->slots; ++i) {
+		const u32 where = get_u32(db->map + HEADER_LEN + i * sizeof(u32));
+		struct record r;
+		if (0 != where && read_record(db,where,&r)
+		&&  db_find(db,r.name) == where && 0 != r.key.l) {
+			keep[count].p = db->map + where;
+			keep[count++].l = r.end - where;
+		}
+	}
+
+	for (offset = db->indexed_end; offset < db->scanned; ) {
+		struct record r;
+		if (!read_record(db,offset,&r)) break;
+		if (db_find(db,r.name) == offset && 0 != r.key.l) {
+			keep[count].p = db->map + offset;
+			keep[count++].l = r.end - offset;
+		}
+		offset = r.end;
+	}
+
+	for (slots = SLOTS_MIN; slots < 2 * count; slots *= 2) ;
+	output.l = HEADER_LEN + slots * sizeof(u32);
+	for (i = 0; i < count; ++i) output.l += keep[i].l;
+	output.p = gale_malloc_atomic(output.l);
+	output.l = 0;
+
+	gale_pack_copy(&output,db_magic,sizeof(db_magic));
+	gale_pack_u32(&output,slots);
+	gale_pack_u32(&output,count);
+	offset = HEADER_LEN + slots * sizeof(u32);
+	for (i = 0; i < count; ++i) offset += keep[i].l;
+	gale_pack_u32(&output,offset);
+
+	memset(output.p + output.l,0,slots * sizeof(u32));
+	offset = HEADER_LEN + slots * sizeof(u32);
+	for (i = 0; i < count; ++i) {
+		struct gale_data name,slot;
+		u32 h;
+
+		/* The name is right after the length. */
+		name.p = keep[i].p + sizeof(u32);
+		name.l = sizeof(u32) + gale_wch_size() * get_u32(name.p);
+		h = hash_name(name) & (slots - 1);
+		while (0 != get_u32(output.p + HEADER_LEN + h * sizeof(u32)))
+			h = (h + 1) & (slots - 1);
+
+		slot.p = output.p + HEADER_LEN + h * sizeof(u32);
+		slot.l = 0;
+		gale_pack_u32(&slot,offset);
+		memcpy(output.p + offset,keep[i].p,keep[i].l);
+		offset += keep[i].l;
+	}
+	output.l = offset;
+
+	ok = gale_write_file(db->path,output,0,NULL);
+	close(fd);
+	if (ok) {
+		/* Keep the database as shared as it was. */
+		if (chmod(gale_text_to(gale_global->enc_filesys,db->path),
+			st.st_mode & 07777))
+			gale_alert(GALE_WARNING,db->path,errno);
+		if (st.st_uid != geteuid())
+			gale_alert(GALE_WARNING,gale_text_concat(3,
+				G_("\""),db->path,
+				G_("\" now belongs to us, not its old owner")),0);
+		++(db->compactions);
+	}
+	db_check(db);
+	return ok;
+}
+
+static void *on_compact(oop_source *oop,struct timeval when,void *x) {
+	struct key_db * const db = (struct key_db *) x;
+	db->is_scheduled = 0;
+	/* Someone else may have done it already. */
+	db_check(db);
+	if (!db->is_readonly && is_compact_due(db)) db_compact(db);
+	return OOP_CONTINUE;
+}
+
+static void db_hook(struct gale_time now,oop_source *oop,
+	struct gale_key *key,int flags,
+	struct gale_key_request *handle,
+	void *user,void **ptr)
+{
+	struct key_db * const db = (struct key_db *) user;
+	const struct gale_text name = gale_key_name(key);
+	const unsigned long appends = db->appends;
+	const struct gale_key_assertion *pub;
+	struct db_cache *cache;
+	u32 offset;
+
+	if (0 == name.l) {
+		gale_key_hook_done(oop,key,handle);
+		return;
+	}
+
+	cache = (struct db_cache *) *ptr;
+	if (NULL == cache) {
+		gale_create(cache);
+		cache->generation = db->generation;
+		cache->offset = 0;
+		cache->ass = NULL;
+		cache->written = NULL;
+		*ptr = cache;
+	}
+
+	db_refresh(db,now);
+	offset = db_find(db,name);
+	if (offset != cache->offset || db->generation != cache->generation) {
+		struct record r;
+		gale_key_retract(cache->ass,0);
+		cache->ass = NULL;
+		if (0 != offset && read_record(db,offset,&r) && 0 != r.key.l) {
+			struct gale_data copy;
+			copy.p = gale_malloc(r.key.l);
+			copy.l = r.key.l;
+			memcpy(copy.p,r.key.p,copy.l);
+			cache->ass = gale_key_assert(copy,gale_text_concat(2,
+				G_("in "),db->path),r.stamp,0);
+		}
+		cache->offset = offset;
+		cache->generation = db->generation;
+	}
+
+	/* Keep signed public keys; forget keys that are gone. */
+	pub = gale_key_public(key,now);
+	if (NULL != pub) {
+		if (NULL != gale_key_signed(pub)
+		&&  pub != cache->ass && pub != cache->written
+		&&  db_append(db,name,gale_key_time(pub),gale_key_raw(pub)))
+			cache->written = pub;
+	} else if (NULL != cache->ass) {
+		if (db_append(db,name,now,null_data))
+			gale_alert(GALE_NOTICE,gale_text_concat(4,
+				G_("erased \""),name,G_("\" from "),db->path),0);
+		gale_key_retract(cache->ass,0);
+		cache->ass = NULL;
+	}
+
+	/* Whoever adds to the database tidies it up. */
+	if (appends != db->appends && !db->is_scheduled && is_compact_due(db)) {
+		db->is_scheduled = 1;
+		oop->on_time(oop,OOP_TIME_NOW,on_compact,db);
+	}
+
+	gale_key_hook_done(oop,key,handle);
+}
+
+/** Add a key to a key database.
+ *  Only public keys can be stored; the database is not trusted.
+ *  \param db Path of the database file, which is created if necessary.
+ *  \param key Raw key data, as read from a key file.
+ *  \param stamp Time stamp for the key (usually the file time).
+ *  \return Nonzero iff the key was added.
+ *  \sa gale_key_db_compact() */
+int gale_key_db_add(struct gale_text db,struct gale_data key,struct gale_time stamp) {
+	const struct gale_text name = key_i_name(key);
+	if (0 == name.l || key_i_private(key)) return 0;
+	return db_append(get_db(db),name,stamp,key);
+}
+
+/** Rewrite a key database with a fresh index.
+ *  This happens automatically as the database grows, but it's worth doing
+ *  after adding many keys at once.
+ *  \param db Path of the database file.
+ *  \return Nonzero iff the operation succeeded.
+ *  \sa gale_key_db_add() */
+int gale_key_db_compact(struct gale_text db) {
+	return db_compact(get_db(db));
+}
+
+void key_i_init_db(void) {
+	const struct gale_text path = gale_var(G_("GALE_KEY_DB"));
+	if (0 != path.l) key_i_add_hook(path,db_hook,get_db(path));
+}
@@ -4,29 +4,143 @@
 
 #include <errno.h>
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 enum dir_type { public_dir, cache_dir, trusted_dir, private_dir };
 
 struct dir_data {
 	struct gale_text dir;
 	enum dir_type type;
+	int is_setup,is_watched;
+	struct gale_map *files; /* base name -> struct dir_filename */
+	struct dir_data *next;
+	int wd;
 };
 
 struct dir_filename {
 	struct gale_text name;
 	struct gale_file_state *state;
 	struct gale_key_assertion *ass;
+	int is_current; /* no change since we last looked (if watched) */
 };
 
 struct dir_cache {
 	struct gale_time last;
 	const struct gale_key_assertion *public_written,*private_written;
 	struct dir_filename old,public,private;
+	int epoch;
 };
 
 static const int size_limit = 65536;
 static const int poll_interval = 10;
 
-static void get_file(int trust,struct dir_filename *f) {
+/* Where inotify is available, each directory is watched, and a key's files
+   are only looked at again when the watch says they've changed.  Otherwise
+   (or if the watch fails) we stat them every poll_interval seconds. 
+   If the kernel drops events, watch_epoch changes and everything is 
+   looked at again. */
+
+static int watch_epoch = 0;
+static struct dir_data *watch_list = NULL;
+static struct gale_time watch_drained;
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int watch_fd = -1;
+
+static void watch_event(const struct inotify_event *event) {
+	struct dir_data *data;
+	struct dir_filename *f;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		++watch_epoch;
+		return;
+	}
+
+	for (data = watch_list; NULL != data; data = data->next)
+		if (data->is_watched && event->wd == data->wd) break;
+	if (NULL == data) return;
+
+	if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/* The directory itself is gone; go back to polling. */
+		if (!(event->mask & IN_IGNORED))
+			inotify_rm_watch(watch_fd,data->wd);
+		data->is_watched = 0;
+		++watch_epoch;
+		return;
+	}
+
+	if (0 == event->len) return;
+	f = gale_map_find(data->files,gale_text_as_data(gale_text_from(
+		gale_global->enc_filesys,event->name,-1)));
+	if (NULL != f) f->is_current = 0;
+}
+
+/* Handle any pending events. */
+static void watch_drain(void) {
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} u;
+	ssize_t len;
+
+	if (watch_fd < 0) return;
+	while ((len = read(watch_fd,u.buf,sizeof(u.buf))) > 0) {
+		const char *p = u.buf;
+		while (p < u.buf + len) {
+			const struct inotify_event *event = 
+				(const struct inotify_event *) p;
+			watch_event(event);
+			p += sizeof(*event) + event->len;
+		}
+	}
+}
+
+static void *on_watch(oop_source *oop,int fd,oop_event event,void *x) {
+	watch_drain();
+	return OOP_CONTINUE;
+}
+
+static void watch_dir(oop_source *oop,struct dir_data *data) {
+	static int is_init = 0;
+	const int mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_ATTRIB
+	               | IN_MOVED_FROM | IN_MOVED_TO
+	               | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+	if (!is_init) {
+		is_init = 1;
+		watch_fd = inotify_init();
+		if (watch_fd >= 0) {
+			fcntl(watch_fd,F_SETFL,O_NONBLOCK);
+			fcntl(watch_fd,F_SETFD,FD_CLOEXEC);
+			oop->on_fd(oop,watch_fd,OOP_READ,on_watch,NULL);
+		}
+	}
+
+	if (watch_fd < 0) return;
+	data->wd = inotify_add_watch(watch_fd,
+		gale_text_to(gale_global->enc_filesys,data->dir),mask);
+	data->is_watched = (data->wd >= 0);
+}
+#else
+#define watch_drain() ((void) 0)
+#define watch_dir(oop,data) ((void) 0)
+#endif
+
+static void track_file(struct dir_data *data,struct dir_filename *f,
+	struct gale_text base)
+{
+	f->name = dir_file(data->dir,base);
+	f->is_current = 0;
+	gale_map_add(data->files,gale_text_as_data(base),f);
+}
+
+static void get_file(int trust,int is_watched,struct dir_filename *f) {
+	if (is_watched && f->is_current) return;
+	f->is_current = 1;
 	if (NULL == f->state || gale_file_changed(f->state)) {
 		struct gale_key *owner = gale_key_owner(f->ass);
 		struct gale_data d = gale_read_file(
@@ -94,6 +208,21 @@ static void dir_hook(struct gale_time now,oop_source *oop,
 	struct dir_cache *cache;
 	const int trusted = trusted_dir == data->type 
 	                 || private_dir == data->type;
+	int is_stale;
+
+	if (!data->is_setup) {
+		data->is_setup = 1;
+		data->files = gale_make_map(0);
+		data->next = watch_list;
+		watch_list = data;
+		watch_dir(oop,data);
+	}
+
+	/* Catch up on changes the event loop hasn't gotten to yet. */
+	if (gale_time_compare(now,watch_drained)) {
+		watch_drained = now;
+		watch_drain();
+	}
 
 	if (NULL != *ptr) 
 		cache = *ptr;
@@ -108,19 +237,33 @@ static void dir_hook(struct gale_time now,oop_source *oop,
 		memset(cache,0,sizeof(*cache));
 		*ptr = cache;
 
-		cache->old.name = dir_file(data->dir,key_i_swizzle(name));
-		cache->public.name = dir_file(data->dir,
+		track_file(data,&cache->old,key_i_swizzle(name));
+		track_file(data,&cache->public,
 			gale_text_concat(2,name,G_(".gpub")));
-		cache->private.name = dir_file(data->dir,
+		track_file(data,&cache->private,
 			gale_text_concat(2,name,G_(".gpri")));
+		cache->epoch = watch_epoch;
+	}
+
+	if (!data->is_watched)
+		is_stale = 0 < gale_time_compare(now,gale_time_add(
+			cache->last,gale_time_seconds(poll_interval)));
+	else {
+		if (cache->epoch != watch_epoch) {
+			cache->epoch = watch_epoch;
+			cache->old.is_current = 0;
+			cache->public.is_current = 0;
+			cache->private.is_current = 0;
+		}
+		is_stale = !cache->old.is_current 
+		        || !cache->public.is_current
+		        || (trusted && !cache->private.is_current);
 	}
 
-	if (0 < gale_time_compare(now,
-		gale_time_add(cache->last,gale_time_seconds(poll_interval))))
-	{
-		get_file(trusted,&cache->old);
-		get_file(trusted,&cache->public);
-		if (trusted) get_file(1,&cache->private);
+	if (is_stale) {
+		get_file(trusted,data->is_watched,&cache->old);
+		get_file(trusted,data->is_watched,&cache->public);
+		if (trusted) get_file(1,data->is_watched,&cache->private);
 		cache->last = now;
 		cache->public_written = NULL;
 		cache->private_written = NULL;
@@ -165,7 +308,11 @@ static void add_dir(struct gale_text dir,enum dir_type type) {
 	gale_create(data);
 	data->dir = dir;
 	data->type = type;
-	gale_key_add_hook(dir_hook,data);
+	data->is_setup = data->is_watched = 0;
+	data->files = NULL;
+	data->next = NULL;
+	data->wd = -1;
+	key_i_add_hook(dir,dir_hook,data);
 }
 
 void key_i_init_dirs(void) {
@@ -14,7 +14,60 @@ struct gale_ptr { void *ptr; };
 
 #ifndef CHEESY_ALLOC
 
+#ifdef HAVE_THREADS
+#define GC_THREADS /* so worker threads are registered with the collector */
+#endif
 #include <gc.h>
+#include <sys/time.h>
+
+/* Collector statistics, updated from the collection event callback. */
+static struct gale_memory_stats stats;
+static struct timeval pause_start;
+
+#ifdef HAVE_GC_SET_ON_COLLECTION_EVENT
+static void on_collection(GC_EventType event) {
+	struct timeval now;
+	unsigned long usec,ms;
+	int i;
+
+	switch (event) {
+	case GC_EVENT_START:
+		gettimeofday(&pause_start,NULL);
+		break;
+	case GC_EVENT_END:
+		gettimeofday(&now,NULL);
+		usec = (now.tv_sec - pause_start.tv_sec) * 1000000
+		     + (now.tv_usec - pause_start.tv_usec);
+		stats.pause_total += usec;
+		if (usec > stats.pause_max) stats.pause_max = usec;
+		for (i = 0, ms = usec / 1000;
+		     i < GALE_MEMORY_BUCKETS - 1 && ms >= (1ul << i); ++i) ;
+		++stats.pause_histogram[i];
+		break;
+	default:
+		break;
+	}
+}
+#endif
+
+/* Parallel marking must be configured before the collector starts, 
+   which is before the configuration files have been read, so we can
+   only look at the real environment here. */
+static void start(void) {
+	const char *markers = getenv("GALE_GC_MARKERS");
+	if (NULL != markers && '\0' != *markers) {
+#ifdef HAVE_GC_SET_MARKERS_COUNT
+		GC_set_markers_count(atoi(markers));
+#else
+		setenv("GC_MARKERS",markers,0);
+#endif
+	}
+
+	GC_INIT();
+#ifdef HAVE_GC_SET_ON_COLLECTION_EVENT
+	GC_set_on_collection_event(on_collection);
+#endif
+}
 
 #if defined(HAVE_GC_BACKPTR_H) && defined(GC_DEBUG)
 #include <gc_backptr.h>
@@ -28,6 +81,11 @@ static struct gale_text memory_report(void *x) {
 
 static inline void init() {
 	static int is_init = 0;
+	static int is_started = 0;
+	if (!is_started) {
+		is_started = 1;
+		start();
+	}
 	if (!is_init 
 	&&  NULL != gale_global 
 	&&  NULL != gale_global->report) {
@@ -36,16 +94,40 @@ static inline void init() {
 	}
 }
 #else  /* HAVE_GC_BACKPTR_H */
-static inline void init() { }
+static inline void init() { 
+	static int is_started = 0;
+	if (!is_started) {
+		is_started = 1;
+		start();
+	}
+}
 #endif
 
-void *gale_malloc(size_t len) { init(); GC_INIT(); return GC_MALLOC(len); }
+void *gale_malloc(size_t len) { init(); return GC_MALLOC(len); }
 void *gale_malloc_atomic(size_t len) { init(); return GC_MALLOC_ATOMIC(len); }
 void *gale_malloc_safe(size_t len) { init(); return GC_MALLOC_UNCOLLECTABLE(len); }
 void gale_free(void *ptr) { init(); GC_FREE(ptr); }
 void *gale_realloc(void *s,size_t len) { init(); return GC_REALLOC(s,len); }
 void gale_check_mem(void) { init(); GC_gcollect(); }
 
+void gale_memory_stats(struct gale_memory_stats *out) {
+	init();
+	*out = stats;
+	out->collections = GC_get_gc_no();
+	out->heap_size = GC_get_heap_size();
+	out->free_bytes = GC_get_free_bytes();
+	out->bytes_since_gc = GC_get_bytes_since_gc();
+	out->total_bytes = GC_get_total_bytes();
+}
+
+static void configure(void) {
+	struct gale_text divisor = gale_var(G_("GALE_GC_DIVISOR"));
+	if (gale_text_to_number(gale_var(G_("GALE_GC_INCREMENTAL"))))
+		GC_enable_incremental();
+	if (0 != divisor.l && gale_text_to_number(divisor) > 0)
+		GC_set_free_space_divisor(gale_text_to_number(divisor));
+}
+
 void gale_finalizer(void *obj,void (*f)(void *,void *),void *data) {
 	GC_REGISTER_FINALIZER(obj,f,data,0,0);
 }
@@ -71,6 +153,12 @@ void gale_free(void *ptr) { free(ptr); }
 void *gale_realloc(void *s,size_t len) { return realloc(s,len); }
 void gale_check_mem(void) { }
 
+void gale_memory_stats(struct gale_memory_stats *out) {
+	memset(out,0,sizeof(*out));
+}
+
+static void configure(void) { }
+
 void gale_finalizer(void *obj,void (*f)(void *,void *),void *data) { }
 
 struct gale_ptr *gale_make_weak(void *ptr) {
@@ -100,6 +188,47 @@ void *gale_get_ptr(struct gale_ptr *ptr) {
 
 /* -------------------------------------------------------------------------- */
 
+static struct gale_text kilobytes(size_t bytes) {
+	return gale_text_concat(2,gale_text_from_number(bytes / 1024,10,0),G_("k"));
+}
+
+static struct gale_text stats_report(void *x) {
+	struct gale_memory_stats st;
+	struct gale_text_builder pauses = null_builder;
+	int i;
+
+	gale_memory_stats(&st);
+	for (i = 0; i < GALE_MEMORY_BUCKETS; ++i) {
+		if (0 != i) gale_text_append(&pauses,G_("/"));
+		gale_text_append(&pauses,
+			gale_text_from_number(st.pause_histogram[i],10,0));
+	}
+
+	return gale_text_concat(15,
+		G_("memory: collections="),
+		gale_text_from_number(st.collections,10,0),
+		G_(", heap="),kilobytes(st.heap_size),
+		G_(", free="),kilobytes(st.free_bytes),
+		G_(", since_gc="),kilobytes(st.bytes_since_gc),
+		G_(", pause_total="),
+		gale_text_from_number(st.pause_total / 1000,10,0),
+		G_("ms, pause_max="),
+		gale_text_from_number(st.pause_max / 1000,10,0),
+		G_("ms, pauses="),gale_text_build(&pauses),
+		G_("\n"));
+}
+
+extern struct gale_text _gale_slab_report(void *);
+
+/** \internal Apply collector settings and register statistics.
+ *  Called from gale_init() once the configuration has been read. */
+void _gale_alloc_init(void) {
+	configure();
+	gale_report_add(gale_global->report,stats_report,NULL);
+	gale_report_add(gale_global->report,_gale_slab_report,NULL);
+}
+
+
 struct gale_data gale_data_copy(struct gale_data d) {
 	struct gale_data r;
 	r.p = gale_malloc(d.l);
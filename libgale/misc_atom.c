@@ -0,0 +1,173 @@
+#include "gale/misc.h"
+#include "thread_i.h"
+
+#include <string.h>
+
+/* Atoms are garbage-collected: the intern table only holds weak references,
+   so an atom goes away when nothing refers to it any more.  A new atom for
+   the same text may then be created, but it can never coexist with the old
+   one, so pointer equality still means textual equality.  (Text obtained
+   from an old atom stays valid, but no longer shares the new atom's
+   pointer.)  Atoms kept in static variables must be made with
+   gale_atom_permanent(), since libgale's static data may not be scanned
+   by the collector.  The tables are shared with worker threads, so they
+   are only touched with atom_lock held.
+
+   Only intern names from a fixed set (literals, mostly).  Names from the
+   network should go through gale_text_interned(), which shares an existing
+   atom's text but never makes a new one; otherwise anyone could fill the 
+   table (for good, without the collector). */
+
+struct gale_atom {
+	const struct gale_atom *self;
+	u32 hash;
+	struct gale_text text;
+};
+
+#define LITERAL_CACHE 256
+
+struct literal {
+	const wchar_t *sz;
+	struct gale_text text;
+};
+
+THREAD_LOCK(atom_lock);
+static struct gale_map **atom_map = NULL;
+static struct gale_map **pinned_map = NULL;
+static struct literal *literal_cache = NULL;
+
+static u32 hash(struct gale_text text) {
+	u32 h = 2166136261u;
+	size_t i;
+	for (i = 0; i < text.l; ++i) h = (h ^ (u32) text.p[i]) * 16777619u;
+	return h;
+}
+
+static const struct gale_atom *intern(struct gale_text text) {
+	struct gale_atom *atom;
+	wch *copy;
+
+	if (NULL == atom_map) {
+		atom_map = gale_malloc_safe(sizeof(*atom_map));
+		*atom_map = gale_make_map(1);
+	}
+
+	atom = gale_map_find(*atom_map,gale_text_as_data(text));
+	if (NULL != atom) return atom;
+
+	/* The map key must not point into the atom, or it would never die. */
+	gale_create(atom);
+	copy = gale_malloc_atomic(text.l * sizeof(wch));
+	memcpy(copy,text.p,text.l * sizeof(wch));
+	atom->self = atom;
+	atom->hash = hash(text);
+	atom->text.p = copy;
+	atom->text.l = text.l;
+	gale_map_add(*atom_map,gale_text_as_data(atom->text),atom);
+	return atom;
+}
+
+static const struct gale_atom *intern_permanent(struct gale_text text) {
+	const struct gale_atom *atom = intern(text);
+	if (NULL == pinned_map) {
+		pinned_map = gale_malloc_safe(sizeof(*pinned_map));
+		*pinned_map = gale_make_map(0);
+	}
+	gale_map_add(*pinned_map,gale_atom_key(atom),(void *) atom);
+	return atom;
+}
+
+/** Intern a string.
+ *  \param text The string to intern.
+ *  \return The unique atom for this text.  Two atoms are equal if and
+ *          only if their pointers are equal.
+ *  \sa gale_atom_text(), gale_text_intern() */
+const struct gale_atom *gale_atom(struct gale_text text) {
+	const struct gale_atom *atom;
+	thread_lock(atom_lock);
+	atom = intern(text);
+	thread_unlock(atom_lock);
+	return atom;
+}
+
+/** Intern a string and keep its atom forever.
+ *  Use this for atoms stored in static variables.
+ *  \param text The string to intern.
+ *  \return The unique atom for this text. */
+const struct gale_atom *gale_atom_permanent(struct gale_text text) {
+	const struct gale_atom *atom;
+	thread_lock(atom_lock);
+	atom = intern_permanent(text);
+	thread_unlock(atom_lock);
+	return atom;
+}
+
+/** Get the text of an atom.
+ *  \param atom An atom from gale_atom().
+ *  \return The atom's text.  Text from the same atom always has the same
+ *          pointer, so gale_text_compare() on two such strings is fast. */
+struct gale_text gale_atom_text(const struct gale_atom *atom) {
+	return atom->text;
+}
+
+/** Get the hash value of an atom.
+ *  \param atom An atom from gale_atom().
+ *  \return A hash of the atom's text, computed when it was interned. */
+u32 gale_atom_hash(const struct gale_atom *atom) {
+	return atom->hash;
+}
+
+/** Use an atom as a map key.
+ *  \param atom An atom from gale_atom().
+ *  \return A short key which identifies the atom (by address). */
+struct gale_data gale_atom_key(const struct gale_atom *atom) {
+	struct gale_data key;
+	key.p = (byte *) &atom->self;
+	key.l = sizeof(atom->self);
+	return key;
+}
+
+/** Intern a string.
+ *  \param text The string to intern.
+ *  \return The same text, shared with every other interned copy. 
+ *  \sa gale_text_interned() */
+struct gale_text gale_text_intern(struct gale_text text) {
+	return gale_atom(text)->text;
+}
+
+/** Find an interned copy of a string, without interning it.
+ *  Use this for text from outside, such as the network.
+ *  \param text The string to look for.
+ *  \return The interned copy of \a text if there is one; 
+ *          otherwise \a text itself. */
+struct gale_text gale_text_interned(struct gale_text text) {
+	const struct gale_atom *atom = NULL;
+	thread_lock(atom_lock);
+	if (NULL != atom_map) 
+		atom = gale_map_find(*atom_map,gale_text_as_data(text));
+	thread_unlock(atom_lock);
+	return (NULL == atom) ? text : atom->text;
+}
+
+struct gale_text _gale_atom_literal(const wchar_t *sz,size_t len) {
+	struct literal *slot;
+	struct gale_text text;
+
+	/* Literals have static addresses, so we can cache by pointer. */
+	thread_lock(atom_lock);
+	if (NULL == literal_cache) {
+		literal_cache = gale_malloc_safe(
+			LITERAL_CACHE * sizeof(*literal_cache));
+		memset(literal_cache,0,LITERAL_CACHE * sizeof(*literal_cache));
+	}
+
+	slot = &literal_cache[((size_t) sz / sizeof(wchar_t)) % LITERAL_CACHE];
+	if (slot->sz != sz) {
+		slot->text = intern_permanent(_gale_text_literal(sz,len))->text;
+		slot->sz = sz;
+	}
+
+	text = slot->text;
+	thread_unlock(atom_lock);
+	return text;
+}
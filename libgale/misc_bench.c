@@ -0,0 +1,107 @@
+#include "gale/misc.h"
+#include "gale/core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Microbenchmarks for libgale utility code.  Each result is printed as a
+   tab-separated line: test, variant, nanoseconds per operation, and the
+   heap growth (in kilobytes) over the run.  For charsets, an operation is
+   one character converted out and back in. */
+
+#define OBJECTS 1000000
+#define WINDOW 1000
+#define CONVERSIONS 20000
+
+struct object {
+	void *p;
+	struct object *next;
+	struct gale_time when;
+};
+
+static double elapsed(struct timeval start) {
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return (now.tv_sec - start.tv_sec) * 1e9
+	     + (now.tv_usec - start.tv_usec) * 1e3;
+}
+
+static void result(const char *test,const char *variant,double ns,size_t heap) {
+	struct gale_memory_stats stats;
+	gale_memory_stats(&stats);
+	printf("%s\t%s\t%.1f\t%lu\n",test,variant,ns,
+	       (unsigned long) (stats.heap_size - heap) / 1024);
+}
+
+/* Keep a sliding window of live objects, like a link's message queue. */
+static void bench_alloc(int use_slab) {
+	static struct object *window[WINDOW];
+	struct gale_slab *slab = gale_make_slab(G_("bench"),sizeof(struct object));
+	struct gale_memory_stats stats;
+	struct timeval start;
+	int i;
+
+	for (i = 0; i < WINDOW; ++i) window[i] = NULL;
+	gale_check_mem();
+	gale_memory_stats(&stats);
+	gettimeofday(&start,NULL);
+
+	for (i = 0; i < OBJECTS; ++i) {
+		struct object **slot = &window[i % WINDOW];
+		if (use_slab) {
+			gale_slab_free(slab,*slot);
+			gale_slab_create(slab,*slot);
+		} else {
+			if (NULL != *slot) gale_free(*slot);
+			gale_create(*slot);
+		}
+		(*slot)->p = slot;
+		(*slot)->next = NULL;
+	}
+
+	result("alloc",use_slab ? "slab" : "gale_malloc",
+	       elapsed(start) / OBJECTS,stats.heap_size);
+}
+
+/* Convert a message-sized string to an encoding and back. */
+static void bench_charset(const char *charset,const char *variant,const char *sample) {
+	struct gale_encoding *enc = gale_make_encoding(gale_text_from(NULL,charset,-1));
+	struct gale_text_builder body = null_builder;
+	struct gale_memory_stats stats;
+	struct gale_text text;
+	struct timeval start;
+	int i;
+
+	if (NULL == enc) {
+		fprintf(stderr,"misc_bench: no encoding for \"%s\"\n",charset);
+		return;
+	}
+
+	for (i = 0; i < 16; ++i)
+		gale_text_append(&body,gale_text_from(enc,sample,-1));
+	text = gale_text_build(&body);
+
+	gale_check_mem();
+	gale_memory_stats(&stats);
+	gettimeofday(&start,NULL);
+
+	for (i = 0; i < CONVERSIONS; ++i)
+		text = gale_text_from(enc,gale_text_to(enc,text),-1);
+
+	result("charset",variant,
+	       elapsed(start) / CONVERSIONS / text.l,stats.heap_size);
+}
+
+int main(int argc,char *argv[]) {
+	const char *ascii = "The quick brown fox jumps over the lazy dog.\n";
+	const char *mixed = "Der Fu\xc3\x9f \xe2\x80\x94 \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e, caf\xc3\xa9.\n";
+
+	gale_init("misc_bench",argc,argv);
+	bench_alloc(0);
+	bench_alloc(1);
+	bench_charset("UTF-8","utf-8/ascii",ascii);
+	bench_charset("UTF-8","utf-8/mixed",mixed);
+	bench_charset("ISO-8859-1","iconv/ascii",ascii);
+	return 0;
+}
@@ -2,10 +2,21 @@
 #include "gale/misc.h"
 
 #include <errno.h>
+#include <string.h>
 #include <assert.h>
 #include <netinet/in.h>
 
+/* UTF-8 and ASCII are converted here directly; iconv is only used for
+   other character sets.  Runs of ASCII, which are most of what we see,
+   are checked a machine word at a time. */
+
+enum native { native_none, native_ascii, native_utf8 };
+
+typedef unsigned long word;
+#define HIGH_BITS (((word) -1 / 0xFF) * 0x80)
+
 struct gale_encoding {
+	enum native native;
 #ifdef HAVE_ICONV
 	iconv_t from;
 	iconv_t to;
@@ -25,14 +36,43 @@ static iconv_t get_iconv(struct gale_text to,struct gale_text from) {
 }
 #endif
 
+static enum native find_native(struct gale_text name) {
+	char buf[16];
+	size_t i,len = 0;
+
+	for (i = 0; i < name.l; ++i) {
+		wch ch = name.p[i];
+		if ('-' == ch || '_' == ch) continue;
+		if (ch >= 'a' && ch <= 'z') ch += 'A' - 'a';
+		if (ch >= 128 || len + 1 == sizeof(buf)) return native_none;
+		buf[len++] = ch;
+	}
+
+	buf[len] = '\0';
+	if (!strcmp(buf,"UTF8")) return native_utf8;
+	if (!strcmp(buf,"ASCII") || !strcmp(buf,"USASCII")
+	||  !strcmp(buf,"ANSIX3.41968") || !strcmp(buf,"646"))
+		return native_ascii;
+	return native_none;
+}
+
 struct gale_encoding *gale_make_encoding(struct gale_text name) {
 	struct gale_encoding *enc = NULL;
-
 #ifdef HAVE_ICONV
 	struct gale_text ienc = (4 == sizeof(wch)) ? G_("UCS-4") : G_("UCS-2");
+#endif
+	const enum native native = find_native(name);
 
+	if (native_none != native) {
+		gale_create(enc);
+		enc->native = native;
+		return enc;
+	}
+
+#ifdef HAVE_ICONV
 	if (0 != name.l) {
 		gale_create(enc);
+		enc->native = native_none;
 		enc->from = get_iconv(ienc,name);
 		enc->to = get_iconv(name,ienc);
 
@@ -45,38 +85,177 @@ struct gale_encoding *gale_make_encoding(struct gale_text name) {
 	return enc;
 }
 
+/* Length of the run of ASCII bytes at the start of a buffer. */
+static size_t ascii_span(const unsigned char *p,size_t len) {
+	size_t i = 0;
+	word w;
+
+	while (i + sizeof(w) <= len) {
+		memcpy(&w,p + i,sizeof(w));
+		if (0 != (w & HIGH_BITS)) break;
+		i += sizeof(w);
+	}
+
+	while (i < len && p[i] < 0x80) ++i;
+	return i;
+}
+
+/* Length of the run of non-NUL ASCII characters at the start of text. */
+static size_t wch_span(const wch *p,size_t len) {
+	size_t i = 0;
+
+	while (i + 4 <= len
+	&&     ((unsigned long) p[i] | (unsigned long) p[i + 1]
+	      | (unsigned long) p[i + 2] | (unsigned long) p[i + 3]) < 0x80
+	&&     0 != p[i] && 0 != p[i + 1] && 0 != p[i + 2] && 0 != p[i + 3])
+		i += 4;
+
+	while (i < len && 0 != p[i] && (unsigned long) p[i] < 0x80) ++i;
+	return i;
+}
+
+static void widen(wch *out,const unsigned char *in,size_t len) {
+	size_t i;
+	for (i = 0; i < len; ++i) out[i] = in[i];
+}
+
+static void narrow(char *out,const wch *in,size_t len) {
+	size_t i;
+	for (i = 0; i < len; ++i) out[i] = in[i];
+}
+
 static struct gale_text gale_text_from_ascii(const char *pch,int len) {
 	struct gale_text text;
-	size_t i;
 
 	if (!pch) {
 		text.p = NULL;
 		text.l = 0;
 	} else {
 		wch *buf;
-		buf = gale_malloc(sizeof(wch) * (text.l = len));
-		for (i = 0; i < text.l; ++i) buf[i] = (unsigned char) pch[i];
+		buf = gale_malloc_atomic(sizeof(wch) * (text.l = len));
+		widen(buf,(const unsigned char *) pch,text.l);
 		text.p = buf;
 	}
 
 	return text;
 }
 
+/* Anything below 128 (including NUL, and negative values) is copied as
+   it is; only characters 128 and up become '?'. */
 static char *gale_text_to_ascii(struct gale_text text) {
 	char *pch;
-	size_t i;
-
-	pch = gale_malloc(text.l + 1);
-	for (i = 0; i < text.l; ++i) 
-		if (text.p[i] < 128)
-			pch[i] = text.p[i];
-		else
-			pch[i] = '?';
+	size_t i = 0;
+
+	pch = gale_malloc_atomic(text.l + 1);
+	while (i < text.l) {
+		size_t run = wch_span(text.p + i,text.l - i);
+		narrow(pch + i,text.p + i,run);
+		i += run;
+		if (i < text.l) {
+			pch[i] = (text.p[i] < 128) ? text.p[i] : '?';
+			++i;
+		}
+	}
 
 	pch[i] = '\0';
 	return pch;
 }
 
+/* Decode UTF-8 (or ASCII); invalid bytes become U+FFFD, as with iconv. */
+static struct gale_text native_from(enum native native,const char *p,size_t l) {
+	const unsigned char *in = (const unsigned char *) p;
+	struct gale_text out;
+	size_t i = 0,o = 0;
+	wch *buf = gale_malloc_atomic(sizeof(wch) * (l ? l : 1));
+
+	while (i < l) {
+		size_t run = ascii_span(in + i,l - i),need,j;
+		unsigned long ch;
+
+		widen(buf + o,in + i,run);
+		i += run;
+		o += run;
+		if (i == l) break;
+
+		ch = in[i];
+		if (native_ascii == native || ch < 0xC2 || ch > 0xF4)
+			need = 0;
+		else if (ch < 0xE0) { need = 1; ch &= 0x1F; }
+		else if (ch < 0xF0) { need = 2; ch &= 0x0F; }
+		else { need = 3; ch &= 0x07; }
+
+		for (j = 1; j <= need; ++j) {
+			if (i + j == l || 0x80 != (in[i + j] & 0xC0)) break;
+			ch = (ch << 6) | (in[i + j] & 0x3F);
+		}
+
+		if (0 == need || j <= need
+		|| (2 == need && (ch < 0x800 || (ch >= 0xD800 && ch < 0xE000)))
+		|| (3 == need && (ch < 0x10000 || ch > 0x10FFFF))) {
+			buf[o++] = 0xFFFD;
+			++i;
+		} else {
+			buf[o++] = ch;
+			i += 1 + need;
+		}
+	}
+
+	out.p = buf;
+	out.l = o;
+	return out;
+}
+
+/* Encode UTF-8 (or ASCII); characters which can't be encoded are
+   dropped and NULs become '?', as with iconv. */
+static char *native_to(enum native native,struct gale_text t) {
+	size_t i,len = 0,o = 0;
+	char *buf;
+
+	for (i = 0; i < t.l; ++i) {
+		const unsigned long ch = t.p[i];
+		if (ch < 0x80 || native_ascii == native) len += (ch < 0x80);
+		else if (ch < 0x800) len += 2;
+		else if (ch < 0x10000) len += (ch >= 0xD800 && ch < 0xE000) ? 0 : 3;
+		else if (ch <= 0x10FFFF) len += 4;
+	}
+
+	buf = gale_malloc_atomic(len + 1);
+	i = 0;
+	while (i < t.l) {
+		size_t run = wch_span(t.p + i,t.l - i);
+		unsigned long ch;
+
+		narrow(buf + o,t.p + i,run);
+		i += run;
+		o += run;
+		if (i == t.l) break;
+
+		ch = t.p[i++];
+		if (0 == ch)
+			buf[o++] = '?';
+		else if (native_ascii == native)
+			continue;
+		else if (ch < 0x800) {
+			buf[o++] = 0xC0 | (ch >> 6);
+			buf[o++] = 0x80 | (ch & 0x3F);
+		} else if (ch < 0x10000) {
+			if (ch >= 0xD800 && ch < 0xE000) continue;
+			buf[o++] = 0xE0 | (ch >> 12);
+			buf[o++] = 0x80 | ((ch >> 6) & 0x3F);
+			buf[o++] = 0x80 | (ch & 0x3F);
+		} else if (ch <= 0x10FFFF) {
+			buf[o++] = 0xF0 | (ch >> 18);
+			buf[o++] = 0x80 | ((ch >> 12) & 0x3F);
+			buf[o++] = 0x80 | ((ch >> 6) & 0x3F);
+			buf[o++] = 0x80 | (ch & 0x3F);
+		}
+	}
+
+	assert(o == len);
+	buf[o] = '\0';
+	return buf;
+}
+
 #ifdef HAVE_ICONV
 static void to_ucs(wch *ch) {
 	if (4 == sizeof(wch))
@@ -108,6 +287,7 @@ struct gale_text gale_text_from(struct gale_encoding *e,const char *p,int l) {
 
 	if (l < 0) l = (NULL == p) ? 0 : strlen(p);
 	if (suspend_count || NULL == e) return gale_text_from_ascii(p,l);
+	if (native_none != e->native) return native_from(e->native,p,l);
 	++suspend_count;
 
 #ifndef HAVE_ICONV
@@ -161,6 +341,7 @@ char *gale_text_to(struct gale_encoding *e,struct gale_text t) {
 #endif
 
 	if (suspend_count || NULL == e) return gale_text_to_ascii(t);
+	if (native_none != e->native) return native_to(e->native,t);
 	++suspend_count;
 
 #ifndef HAVE_ICONV
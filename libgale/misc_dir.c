@@ -22,21 +22,23 @@
  *  \param file The filename relative to \a path.
  *  \return The full name of the file. */
 struct gale_text dir_file(struct gale_text path,struct gale_text file) {
-	struct gale_text r = null_text,part = null_text;
+	struct gale_text_builder b = null_builder;
+	struct gale_text r,part = null_text;
 	if (0 == path.l) return file;
 
 	while (gale_text_token(file,'/',&part)) {
 		if (part.p + part.l < file.p + file.l) ++part.l;
 		if (gale_text_compare(part,G_(".."))
 		&&  gale_text_compare(part,G_("../")))
-			r = gale_text_concat(2,r,part);
+			gale_text_append(&b,part);
 		else {
-			r = gale_text_concat(3,r,G_("__"),
-				gale_text_right(part,-2));
+			gale_text_append(&b,G_("__"));
+			gale_text_append(&b,gale_text_right(part,-2));
 		}
 		if (part.l > 0 && '/' == part.p[part.l - 1]) --part.l;
 	}
 
+	r = gale_text_build(&b);
 	if (gale_text_compare(r,file))
 		gale_alert(GALE_WARNING,gale_text_concat(6,
 			G_("replaced \""),file,G_("\" with \""),r,
@@ -1,6 +1,7 @@
 #include "gale/misc.h"
 #include "gale/compat.h"
 #include "gale/globals.h"
+#include "thread_i.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -18,8 +19,34 @@ struct gale_errors {
 struct error_message {
 	enum gale_error severity;
 	struct gale_text text;
+	struct error_message *next;
 };
 
+/* Alerts from worker threads wait here, oldest first, until the event
+   loop picks them up with thread_i_flush_alerts(). */
+struct deferred {
+	struct error_message *head,*tail;
+};
+
+THREAD_LOCK(deferred_lock);
+static struct deferred *deferred = NULL;
+
+#ifdef HAVE_THREADS
+static pthread_key_t collect_key;
+static pthread_once_t collect_once = PTHREAD_ONCE_INIT;
+
+static void collect_init(void) {
+	pthread_key_create(&collect_key,NULL);
+}
+
+static struct thread_i_alerts *collecting(void) {
+	pthread_once(&collect_once,collect_init);
+	return (struct thread_i_alerts *) pthread_getspecific(collect_key);
+}
+#else
+#define collecting() ((struct thread_i_alerts *) NULL)
+#endif
+
 static void output(struct error_message *message) {
 	gale_print(stderr,1,G_("! "));
 	gale_print(stderr,0,message->text);
@@ -37,6 +64,35 @@ static void *on_error(oop_source *source,struct timeval when,void *data) {
 	return OOP_CONTINUE;
 }
 
+static void dispatch(struct error_message *message) {
+	if (NULL == gale_global || NULL == gale_global->error)
+		output(message);
+	else
+		gale_global->error->source->on_time(
+			gale_global->error->source,
+			OOP_TIME_NOW,
+			on_error,message);
+}
+
+/* Deliver a (nonfatal) alert, or hold it for the event loop. */
+static void deliver(struct error_message *message) {
+	if (!thread_i_is_worker()) {
+		dispatch(message);
+		return;
+	}
+
+	message->next = NULL;
+	thread_lock(deferred_lock);
+	if (NULL == deferred) {
+		deferred = gale_malloc_safe(sizeof(*deferred));
+		deferred->head = deferred->tail = NULL;
+	}
+	if (NULL == deferred->tail) deferred->head = message;
+	else deferred->tail->next = message;
+	deferred->tail = message;
+	thread_unlock(deferred_lock);
+}
+
 /** Set a different error handler.
  *  The function \a func will be called when an error is reported.
  *  \param oop The liboop source used for dispatch.
@@ -54,6 +110,7 @@ void gale_on_error(oop_source *oop,gale_call_error *func,void *user) {
  *  \param msg The error message to report.
  *  \param err If nonzero, a system errno value to look up. */
 void gale_alert(int severity,struct gale_text msg,int err) {
+	struct thread_i_alerts * const collect = collecting();
 	struct error_message *message;
 	struct gale_text stamp,prefix,label;
 
@@ -79,13 +136,60 @@ void gale_alert(int severity,struct gale_text msg,int err) {
 		message->text = gale_text_concat(5,
 			stamp,prefix,label,G_(": "),msg);
 
-	if (NULL == gale_global || NULL == gale_global->error)
+	message->next = NULL;
+
+	/* A fatal error off the main thread can't wait for the event loop. */
+	if (GALE_ERROR == severity && (NULL != collect || thread_i_is_worker())) {
 		output(message);
-	else
-		gale_global->error->source->on_time(
-			gale_global->error->source,
-			OOP_TIME_NOW,
-			on_error,message);
+		exit(1);
+	}
+
+#ifdef HAVE_THREADS
+	if (NULL != collect) {
+		if (NULL == collect->tail) collect->head = message;
+		else collect->tail->next = message;
+		collect->tail = message;
+		return;
+	}
+#endif
+
+	if (GALE_ERROR != severity) {
+		deliver(message);
+		return;
+	}
 
-	if (GALE_ERROR == severity) exit(1);
+	dispatch(message);
+	exit(1);
+}
+
+#ifdef HAVE_THREADS
+void thread_i_flush_alerts(void) {
+	struct error_message *message;
+
+	thread_lock(deferred_lock);
+	message = (NULL == deferred) ? NULL : deferred->head;
+	if (NULL != deferred) deferred->head = deferred->tail = NULL;
+	thread_unlock(deferred_lock);
+
+	while (NULL != message) {
+		struct error_message * const next = message->next;
+		dispatch(message);
+		message = next;
+	}
+}
+
+void thread_i_collect(struct thread_i_alerts *list) {
+	pthread_once(&collect_once,collect_init);
+	pthread_setspecific(collect_key,list);
+}
+
+void thread_i_report(struct thread_i_alerts *list) {
+	struct error_message *message = list->head;
+	list->head = list->tail = NULL;
+	while (NULL != message) {
+		struct error_message * const next = message->next;
+		deliver(message);
+		message = next;
+	}
 }
+#endif
@@ -1,5 +1,6 @@
 #include "gale/misc.h"
 #include "gale/crypto.h" /* for hash */
+#include "thread_i.h"
 
 #include <assert.h>
 #include <time.h>
@@ -19,18 +20,30 @@ struct gale_group gale_group_empty(void) {
 	return g;
 }
 
+/* A chain link and its single fragment, allocated together. */
+struct group_node {
+	struct gale_group group;
+	struct gale_fragment frag;
+};
+
+/* Groups are built on worker threads too. */
+THREAD_LOCK(slab_lock);
+static struct gale_slab *node_slab = NULL;
+
 void gale_group_add(struct gale_group *g,struct gale_fragment f) {
-	struct gale_group *gn;
-	struct gale_fragment *list;
+	struct group_node *node;
 
-	gale_create(gn);
-	*gn = *g;
+	thread_lock(slab_lock);
+	if (NULL == node_slab)
+		node_slab = gale_make_slab(G_("group node"),sizeof(*node));
+	thread_unlock(slab_lock);
 
-	gale_create(list);
-	list[0] = f;
-	g->list = list;
+	gale_slab_create(node_slab,node);
+	node->group = *g;
+	node->frag = f;
+	g->list = &node->frag;
 	g->len = 1;
-	g->next = gn;
+	g->next = &node->group;
 }
 
 void gale_group_append(struct gale_group *g,struct gale_group ga) {
@@ -60,6 +73,14 @@ void gale_group_append(struct gale_group *g,struct gale_group ga) {
 	*g = n;
 }
 
+/* Unpacked fragment names share the text of any interned literal they
+   match, so if the caller's name is one (see GA_()), matches are found by
+   pointer comparison. */
+static int same_name(struct gale_text a,struct gale_text b) {
+	return a.l == b.l 
+	   && (a.p == b.p || !memcmp(a.p,b.p,a.l * sizeof(*a.p)));
+}
+
 struct gale_group gale_group_find(
 	struct gale_group g,
 	struct gale_text name,
@@ -67,7 +88,7 @@ struct gale_group gale_group_find(
 {
 	while (!gale_group_null(g) 
 	   && (gale_group_first(g).type != type
-	   ||  gale_text_compare(gale_group_first(g).name,name)))
+	   ||  !same_name(gale_group_first(g).name,name)))
 		g = gale_group_rest(g);
 	return g;
 }
@@ -81,6 +102,131 @@ int gale_group_lookup(struct gale_group group,struct gale_text name,
 	return 1;
 }
 
+/* A group index is a flattened copy of the group, plus an open-addressed
+   hash table on (name, type).  Each table slot refers to a contiguous run
+   of the matching fragments (in group order) in a separate array. */
+
+struct index_slot {
+	u32 hash;
+	int rep;		/* index in the group of the first match, or -1 */
+	int first,count,fill;	/* run of matches */
+};
+
+struct gale_group_index {
+	struct gale_group group;
+	struct gale_fragment *matches;
+	struct index_slot *slots;
+	size_t mask;
+};
+
+static u32 index_hash(struct gale_text name,enum gale_fragment_type type) {
+	u32 h = 2166136261u ^ (u32) type;
+	size_t i;
+	for (i = 0; i < name.l; ++i) h = (h ^ (u32) name.p[i]) * 16777619u;
+	return h;
+}
+
+static struct index_slot *index_slot(
+	const struct gale_group_index *index,
+	struct gale_text name,enum gale_fragment_type type,u32 hash)
+{
+	size_t i = hash & index->mask;
+	for (;;) {
+		struct index_slot * const slot = &index->slots[i];
+		if (slot->rep < 0) return slot;
+		if (slot->hash == hash) {
+			const struct gale_fragment *rep = 
+				&index->group.list[slot->rep];
+			if (rep->type == type && same_name(rep->name,name)) 
+				return slot;
+		}
+		i = (i + 1) & index->mask;
+	}
+}
+
+struct gale_group_index *gale_make_group_index(struct gale_group group) {
+	struct gale_group_index *index;
+	struct gale_fragment *list;
+	size_t i,count = 0,size = 8;
+	int offset = 0;
+
+	gale_create(index);
+	for (index->group = group; !gale_group_null(index->group);
+	     index->group = gale_group_rest(index->group)) 
+		++count;
+
+	gale_create_array(list,count);
+	for (i = 0; i < count; ++i) {
+		list[i] = gale_group_first(group);
+		group = gale_group_rest(group);
+	}
+
+	index->group.list = list;
+	index->group.len = count;
+	index->group.next = NULL;
+	gale_create_array(index->matches,count);
+
+	while (size < 2 * count) size *= 2;
+	index->mask = size - 1;
+	gale_create_array(index->slots,size);
+	for (i = 0; i < size; ++i) {
+		index->slots[i].rep = -1;
+		index->slots[i].count = 0;
+		index->slots[i].fill = 0;
+	}
+
+	for (i = 0; i < count; ++i) {
+		const u32 hash = index_hash(list[i].name,list[i].type);
+		struct index_slot * const slot = 
+			index_slot(index,list[i].name,list[i].type,hash);
+		if (slot->rep < 0) {
+			slot->hash = hash;
+			slot->rep = i;
+		}
+		++slot->count;
+	}
+
+	for (i = 0; i < size; ++i) {
+		index->slots[i].first = offset;
+		offset += index->slots[i].count;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct index_slot * const slot = index_slot(index,
+			list[i].name,list[i].type,
+			index_hash(list[i].name,list[i].type));
+		index->matches[slot->first + slot->fill++] = list[i];
+	}
+
+	return index;
+}
+
+int gale_index_find(
+	const struct gale_group_index *index,
+	struct gale_text name,enum gale_fragment_type type,
+	const struct gale_fragment **frags)
+{
+	const struct index_slot * const slot = 
+		index_slot(index,name,type,index_hash(name,type));
+	*frags = index->matches + slot->first;
+	return slot->count;
+}
+
+int gale_index_lookup(
+	const struct gale_group_index *index,
+	struct gale_text name,enum gale_fragment_type type,
+	struct gale_fragment *frag)
+{
+	const struct gale_fragment *frags;
+	if (0 == gale_index_find(index,name,type,&frags)) return 0;
+	*frag = frags[0];
+	return 1;
+}
+
+struct gale_group gale_index_group(const struct gale_group_index *index) {
+	return index->group;
+}
+
 int gale_group_remove(
 	struct gale_group *g,
 	struct gale_text name,
@@ -151,54 +297,124 @@ void gale_group_prefix(struct gale_group *g,struct gale_group tail) {
 	*g = n;
 }
 
-int gale_unpack_fragment(struct gale_data *d,struct gale_fragment *f) {
+static int unpack_group(struct gale_data *,struct gale_group *,int borrow);
+
+int gale_view_next(struct gale_data *d,struct gale_fragment_view *view) {
 	struct gale_data fdata;
-	size_t size;
-	u32 num,type,len;
+	u32 type,len,name_len;
 
-	if (!gale_unpack_u32(d,&type) || type > max_fragment
+	if (!gale_unpack_u32(d,&type) || type >= max_fragment
 	||  !gale_unpack_u32(d,&len) || len > d->l)
 		return 0;
 
-	/* point of no return */
-
 	fdata.p = d->p;
 	fdata.l = len;
 	d->p += len;
 	d->l -= len;
 
-	if (!gale_unpack_text(&fdata,&f->name)) goto warning;
-
 	switch (type) {
-	case fragment_text:
-		f->type = frag_text;
+	case fragment_text: view->type = frag_text; break;
+	case fragment_data: view->type = frag_data; break;
+	case fragment_time: view->type = frag_time; break;
+	case fragment_number: view->type = frag_number; break;
+	case fragment_group: view->type = frag_group; break;
+	default: assert(0); /* checked above */
+	}
+
+	/* A fragment with a bad name is passed along (as "error"). */
+	view->name = null_data;
+	view->value = fdata;
+	if (gale_unpack_u32(&fdata,&name_len)
+	&&  name_len * gale_wch_size() <= fdata.l) {
+		view->name.p = fdata.p;
+		view->name.l = name_len * gale_wch_size();
+		view->value.p = fdata.p + view->name.l;
+		view->value.l = fdata.l - view->name.l;
+	}
+
+	return 1;
+}
+
+static wch name_char(struct gale_data name,size_t i) {
+	return (name.p[2*i] << 8) | name.p[2*i + 1];
+}
+
+static int view_name_is(const struct gale_fragment_view *view,struct gale_text name) {
+	size_t i;
+	if (NULL == view->name.p || view->name.l != name.l * gale_wch_size()) 
+		return 0;
+	for (i = 0; i < name.l; ++i)
+		if (name_char(view->name,i) != name.p[i]) return 0;
+	return 1;
+}
+
+struct gale_text gale_view_name(const struct gale_fragment_view *view) {
+	wch buf[64],*copy = buf;
+	struct gale_text name;
+	size_t i;
+
+	if (NULL == view->name.p) return G_("error");
+	name.l = view->name.l / gale_wch_size();
+	if (name.l > sizeof(buf) / sizeof(buf[0])) 
+		copy = gale_malloc_atomic(name.l * sizeof(*copy));
+	for (i = 0; i < name.l; ++i) copy[i] = name_char(view->name,i);
+	name.p = copy;
+	name = gale_text_interned(name);
+	if (name.p == buf) {
+		copy = gale_malloc_atomic(name.l * sizeof(*copy));
+		memcpy(copy,buf,name.l * sizeof(*copy));
+		name.p = copy;
+	}
+	return name;
+}
+
+int gale_view_lookup(
+	struct gale_data group,
+	struct gale_text name,enum gale_fragment_type type,
+	struct gale_fragment_view *view)
+{
+	while (gale_view_next(&group,view))
+		if (view->type == type && view_name_is(view,name)) return 1;
+	return 0;
+}
+
+static void view_fragment(
+	const struct gale_fragment_view *view,
+	struct gale_fragment *f,int borrow)
+{
+	struct gale_data fdata = view->value;
+	size_t size;
+	u32 num;
+
+	if (NULL == view->name.p) goto warning;
+	f->name = gale_view_name(view);
+	f->type = view->type;
+
+	switch (view->type) {
+	case frag_text:
 		size = fdata.l / gale_wch_size();
 		if (!gale_unpack_text_len(&fdata,size,&f->value.text))
 			goto warning;
 		break;
-	case fragment_data:
-		f->type = frag_data;
-		f->value.data = gale_data_copy(fdata);
+	case frag_data:
+		f->value.data = borrow ? fdata : gale_data_copy(fdata);
 		fdata = null_data;
 		break;
-	case fragment_time:
-		f->type = frag_time;
+	case frag_time:
 		if (!gale_unpack_time(&fdata,&f->value.time))
 			goto warning;
 		break;
-	case fragment_number:
-		f->type = frag_number;
+	case frag_number:
 		if (!gale_unpack_u32(&fdata,&num)) 
 			goto warning;
 		f->value.number = (s32) num;
 		break;
-	case fragment_group:
-		f->type = frag_group;
-		if (!gale_unpack_group(&fdata,&f->value.group)) 
+	case frag_group:
+		if (!unpack_group(&fdata,&f->value.group,borrow)) 
 			goto warning;
 		break;
 	default:
-		assert(0); /* checked above */
+		assert(0);
 	}
 
 	if (0 != fdata.l) {
@@ -206,9 +422,21 @@ int gale_unpack_fragment(struct gale_data *d,struct gale_fragment *f) {
 		gale_alert(GALE_WARNING,G_("invalid fragment"),0);
 		f->name = G_("error");
 		f->type = frag_data;
-		f->value.data = gale_data_copy(fdata);
+		f->value.data = borrow ? fdata : gale_data_copy(fdata);
 	}
+}
 
+void gale_view_fragment(
+	const struct gale_fragment_view *view,
+	struct gale_fragment *f)
+{
+	view_fragment(view,f,1);
+}
+
+int gale_unpack_fragment(struct gale_data *d,struct gale_fragment *f) {
+	struct gale_fragment_view view;
+	if (!gale_view_next(d,&view)) return 0;
+	view_fragment(&view,f,0);
 	return 1;
 }
 
@@ -281,12 +509,16 @@ void gale_pack_fragment(struct gale_data *data,struct gale_fragment frag) {
 	}
 }
 
-int gale_unpack_group(struct gale_data *data,struct gale_group *group) {
+static int unpack_group(
+	struct gale_data *data,struct gale_group *group,int borrow) 
+{
 	struct gale_fragment list[100],*copy;
+	struct gale_fragment_view view;
 	struct gale_group *next;
 	int count = 0;
 
-	while (gale_unpack_fragment(data,&list[count])) {
+	while (gale_view_next(data,&view)) {
+		view_fragment(&view,&list[count],borrow);
 		if (++count == sizeof(list)/sizeof(list[0])) {
 			gale_create_array(copy,group->len = count);
 			memcpy(copy,list,sizeof(list[0]) * count);
@@ -305,6 +537,14 @@ int gale_unpack_group(struct gale_data *data,struct gale_group *group) {
 	return 1;
 }
 
+int gale_unpack_group(struct gale_data *data,struct gale_group *group) {
+	return unpack_group(data,group,0);
+}
+
+int gale_view_group(struct gale_data *data,struct gale_group *group) {
+	return unpack_group(data,group,1);
+}
+
 size_t gale_group_size(struct gale_group group) {
 	size_t size = 0;
 	while (!gale_group_null(group)) {
@@ -345,12 +585,15 @@ struct gale_text gale_print_fragment(struct gale_fragment frag,int indent) {
 		if (3*frag.value.data.l < 82 - indent)
 		{
 			int i;
-			struct gale_text r = G_("[");
-			for (i = 0; i < frag.value.data.l; ++i)
-				r = gale_text_concat(3,r,
-					i ? G_(" ") : G_(""),
-					gale_text_from_number(frag.value.data.p[i],16,-2));
-			return gale_text_concat(2,r,G_("]"));
+			struct gale_text_builder r = null_builder;
+			gale_text_append(&r,G_("["));
+			for (i = 0; i < frag.value.data.l; ++i) {
+				if (i) gale_text_append(&r,G_(" "));
+				gale_text_append(&r,gale_text_from_number(
+					frag.value.data.p[i],16,-2));
+			}
+			gale_text_append(&r,G_("]"));
+			return gale_text_build(&r);
 		}
 
 		frag.value.data = gale_crypto_hash((d = frag.value.data));
@@ -369,15 +612,17 @@ struct gale_text gale_print_fragment(struct gale_fragment frag,int indent) {
 }
 
 struct gale_text gale_print_group(struct gale_group grp,int indent) {
-	struct gale_text i = null_text,t = null_text;
+	struct gale_text i = null_text;
+	struct gale_text_builder t = null_builder;
 
 	while (!gale_group_null(grp))
 	{
 		struct gale_fragment frag = gale_group_first(grp);
-		t = gale_text_concat(5,
-			t,i,frag.name,G_(": "),
-			gale_print_fragment(frag,
-				i.l + indent + frag.name.l + 2));
+		gale_text_append(&t,i);
+		gale_text_append(&t,frag.name);
+		gale_text_append(&t,G_(": "));
+		gale_text_append(&t,gale_print_fragment(frag,
+			i.l + indent + frag.name.l + 2));
 		grp = gale_group_rest(grp);
 		if (indent >= 0) {
 			wch *ch;
@@ -388,7 +633,7 @@ struct gale_text gale_print_group(struct gale_group grp,int indent) {
 			ch[0] = '\n';
 		}
 	}
-	return t;
+	return gale_text_build(&t);
 }
 
 int gale_fragment_compare(struct gale_fragment a,struct gale_fragment b) {
@@ -422,3 +667,126 @@ int gale_group_compare(struct gale_group a,struct gale_group b) {
 	if (0 != i) return i;
 	return gale_group_compare(gale_group_rest(a),gale_group_rest(b));
 }
+
+/* Output for gale_write_group(): small items are collected in a buffer,
+   large data values are passed straight through. */
+struct writer {
+	void (*func)(struct gale_data,void *);
+	void *user;
+	struct gale_data buf;
+	byte space[1024];
+};
+
+static void flush(struct writer *w) {
+	if (0 != w->buf.l) w->func(w->buf,w->user);
+	w->buf.p = w->space;
+	w->buf.l = 0;
+}
+
+static void reserve(struct writer *w,size_t len) {
+	assert(len <= sizeof(w->space));
+	if (w->buf.l + len > sizeof(w->space)) flush(w);
+}
+
+static void write_text(struct writer *w,struct gale_text text) {
+	while (0 != text.l) {
+		struct gale_text part = text;
+		const size_t room = (sizeof(w->space) - w->buf.l) / gale_wch_size();
+		if (0 == room) {
+			flush(w);
+			continue;
+		}
+
+		if (part.l > room) part.l = room;
+		gale_pack_text_len(&w->buf,part);
+		text.p += part.l;
+		text.l -= part.l;
+	}
+}
+
+static void write_data(struct writer *w,struct gale_data data) {
+	if (data.l <= sizeof(w->space) / 4) {
+		reserve(w,data.l);
+		gale_pack_copy(&w->buf,data.p,data.l);
+	} else {
+		flush(w);
+		w->func(data,w->user);
+	}
+}
+
+static void write_group(struct writer *w,struct gale_group group);
+
+static void write_fragment(struct writer *w,struct gale_fragment frag) {
+	size_t len = gale_text_size(frag.name);
+
+	reserve(w,3 * gale_u32_size());
+	switch (frag.type) {
+	case frag_text:
+		gale_pack_u32(&w->buf,fragment_text);
+		gale_pack_u32(&w->buf,len + gale_text_len_size(frag.value.text));
+		break;
+	case frag_data:
+		gale_pack_u32(&w->buf,fragment_data);
+		gale_pack_u32(&w->buf,len + frag.value.data.l);
+		break;
+	case frag_time:
+		gale_pack_u32(&w->buf,fragment_time);
+		gale_pack_u32(&w->buf,len + gale_time_size());
+		break;
+	case frag_number:
+		gale_pack_u32(&w->buf,fragment_number);
+		gale_pack_u32(&w->buf,len + gale_u32_size());
+		break;
+	case frag_group:
+		gale_pack_u32(&w->buf,fragment_group);
+		gale_pack_u32(&w->buf,len + gale_group_size(frag.value.group));
+		break;
+	default:
+		assert(0);
+	}
+
+	gale_pack_u32(&w->buf,frag.name.l);
+	write_text(w,frag.name);
+
+	switch (frag.type) {
+	case frag_text:
+		write_text(w,frag.value.text);
+		break;
+	case frag_data:
+		write_data(w,frag.value.data);
+		break;
+	case frag_time:
+		reserve(w,gale_time_size());
+		gale_pack_time(&w->buf,frag.value.time);
+		break;
+	case frag_number:
+		reserve(w,gale_u32_size());
+		gale_pack_u32(&w->buf,(u32) frag.value.number);
+		break;
+	case frag_group:
+		write_group(w,frag.value.group);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static void write_group(struct writer *w,struct gale_group group) {
+	while (!gale_group_null(group)) {
+		write_fragment(w,gale_group_first(group));
+		group = gale_group_rest(group);
+	}
+}
+
+void gale_write_group(
+	struct gale_group group,
+	void (*func)(struct gale_data,void *),void *user)
+{
+	struct writer w;
+	w.func = func;
+	w.user = user;
+	w.buf.p = w.space;
+	w.buf.l = 0;
+	write_group(&w,group);
+	flush(&w);
+}
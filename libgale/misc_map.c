@@ -1,34 +1,91 @@
 #include "gale/misc.h"
+#include "thread_i.h"
 
 #include <assert.h>
 
+/* Maps come in two flavors.  Ordinary maps are hash tables; ordered maps
+   are binary trees which keep their keys sorted for gale_map_walk().
+
+   Hash table chains are kept sorted by (hash,key), and a key's bucket is
+   the top bits of its hash, so the whole table is sorted by (hash,key).
+   That order doesn't depend on the table size, so walks can resume after
+   any key even if the table has been modified (and resized) in between.
+   The empty key hashes to zero, so it sorts first, as it does in an
+   ordered map.
+
+   Every change to a map's structure bumps its generation number.  Cursors
+   continue directly from their last node unless the generation changed,
+   in which case they find their place again by key. */
+
+#define MIN_BITS 3
+
 struct wt_node {
 	struct gale_data key;
 	struct gale_ptr *data;
 	struct wt_node *left,*right;
 };
 
+struct hash_node {
+	struct gale_data key;
+	struct gale_ptr *data;
+	u32 hash;
+	struct hash_node *next;
+};
+
 struct gale_map {
+	int weak,ordered;
+	unsigned long generation;
 	struct wt_node *root;
-	int weak;
+	struct hash_node **table;
+	int bits,low;
+	size_t count;
 };
 
+/* Maps are used from worker threads too; the pools lock themselves, but
+   creating them is guarded here. */
+THREAD_LOCK(slab_lock);
+static struct gale_slab *node_slab = NULL;
+static struct gale_slab *hash_slab = NULL;
+
+static struct gale_map *make_map(int weak,int ordered) {
+	struct gale_map *map;
+	gale_create(map);
+	map->weak = weak;
+	map->ordered = ordered;
+	map->generation = 0;
+	map->root = NULL;
+	map->table = NULL;
+	map->bits = 0;
+	map->low = 0;
+	map->count = 0;
+	if (!ordered) {
+		int i;
+		map->bits = MIN_BITS;
+		gale_create_array(map->table,1 << map->bits);
+		for (i = 0; i < (1 << map->bits); ++i) map->table[i] = NULL;
+	}
+	return map;
+}
+
 struct gale_map *gale_make_map(int weak) {
-	struct gale_map *wt;
-	gale_create(wt);
-	wt->root = NULL;
-	wt->weak = weak;
-	return wt;
+	return make_map(weak,0);
 }
 
-static struct wt_node *distill(struct wt_node *node) {
+struct gale_map *gale_make_ordered_map(int weak) {
+	return make_map(weak,1);
+}
+
+/* -- ordered maps ---------------------------------------------------------- */
+
+static struct wt_node *distill(struct gale_map *wt,struct wt_node *node) {
 	struct wt_node **parent,*temp;
 
 	if (NULL == node) return NULL;
 	if (NULL != gale_get_ptr(node->data)) return node;
-	if (NULL == (node->right = distill(node->right)))
-		return distill(node->left);
-	if (NULL == (node->left = distill(node->left)))
+	++wt->generation;
+	if (NULL == (node->right = distill(wt,node->right)))
+		return distill(wt,node->left);
+	if (NULL == (node->left = distill(wt,node->left)))
 		return node->right;
 
 	parent = &node->left;
@@ -39,12 +96,12 @@ static struct wt_node *distill(struct wt_node *node) {
 	*parent = temp->left;
 	temp->left = node->left;
 	temp->right = node->right;
-	return distill(temp);
+	return distill(wt,temp);
 }
 
 static struct wt_node **find(struct gale_map *wt,struct gale_data key) {
 	struct wt_node **p = &wt->root;
-	while (NULL != (*p = distill(*p))) {
+	while (NULL != (*p = distill(wt,*p))) {
 		const int x = gale_data_compare(key,(*p)->key);
 		if (x < 0)
 			p = &(*p)->left;
@@ -57,58 +114,361 @@ static struct wt_node **find(struct gale_map *wt,struct gale_data key) {
 	return p;
 }
 
-void gale_map_add(struct gale_map *wt,struct gale_data key,void *data) {
+static void tree_add(struct gale_map *wt,struct gale_data key,void *data) {
 	struct wt_node *new = NULL,**p;
 
-	if (NULL != data) gale_create(new); /* This must happen first! */
+	thread_lock(slab_lock);
+	if (NULL == node_slab)
+		node_slab = gale_make_slab(G_("map node"),sizeof(*new));
+	thread_unlock(slab_lock);
+	if (NULL != data) gale_slab_create(node_slab,new); /* First! */
 	p = find(wt,key);
 
-	if (NULL != *p) 
+	if (NULL != *p)
 		new = *p;
-	else if (NULL == data) 
+	else if (NULL == data)
 		return;
 	else {
 		new->key = key;
 		new->left = NULL;
 		new->right = NULL;
+		++wt->generation;
 	}
 
 	new->data = (NULL == data) ? NULL
 	          : (wt->weak ? gale_make_weak : gale_make_ptr)(data);
-	*p = distill(new);
-}
-
-void *gale_map_find(const struct gale_map *wt,struct gale_data key) {
-	struct wt_node *n = *(find((struct gale_map *) wt,key));
-	return n ? gale_get_ptr(n->data) : NULL;
+	*p = distill(wt,new);
 }
 
 static int walk(
+	struct gale_map *wt,
 	struct wt_node *node,
 	const struct gale_data *after,
-	struct gale_data *key,void **data) 
+	struct gale_data *key,void **data)
 {
 	int x;
 	if (NULL == node) return 0;
 	x = after ? gale_data_compare(*after,node->key) : -1;
 
 	if (x < 0) {
-		node->left = distill(node->left);
-		if (walk(node->left,after,key,data)) return 1;
+		node->left = distill(wt,node->left);
+		if (walk(wt,node->left,after,key,data)) return 1;
 		if (NULL != data) *data = gale_get_ptr(node->data);
 		if (NULL != key) *key = node->key;
 		return 1;
 	}
 
-	node->right = distill(node->right);
-	return walk(node->right,after,key,data);
+	node->right = distill(wt,node->right);
+	return walk(wt,node->right,after,key,data);
+}
+
+/* -- hashed maps ----------------------------------------------------------- */
+
+static u32 hash(struct gale_data key) {
+	u32 h = 2166136261u;
+	size_t i;
+	if (0 == key.l) return 0;
+	for (i = 0; i < key.l; ++i) h = (h ^ key.p[i]) * 16777619u;
+	return (0 == h) ? 1 : h;
+}
+
+static int bucket(const struct gale_map *map,u32 h) {
+	return h >> (32 - map->bits);
+}
+
+static int order(u32 h,struct gale_data key,const struct hash_node *node) {
+	if (h != node->hash) return (h < node->hash) ? -1 : 1;
+	return gale_data_compare(key,node->key);
+}
+
+/* Unlink a node; the caller is responsible for the count. */
+static struct hash_node *unlink_node(struct gale_map *map,struct hash_node **p) {
+	struct hash_node *node = *p;
+	++map->generation;
+	*p = node->next;
+	gale_slab_free(hash_slab,node);
+	return *p;
+}
+
+/* Find the first live node >= (h,key) in its chain, pruning dead ones. */
+static struct hash_node **lookup(struct gale_map *map,u32 h,struct gale_data key) {
+	struct hash_node **p = &map->table[bucket(map,h)];
+	while (NULL != *p) {
+		if (NULL == gale_get_ptr((*p)->data)) {
+			unlink_node(map,p);
+			--map->count;
+		} else if (order(h,key,*p) <= 0)
+			break;
+		else
+			p = &(*p)->next;
+	}
+	return p;
+}
+
+static void resize(struct gale_map *map,int bits) {
+	struct hash_node **old = map->table;
+	const int old_size = 1 << map->bits;
+	struct hash_node ***tail;
+	int i;
+
+	gale_create_array(map->table,1 << bits);
+	gale_create_array(tail,1 << bits);
+	for (i = 0; i < (1 << bits); ++i) {
+		map->table[i] = NULL;
+		tail[i] = &map->table[i];
+	}
+
+	/* Walking in order and appending keeps every chain sorted. */
+	++map->generation;
+	map->bits = bits;
+	map->low = 0;
+	map->count = 0;
+	for (i = 0; i < old_size; ++i) {
+		struct hash_node *node = old[i];
+		while (NULL != node) {
+			struct hash_node * const next = node->next;
+			if (NULL == gale_get_ptr(node->data))
+				gale_slab_free(hash_slab,node);
+			else {
+				const int b = bucket(map,node->hash);
+				node->next = NULL;
+				*tail[b] = node;
+				tail[b] = &node->next;
+				++map->count;
+			}
+			node = next;
+		}
+	}
+}
+
+static void hash_add(struct gale_map *map,struct gale_data key,void *data) {
+	const u32 h = hash(key);
+	struct hash_node *new = NULL,**p;
+
+	thread_lock(slab_lock);
+	if (NULL == hash_slab)
+		hash_slab = gale_make_slab(G_("map entry"),sizeof(*new));
+	thread_unlock(slab_lock);
+	if (NULL != data) gale_slab_create(hash_slab,new); /* First! */
+	p = lookup(map,h,key);
+
+	if (NULL != *p && 0 == order(h,key,*p)) {
+		gale_slab_free(hash_slab,new);
+		if (NULL == data) {
+			unlink_node(map,p);
+			--map->count;
+			if (map->bits > MIN_BITS
+			&&  map->count < ((size_t) 1 << map->bits) / 8)
+				resize(map,map->bits - 1);
+			return;
+		}
+		new = *p;
+	} else if (NULL == data)
+		return;
+	else {
+		new->key = key;
+		new->hash = h;
+		new->next = *p;
+		*p = new;
+		++map->count;
+		if (bucket(map,h) < map->low) map->low = bucket(map,h);
+	}
+
+	new->data = (map->weak ? gale_make_weak : gale_make_ptr)(data);
+	if (map->count > ((size_t) 1 << map->bits) && map->bits < 30)
+		resize(map,map->bits + 1);
+}
+
+/* Find the first live node > (h,key), or the first node if after is NULL. */
+static struct hash_node *next_node(struct gale_map *map,const struct gale_data *after) {
+	const int size = 1 << map->bits;
+	struct hash_node **p;
+	int b = map->low;
+
+	if (NULL != after) {
+		const u32 h = hash(*after);
+		b = bucket(map,h);
+		p = lookup(map,h,*after);
+		if (NULL != *p && 0 == order(h,*after,*p)) p = &(*p)->next;
+	} else if (b < size)
+		p = &map->table[b];
+	else
+		return NULL;
+
+	for (;;) {
+		while (NULL != *p) {
+			if (NULL != gale_get_ptr((*p)->data)) {
+				if (NULL == after) map->low = b;
+				return *p;
+			}
+			unlink_node(map,p);
+			--map->count;
+		}
+		if (++b == size) {
+			if (NULL == after) map->low = size;
+			return NULL;
+		}
+		p = &map->table[b];
+	}
+}
+
+/* Find the first live node at or after this one, without pruning. */
+static struct hash_node *scan(
+	const struct gale_map *map,
+	struct hash_node *node,int *b)
+{
+	const int size = 1 << map->bits;
+	for (;;) {
+		for (; NULL != node; node = node->next)
+			if (NULL != gale_get_ptr(node->data)) return node;
+		if (++*b >= size) return NULL;
+		node = map->table[*b];
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+void gale_map_add(struct gale_map *map,struct gale_data key,void *data) {
+	if (map->ordered)
+		tree_add(map,key,data);
+	else
+		hash_add(map,key,data);
+}
+
+void *gale_map_find(const struct gale_map *map,struct gale_data key) {
+	struct gale_map * const m = (struct gale_map *) map;
+	if (m->ordered) {
+		struct wt_node *n = *(find(m,key));
+		return n ? gale_get_ptr(n->data) : NULL;
+	} else {
+		const u32 h = hash(key);
+		struct hash_node *n = *(lookup(m,h,key));
+		if (NULL == n || 0 != order(h,key,n)) return NULL;
+		return gale_get_ptr(n->data);
+	}
 }
 
 int gale_map_walk(
-	const struct gale_map *wt,
+	const struct gale_map *map,
 	const struct gale_data *after,
-	struct gale_data *key,void **data) 
+	struct gale_data *key,void **data)
 {
-	((struct gale_map *) wt)->root = distill(wt->root);
-	return walk(wt->root,after,key,data);
+	struct gale_map * const m = (struct gale_map *) map;
+	struct hash_node *node;
+
+	if (m->ordered) {
+		m->root = distill(m,m->root);
+		return walk(m,m->root,after,key,data);
+	}
+
+	node = next_node(m,after);
+	if (NULL == node) return 0;
+	if (NULL != data) *data = gale_get_ptr(node->data);
+	if (NULL != key) *key = node->key;
+	return 1;
+}
+
+/* -- cursors --------------------------------------------------------------- */
+
+static void push(struct gale_map_cursor *cursor,struct wt_node *node) {
+	if (cursor->depth == cursor->alloc) {
+		void **old = cursor->stack;
+		cursor->alloc = cursor->alloc ? 2 * cursor->alloc : 16;
+		gale_create_array(cursor->stack,cursor->alloc);
+		memcpy(cursor->stack,old,cursor->depth * sizeof(*old));
+	}
+	cursor->stack[cursor->depth++] = node;
+}
+
+/* Rebuild the stack of pending ancestors from the root. */
+static void seek(struct gale_map_cursor *cursor) {
+	struct gale_map * const wt = (struct gale_map *) cursor->map;
+	struct wt_node *node;
+
+	cursor->depth = 0;
+	wt->root = distill(wt,wt->root);
+	node = wt->root;
+	while (NULL != node) {
+		if (!cursor->started 
+		||  gale_data_compare(cursor->key,node->key) < 0) {
+			push(cursor,node);
+			node = node->left;
+		} else
+			node = node->right;
+	}
+}
+
+static struct wt_node *tree_next(struct gale_map_cursor *cursor) {
+	struct wt_node *node,*child;
+	if (!cursor->started || cursor->generation != cursor->map->generation)
+		seek(cursor);
+
+	do {
+		if (0 == cursor->depth) return NULL;
+		node = (struct wt_node *) cursor->stack[--cursor->depth];
+		for (child = node->right; NULL != child; child = child->left)
+			push(cursor,child);
+	} while (NULL == gale_get_ptr(node->data));
+
+	return node;
+}
+
+static struct hash_node *hash_next(struct gale_map_cursor *cursor) {
+	struct gale_map * const map = (struct gale_map *) cursor->map;
+	struct hash_node *node;
+
+	if (!cursor->started)
+		node = next_node(map,NULL);
+	else if (cursor->generation != map->generation)
+		node = next_node(map,&cursor->key);
+	else {
+		node = (struct hash_node *) cursor->node;
+		return scan(map,node->next,&cursor->bucket);
+	}
+
+	if (NULL != node) cursor->bucket = bucket(map,node->hash);
+	return node;
+}
+
+void gale_map_begin(struct gale_map_cursor *cursor,const struct gale_map *map) {
+	cursor->map = map;
+	cursor->node = NULL;
+	cursor->generation = 0;
+	cursor->bucket = 0;
+	cursor->key = null_data;
+	cursor->started = 0;
+	cursor->stack = NULL;
+	cursor->depth = cursor->alloc = 0;
+}
+
+int gale_map_next(struct gale_map_cursor *cursor,struct gale_data *key,void **data) {
+	struct gale_data k;
+	struct gale_ptr *ptr;
+
+	if (cursor->map->ordered) {
+		struct wt_node * const node = tree_next(cursor);
+		if (NULL == node) return 0;
+		cursor->node = node;
+		k = node->key;
+		ptr = node->data;
+	} else {
+		struct hash_node * const node = hash_next(cursor);
+		if (NULL == node) return 0;
+		cursor->node = node;
+		k = node->key;
+		ptr = node->data;
+	}
+
+	cursor->key = k;
+	cursor->started = 1;
+	cursor->generation = cursor->map->generation;
+	if (NULL != key) *key = k;
+	if (NULL != data) *data = gale_get_ptr(ptr);
+	return 1;
+}
+
+int gale_map_empty(const struct gale_map *map) {
+	struct gale_map * const m = (struct gale_map *) map;
+	if (m->ordered) return NULL == (m->root = distill(m,m->root));
+	return 0 == m->count || NULL == next_node(m,NULL);
 }
@@ -47,13 +47,15 @@ void gale_report_remove(struct gale_report *rep,gale_report_call *func,void *dat
 
 struct gale_text gale_report_run(struct gale_report *rep) {
 	struct gale_map *tree = (struct gale_map *) rep;
-	struct gale_data key,*after = NULL;
+	struct gale_map_cursor cursor;
+	struct gale_data key;
 	struct gale_text ret;
 	int alloc = 0,len = 0;
 	wch *buffer = 0;
 	void *data;
 
-	while (gale_map_walk(tree,after,&key,&data))
+	gale_map_begin(&cursor,tree);
+	while (gale_map_next(&cursor,&key,&data))
 	{
 		struct entry *ent = (struct entry *) key.p;
 		struct gale_text text = ent->func(ent->data);
@@ -67,7 +69,6 @@ struct gale_text gale_report_run(struct gale_report *rep) {
 		}
 		memcpy(buffer + len,text.p,text.l * sizeof(wch));
 		len += text.l;
-		after = &key;
 	}
 
 	ret.p = buffer;
@@ -0,0 +1,202 @@
+#include "gale/misc.h"
+#include "gale/globals.h"
+#include "thread_i.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+/* Objects are carved out of chunks obtained from gale_malloc().  Each
+   object is preceded by a word pointing to its chunk, and each chunk keeps
+   its own free list (threaded through the objects' first words) and count
+   of objects in use.  Chunks with room are listed in the pool, and
+   allocation takes from the first of them, so the pool tends to fill the
+   same few chunks.  When the last object in a chunk is freed, the chunk
+   is given back with gale_free(), unless it's the only chunk with room.
+
+   In the garbage-collected build, a full chunk is also reclaimed once 
+   nothing points into it; objects which are simply dropped rather than
+   returned with gale_slab_free() are therefore still collected, just a 
+   chunk at a time.  Worker threads allocate from the same pools as the
+   event loop, so each pool has its own lock. */
+
+union align { void *p; double d; long l; };
+
+struct free_object { struct free_object *next; };
+
+struct chunk {
+	struct free_object *free;
+	char *fresh,*limit; /* objects never yet allocated */
+	size_t used;
+	struct chunk *prev,*next; /* among chunks with room */
+	union align objects[1];
+};
+
+struct gale_slab {
+	struct gale_text name;
+	size_t size,per_chunk; /* size includes the chunk pointer */
+	struct chunk *open;
+	struct gale_slab_stats stats;
+	struct gale_slab *link;
+#ifdef HAVE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+THREAD_LOCK(list_lock);
+static struct gale_slab **slab_list = NULL;
+
+/** Create a pool of fixed-size objects.
+ *  \param name Descriptive name for the objects (used in reports).
+ *  \param size Size of each object, in bytes.
+ *  \return The new allocator.
+ *  \sa gale_slab_alloc(), ::gale_slab_create */
+struct gale_slab *gale_make_slab(struct gale_text name,size_t size) {
+	const size_t unit = sizeof(union align);
+	struct gale_slab *slab = gale_malloc_safe(sizeof(*slab));
+
+	if (size < sizeof(struct free_object)) size = sizeof(struct free_object);
+	slab->name = name;
+	slab->size = unit * ((size + unit - 1) / unit);
+	slab->per_chunk = 4096 / (unit + slab->size);
+	if (slab->per_chunk < 16) slab->per_chunk = 16;
+	slab->open = NULL;
+	memset(&slab->stats,0,sizeof(slab->stats));
+	slab->stats.size = slab->size;
+	slab->size += unit;
+#ifdef HAVE_THREADS
+	pthread_mutex_init(&slab->lock,NULL);
+#endif
+
+	thread_lock(list_lock);
+	if (NULL == slab_list) {
+		slab_list = gale_malloc_safe(sizeof(*slab_list));
+		*slab_list = NULL;
+	}
+	slab->link = *slab_list;
+	*slab_list = slab;
+	thread_unlock(list_lock);
+	return slab;
+}
+
+/* Call these with the pool locked. */
+static void open_chunk(struct gale_slab *slab,struct chunk *chunk) {
+	chunk->prev = NULL;
+	chunk->next = slab->open;
+	if (NULL != slab->open) slab->open->prev = chunk;
+	slab->open = chunk;
+}
+
+static void close_chunk(struct gale_slab *slab,struct chunk *chunk) {
+	if (NULL != chunk->prev) chunk->prev->next = chunk->next;
+	else slab->open = chunk->next;
+	if (NULL != chunk->next) chunk->next->prev = chunk->prev;
+	chunk->prev = chunk->next = NULL;
+}
+
+static struct chunk *new_chunk(struct gale_slab *slab) {
+	struct chunk *chunk = gale_malloc(
+		offsetof(struct chunk,objects) + slab->size * slab->per_chunk);
+	chunk->free = NULL;
+	chunk->fresh = (char *) chunk->objects;
+	chunk->limit = chunk->fresh + slab->size * slab->per_chunk;
+	chunk->used = 0;
+	++slab->stats.chunks;
+	open_chunk(slab,chunk);
+	return chunk;
+}
+
+static struct chunk *chunk_of(void *obj) {
+	return *(struct chunk **) ((char *) obj - sizeof(union align));
+}
+
+/** Allocate an object from a pool.
+ *  The object is not initialized.
+ *  \param slab Pool from gale_make_slab().
+ *  \return Pointer to the new object. */
+void *gale_slab_alloc(struct gale_slab *slab) {
+	struct free_object *f;
+	struct chunk *chunk;
+
+	thread_lock(slab->lock);
+	++slab->stats.allocated;
+	chunk = slab->open;
+	if (NULL == chunk) chunk = new_chunk(slab);
+
+	if (NULL != chunk->free) {
+		f = chunk->free;
+		chunk->free = f->next;
+		f->next = NULL;
+		++slab->stats.reused;
+	} else {
+		*(struct chunk **) chunk->fresh = chunk;
+		f = (struct free_object *) (chunk->fresh + sizeof(union align));
+		chunk->fresh += slab->size;
+	}
+
+	if (NULL == chunk->free && chunk->fresh == chunk->limit) 
+		close_chunk(slab,chunk);
+	++chunk->used;
+	thread_unlock(slab->lock);
+	return f;
+}
+
+/** Return an object to its pool for reuse.
+ *  This is optional; objects which are no longer referenced will still be
+ *  garbage-collected.  Don't free an object which may still be in use!
+ *  \param slab Pool the object came from.
+ *  \param obj Object from gale_slab_alloc(). */
+void gale_slab_free(struct gale_slab *slab,void *obj) {
+	struct free_object *f = (struct free_object *) obj;
+	struct chunk *chunk;
+	if (NULL == obj) return;
+	chunk = chunk_of(obj);
+	/* Don't let stale contents keep garbage alive. */
+	memset(obj,0,slab->stats.size);
+	thread_lock(slab->lock);
+	++slab->stats.freed;
+	if (NULL == chunk->free && chunk->fresh == chunk->limit) 
+		open_chunk(slab,chunk);
+	f->next = chunk->free;
+	chunk->free = f;
+	if (0 == --chunk->used && (slab->open != chunk || NULL != chunk->next)) {
+		close_chunk(slab,chunk);
+		gale_free(chunk);
+		++slab->stats.released;
+	}
+	thread_unlock(slab->lock);
+}
+
+/** Get statistics for a pool.
+ *  \param slab Pool from gale_make_slab().
+ *  \param stats Structure to fill in. */
+void gale_slab_stats(const struct gale_slab *slab,struct gale_slab_stats *stats) {
+	*stats = slab->stats;
+}
+
+/** \internal Report generator for all pools. */
+struct gale_text _gale_slab_report(void *x) {
+	struct gale_text_accumulator accum = null_accumulator;
+	const struct gale_slab *slab;
+
+	thread_lock(list_lock);
+	for (slab = slab_list ? *slab_list : NULL; NULL != slab; slab = slab->link)
+		gale_text_accumulate(&accum,gale_text_concat(15,
+			G_("slab "),slab->name,
+			G_(": size="),
+			gale_text_from_number(slab->stats.size,10,0),
+			G_(", chunks="),
+			gale_text_from_number(slab->stats.chunks,10,0),
+			G_(", released="),
+			gale_text_from_number(slab->stats.released,10,0),
+			G_(", allocated="),
+			gale_text_from_number(slab->stats.allocated,10,0),
+			G_(", reused="),
+			gale_text_from_number(slab->stats.reused,10,0),
+			G_(", freed="),
+			gale_text_from_number(slab->stats.freed,10,0),
+			G_("\n")));
+	thread_unlock(list_lock);
+
+	return gale_text_collect(&accum);
+}
@@ -6,6 +6,7 @@
 
 const struct gale_text null_text = { NULL, 0 };
 const struct gale_text_accumulator null_accumulator = { 0, { } };
+const struct gale_text_builder null_builder = { NULL, 0, 0 };
 
 /** Concatenate text strings.
  *  The first argument \a count is the number of strings passed.
@@ -18,18 +19,23 @@ const struct gale_text_accumulator null_accumulator = { 0, { } };
  *  assert(0 == gale_text_compare(foobar,G_("foo [hi hi] bar")));
  *  \endcode */
 struct gale_text gale_text_concat(int count,...) {
-	size_t len = 0,alloc = 30;
-	wch *buffer = gale_malloc(alloc * sizeof(*buffer));
+	size_t len = 0;
+	wch *buffer;
 	struct gale_text text;
 	va_list ap;
+	int i;
 
+	/* first, count */
 	va_start(ap,count);
-	while (count--) {
+	for (i = 0; i < count; ++i) len += va_arg(ap,struct gale_text).l;
+	va_end(ap);
+	buffer = gale_malloc_atomic(len * sizeof(*buffer));
+
+	/* then, copy */
+	len = 0;
+	va_start(ap,count);
+	for (i = 0; i < count; ++i) {
 		text = va_arg(ap,struct gale_text);
-		if (text.l + len > alloc) {
-			alloc = (text.l + len) * 2;
-			buffer = gale_realloc(buffer,alloc * sizeof(*buffer));
-		}
 		memcpy(buffer + len,text.p,text.l * sizeof(*buffer));
 		len += text.l;
 	}
@@ -65,6 +71,38 @@ struct gale_text gale_text_concat_array(int count,struct gale_text *array) {
 	return ret;
 }
 
+/** Append text to a builder.
+ *  The builder's buffer grows geometrically, so building a string
+ *  piece by piece takes time proportional to its final length.
+ *  \param builder Builder to append to (start with ::null_builder).
+ *  \param text Text to append. */
+void gale_text_append(struct gale_text_builder *builder,struct gale_text text) {
+	if (builder->len + text.l > builder->alloc) {
+		wch *old = builder->buffer;
+		builder->alloc = 2 * (builder->len + text.l);
+		if (builder->alloc < 30) builder->alloc = 30;
+		builder->buffer = gale_malloc_atomic(
+			builder->alloc * sizeof(*builder->buffer));
+		if (NULL != old)
+			memcpy(builder->buffer,old,builder->len * sizeof(*old));
+	}
+
+	memcpy(builder->buffer + builder->len,text.p,text.l * sizeof(*text.p));
+	builder->len += text.l;
+}
+
+/** Return the text in a builder.
+ *  The text is not copied.  It remains valid (and unchanged) if more 
+ *  text is appended to the builder afterwards.
+ *  \param builder Builder to collect text from.
+ *  \return All the text appended to the builder. */
+struct gale_text gale_text_build(const struct gale_text_builder *builder) {
+	struct gale_text text;
+	text.p = builder->buffer;
+	text.l = builder->len;
+	return text;
+}
+
 /** Append text to an accumulator.
  *  \param accum Accumulator to append to.
  *  \param text Text to append to the accumulator. */
@@ -0,0 +1,44 @@
+#ifndef THREAD_I_H
+#define THREAD_I_H
+
+#include "gale/config.h"
+
+/* Internal locking for data shared with worker threads.  Without thread
+   support (configure --enable-threads), these all compile to nothing. */
+
+#ifdef HAVE_THREADS
+
+#include <pthread.h>
+
+#define THREAD_LOCK(name) static pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#define thread_lock(name) pthread_mutex_lock(&(name))
+#define thread_unlock(name) pthread_mutex_unlock(&(name))
+
+/* Nonzero iff the calling thread is one of the crypto workers. */
+int thread_i_is_worker(void);
+
+/* Deliver alerts raised by worker threads.  Call from the event loop. */
+void thread_i_flush_alerts(void);
+
+/* While a thread is collecting, its alerts (other than fatal ones) go on
+   the list instead; thread_i_report() raises them again from whichever
+   thread calls it, in order.  Collect into NULL to stop. */
+struct thread_i_alerts {
+	struct error_message *head,*tail;
+};
+
+void thread_i_collect(struct thread_i_alerts *);
+void thread_i_report(struct thread_i_alerts *);
+
+#else
+
+#define THREAD_LOCK(name) extern int thread_i_unused
+#define thread_lock(name) ((void) 0)
+#define thread_unlock(name) ((void) 0)
+
+#define thread_i_is_worker() 0
+#define thread_i_flush_alerts() ((void) 0)
+
+#endif
+
+#endif
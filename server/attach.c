@@ -37,7 +37,7 @@ static struct gale_text attach_report(void *d) {
 
 static void *on_will_packet(struct gale_packet *pkt,void *x) {
 	struct attach *att = (struct attach *) x;
-	link_will(att->link,pkt);
+	if (NULL != pkt) link_will(att->link,pkt);
 	return OOP_CONTINUE;
 }
 
@@ -67,21 +67,19 @@ static void *on_empty(struct attach *att,void *d) {
 static struct gale_packet *cat_filter(struct gale_packet *msg,void *d) {
 	struct directed *dir = (struct directed *) d;
 	struct gale_packet *rewrite;
-	struct gale_text cat = null_text;
-	int do_transmit = 0;
+	struct gale_text_builder routing = null_builder;
+	const struct gale_category *cat;
+	int i,count,do_transmit = 0;
 
 	gale_create(rewrite);
-	rewrite->routing = null_text;
 	rewrite->content = msg->content;
-	while (gale_text_token(msg->routing,':',&cat)) {
-		struct gale_text base,host;
-		int orig_flag;
-		int flag = is_directed(cat,&orig_flag,&base,&host) && orig_flag
-			&& !gale_text_compare(host,dir->host);
-		base = category_escape(base,flag);
+	cat = gale_packet_categories(msg,&count);
+	for (i = 0; i < count; ++i) {
+		int flag = cat[i].directed && cat[i].flag
+			&& !gale_text_compare(cat[i].host,dir->host);
 		do_transmit |= flag;
-                rewrite->routing = 
-			gale_text_concat(3,rewrite->routing,G_(":"),base);
+                gale_text_append(&routing,G_(":"));
+                gale_text_append(&routing,category_escape(cat[i].base,flag));
         }
 
 	if (!do_transmit) {
@@ -90,6 +88,7 @@ static struct gale_packet *cat_filter(struct gale_packet *msg,void *d) {
 	}
 
         /* strip leading colon */
+        rewrite->routing = gale_text_build(&routing);
         if (rewrite->routing.l > 0) 
 		rewrite->routing = gale_text_right(rewrite->routing,-1);
 	gale_dprintf(5,"*** \"%s\": rewrote categories to \"%s\"\n",
@@ -126,21 +125,14 @@ static void activate(oop_source *src,struct directed *dir) {
 int is_directed(struct gale_text cat,int *flag,
                 struct gale_text *base,struct gale_text *host) 
 {
-	struct gale_text base_buf,host_buf;
-	int flag_buf;
+	struct gale_category parsed;
+	gale_category_parse(cat,&parsed);
 
 	/* Allow NULL. */
-	if (NULL == base) base = &base_buf;
-	if (NULL == host) host = &host_buf;
-	if (NULL == flag) flag = &flag_buf;
-
-	*host = null_text;
-	*flag = category_flag(cat,base);
-	if (base->l < 1 || base->p[0] != '@') return 0;
-
-	gale_text_token(gale_text_right(*base,-1),'/',host);
-	if (host->l == base->l - 1) *base = gale_text_concat(2,*base,G_("/"));
-	return *flag;
+	if (NULL != base) *base = parsed.base;
+	if (NULL != host) *host = parsed.host;
+	if (NULL != flag) *flag = parsed.flag;
+	return parsed.directed && parsed.flag;
 }
 
 void sub_directed(oop_source *src,struct gale_text host) {
@@ -27,7 +27,7 @@
 int server_port;
 
 static void *on_error_packet(struct gale_packet *pkt,void *x) {
-	subscr_transmit((oop_source *) x,pkt,NULL);
+	if (NULL != pkt) subscr_transmit((oop_source *) x,pkt,NULL);
 	return OOP_CONTINUE;
 }
 
@@ -64,20 +64,18 @@ static void *on_incoming(oop_source *source,int fd,oop_event ev,void *user) {
 
 static struct gale_packet *link_filter(struct gale_packet *msg,void *x) {
 	struct gale_packet *rewrite;
-	struct gale_text cat = null_text;
-	int do_transmit = 0;
+	struct gale_text_builder routing = null_builder;
+	const struct gale_category *cat;
+	int i,count,do_transmit = 0;
 
 	gale_create(rewrite);
-	rewrite->routing = null_text;
 	rewrite->content = msg->content;
-	while (gale_text_token(msg->routing,':',&cat)) {
-		struct gale_text base;
-		int orig_flag;
-		int flag = !is_directed(cat,&orig_flag,&base,NULL) && orig_flag;
-		base = category_escape(base,flag);
+	cat = gale_packet_categories(msg,&count);
+	for (i = 0; i < count; ++i) {
+		int flag = !cat[i].directed && cat[i].flag;
 		do_transmit |= flag;
-		rewrite->routing = 
-			gale_text_concat(3,rewrite->routing,G_(":"),base);
+		gale_text_append(&routing,G_(":"));
+		gale_text_append(&routing,category_escape(cat[i].base,flag));
 	}
 
 	if (!do_transmit) {
@@ -86,6 +84,7 @@ static struct gale_packet *link_filter(struct gale_packet *msg,void *x) {
 	}
 
 	/* strip leading colon */
+	rewrite->routing = gale_text_build(&routing);
 	if (rewrite->routing.l > 0)
 		rewrite->routing = gale_text_right(rewrite->routing,-1);
 
@@ -33,6 +33,7 @@ static wch null = 0;
 static const struct gale_text empty = { &null,0 };
 static struct node root = { { &null,0 },NULL,NULL,0,0,NULL };
 static struct sub_connect *list = NULL;
+static struct gale_slab *connect_slab = NULL;
 
 static void add(struct node *ptr,struct gale_text spec,struct sub *sub) {
 	struct node *child,*node;
@@ -188,14 +189,19 @@ static void subscr(oop_source *src,struct gale_text spec,struct connect *link,
 {
 	struct gale_text cat = null_text;
 	struct sub sub;
-	sub.priority = 0;
-	gale_create(sub.connect);
-	sub.connect->stamp = stamp;
-	sub.connect->link = link;
 
 	/* easy escape */
 	if (!gale_text_compare(spec,G_("-"))) return;
 
+	if (NULL == connect_slab)
+		connect_slab = gale_make_slab(
+			G_("subscription"),sizeof(*sub.connect));
+
+	sub.priority = 0;
+	gale_slab_create(connect_slab,sub.connect);
+	sub.connect->stamp = stamp;
+	sub.connect->link = link;
+
 	gale_dprintf(3,"--- subscribing to all of \"%s\"\n",
 		gale_text_to(gale_global->enc_console,spec));
 
@@ -205,19 +211,9 @@ static void subscr(oop_source *src,struct gale_text spec,struct connect *link,
 		func(&root,base,&sub);
 		++sub.priority;
 	}
-}
-
-int category_flag(struct gale_text cat,struct gale_text *base) {
-	if (cat.l > 0 && cat.p[0] == '+') {
-		*base = gale_text_right(cat,-1);
-		return 1;
-	} else if (cat.l > 0 && cat.p[0] == '-') {
-		*base = gale_text_right(cat,-1);
-		return 0;
-	}
 
-	*base = cat;
-	return 1;
+	/* Removal only uses this to match existing entries. */
+	if (do_remove == func) gale_slab_free(connect_slab,sub.connect);
 }
 
 struct gale_text category_escape(struct gale_text cat,int flag) {
@@ -268,33 +264,29 @@ void subscr_transmit(
 	oop_source *src,
 	struct gale_packet *msg,struct connect *avoid) 
 {
-	struct gale_text cat = null_text;
+	struct gale_text_builder routing = null_builder;
 	struct gale_packet *rewrite;
-	while (gale_text_token(msg->routing,':',&cat)) {
-		struct gale_text host;
-		if (is_directed(cat,NULL,NULL,&host)) 
-			send_directed(src,host);
-	}
+	int i,count;
+	const struct gale_category *cat = gale_packet_categories(msg,&count);
+
+	for (i = 0; i < count; ++i)
+		if (cat[i].directed && cat[i].flag) 
+			send_directed(src,cat[i].host);
 
 	++stamp;
 	assert(list == NULL);
-	cat = null_text;
 	gale_create(rewrite);
-	rewrite->routing = null_text;
 	rewrite->content = msg->content;
-	while (gale_text_token(msg->routing,':',&cat)) {
-		struct gale_text base,host;
-		int flag;
+	for (i = 0; i < count; ++i) {
 		gale_dprintf(3,"*** transmitting \"%s\"\n",
-		             gale_text_to(gale_global->enc_console,cat));
-		is_directed(cat,&flag,&base,&host);
-		transmit(&root,base,avoid,flag);
-		base = category_escape(base,1);
-		rewrite->routing = 
-			gale_text_concat(3,rewrite->routing,G_(":"),base);
+		             gale_text_to(gale_global->enc_console,cat[i].text));
+		transmit(&root,cat[i].base,avoid,cat[i].flag);
+		gale_text_append(&routing,G_(":"));
+		gale_text_append(&routing,category_escape(cat[i].base,1));
 	}
 
 	/* strip leading colon */
+	rewrite->routing = gale_text_build(&routing);
 	if (rewrite->routing.l > 0) 
 		rewrite->routing = gale_text_right(rewrite->routing,-1);
 